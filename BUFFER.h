@@ -26,27 +26,31 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 
 #include "SD.h"
 
+// img[] of smart, ui and ini should be at the same place,
+// and disk2.img[] should be after ini.img[0] and ini.img[1].
+
 #ifdef SDISK2P
+// 963 bytes in total
 union BUFFER2 {
 	struct {
-		uint8_t writebuf[350*3];
+		uint8_t writebuf[258*2+350];
 		struct FILE img[1];
 	} disk2;
 	struct {
-		uint8_t buf[350*3];
+		uint8_t buf[258*2+350];
 		struct FILE img[1];
 	} smart;
 	struct {
-		uint8_t buf[350*3];
+		uint8_t buf[258*2+350];
 		struct FILE img[1];
 	} sd;
 };
 #else
-// 2564 bytes in total
+// 2044 bytes in total
 union BUFFER2 {
 	struct {
 		uint8_t buf[512];	
-		uint8_t buf2[2052];
+		uint8_t buf2[1532];
 	} sd;
 	struct {
 		uint8_t buf[768];
@@ -54,8 +58,8 @@ union BUFFER2 {
 		struct FILE img[4];
 	} smart;
 	struct {
-		uint8_t writebuf[350*5];
-		uint8_t buf[232];
+		uint8_t writebuf[258*5+350];
+		uint8_t buf[82];
 		struct FILE img[2];
 	} disk2;
 	struct {
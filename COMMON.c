@@ -24,6 +24,7 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #include <avr/io.h>
 #include <avr/eeprom.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 #include <string.h>
 #include "BUFFER.h"
@@ -41,6 +42,11 @@ volatile uint16_t timerOneShot, timerOneShot2;
 // blink at 0.33 sec
 volatile uint8_t timerBlink = 0;
 
+#ifdef PROF
+uint16_t PROF_hist[PROF_KINDS][PROF_BUCKETS];
+uint16_t PROF_max[PROF_KINDS];
+#endif
+
 // initialize
 void COMMON_init(void)
 {
@@ -127,6 +133,9 @@ void COMMON_init(void)
 	TCC5.CTRLA = TC5_CLKSEL2_bm|TC5_CLKSEL1_bm|TC5_CLKSEL0_bm;			// prescaler : clk/1024
 	TCC5.INTCTRLA = 0;	// meddle level interrupt, but off for the time being
 	PMIC.CTRL = PMIC_LOLVLEN_bm;
+	// TCD5 free running, 8u sec a tick, to measure the card
+	TCD5.PER = 0xffff;
+	TCD5.CTRLA = TC5_CLKSEL2_bm|TC5_CLKSEL1_bm;			// prescaler : clk/256
 	if (mode == DISK2MODE)
 		for (uint8_t i = 0; i < 2; i++) buffer2.disk2.img[i].valid = 0;
 	else
@@ -134,6 +143,46 @@ void COMMON_init(void)
 #endif
 }
 
+#ifdef PROF
+// add a sample
+void PROF_add(uint8_t kind, uint16_t ticks)
+{
+	uint16_t *h = PROF_hist[kind];
+	uint8_t b = 0;
+
+	for (uint16_t t = ticks; t > 1; t >>= 1) b++;
+	// halve the counts rather than stop counting, the shape is kept
+	if (h[b] == 0xffff) for (uint8_t i = 0; i < PROF_BUCKETS; i++) h[i] >>= 1;
+	h[b]++;
+	if (ticks > PROF_max[kind]) PROF_max[kind] = ticks;
+}
+
+// upper bound of the bucket holding the percent-th sample, at most the maximum
+uint16_t PROF_percentile(uint8_t kind, uint8_t percent)
+{
+	uint32_t total = 0, sum = 0;
+	uint8_t b;
+
+	for (b = 0; b < PROF_BUCKETS; b++) total += PROF_hist[kind][b];
+	if (!total) return 0;
+	total = (total*percent+99)/100;
+	for (b = 0; b < PROF_BUCKETS-1; b++) {
+		sum += PROF_hist[kind][b];
+		if (sum >= total) break;
+	}
+	uint16_t ub = (uint16_t)((2UL<<b)-1);
+	return (ub < PROF_max[kind]) ? ub : PROF_max[kind];
+}
+#endif
+
+// run the tasks of a table in the order of priority, the highest first
+void COMMON_runTasks(const COMMON_TASK *tasks, uint8_t num)
+{
+	for (uint8_t i=0; i<num; i++) {
+		if (((COMMON_TASK)pgm_read_ptr(tasks+i))()) return;
+	}
+}
+
 uint32_t readmem_long(uint8_t *mem)
 {
 	return *(uint32_t *)mem;
@@ -26,10 +26,28 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 
 #include "SD.h"
 
+// a sector is captured as 350 raw nibbles into the current slot,
+// then packed into 258 bytes (6 bits per nibble)
+// a sector with a nibble that is not 6-and-2 is kept raw and written back at once
+// define DISK2_NOPACK to keep every sector raw, 350 bytes a slot, fewer slots in the same RAM
 #ifdef SDISK2P
+#ifdef DISK2_NOPACK
+#define DISK2_WRITE_BUF_NUM 2
+#else
 #define DISK2_WRITE_BUF_NUM 3
+#endif
 #else
-#define DISK2_WRITE_BUF_NUM 5
+#ifdef DISK2_NOPACK
+#define DISK2_WRITE_BUF_NUM 4
+#else
+#define DISK2_WRITE_BUF_NUM 6
+#endif
+#endif
+#define DISK2_RAW_LEN 350
+#ifdef DISK2_NOPACK
+#define DISK2_SLOT_LEN DISK2_RAW_LEN
+#else
+#define DISK2_SLOT_LEN 258
 #endif
 
 // mode : DISK2MODE | SMARTMODE
@@ -49,6 +67,29 @@ extern volatile uint8_t timerBlink;
 #define OFF_TIMER2 TCC5.INTCTRLA = 0;
 #endif
 
+// define to record latency histograms, shown by releasing PSW4 with PSW1 held
+// the ATmega328P has no free 16 bit timer, so UNISDISK only
+#ifndef SDISK2P
+//#define PROF
+#endif
+
+#ifdef PROF
+// log2 buckets of 8u sec ticks, bucket 0 holds 0-1 tick
+#define PROF_BUCKETS 16
+enum PROF_KIND {PROF_PREPARE, PROF_WRITEBACK, PROF_SMARTREAD, PROF_SMARTWRITE, PROF_SMARTOTHER, PROF_KINDS};
+extern uint16_t PROF_hist[PROF_KINDS][PROF_BUCKETS];
+extern uint16_t PROF_max[PROF_KINDS];
+#define PROF_BEGIN(t) uint16_t t = TCD5.CNT
+#define PROF_END(k, t) PROF_add((k), TCD5.CNT-(t))
+// add a sample
+void PROF_add(uint8_t kind, uint16_t ticks);
+// upper bound of the bucket holding the percent-th sample, at most the maximum
+uint16_t PROF_percentile(uint8_t kind, uint8_t percent);
+#else
+#define PROF_BEGIN(t)
+#define PROF_END(k, t)
+#endif
+
 #ifndef SDISK2P
 #define ON_PHASEINT PORTA.INTCTRL = PORT_INTLVL_LO_gc;
 #define OFF_PHASEINT { PORTA.INTCTRL = 0; }
@@ -92,6 +133,13 @@ extern struct FILE img[];
 // common initialization
 void COMMON_init(void);
 
+// a task of a main loop, return 1 if it has done some work
+typedef uint8_t (*COMMON_TASK)(void);
+
+// run the tasks of a table in flash in the order of priority, the highest first
+// the first one that has done some work ends the turn, so the ones above it are looked at first again
+void COMMON_runTasks(const COMMON_TASK *tasks, uint8_t num);
+
 // read a long word data from memory
 uint32_t readmem_long(uint8_t *mem);
 
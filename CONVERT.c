@@ -1,13 +1,203 @@
 ﻿/*
  * CONVERT.c
- *
+ * 6-and-2 encoding of Apple II disk sectors
  * Created: 2013/11/18 22:12:23
  *  Author: 浩一
  */
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
 
 #include <avr/io.h>
 #include <avr/pgmspace.h>
-#include "SD.h"
-#include "DISK2.h"
+#include "CONVERT.h"
+
+// swap the two bits of each 2 bit field of an auxiliary nibble
+// the swap goes through XOR, so the tables swap each nibble and the loops only the last one
+#define CONVERT_FLIP(x) ((((x)&0x15)<<1)|(((x)>>1)&0x15))
+
+// encode / decode table for a nib image
+#ifdef SDISK2P
+PROGMEM
+#endif
+const uint8_t CONVERT_encTable[] = {
+	0x96,0x97,0x9A,0x9B,0x9D,0x9E,0x9F,0xA6,
+	0xA7,0xAB,0xAC,0xAD,0xAE,0xAF,0xB2,0xB3,
+	0xB4,0xB5,0xB6,0xB7,0xB9,0xBA,0xBB,0xBC,
+	0xBD,0xBE,0xBF,0xCB,0xCD,0xCE,0xCF,0xD3,
+	0xD6,0xD7,0xD9,0xDA,0xDB,0xDC,0xDD,0xDE,
+	0xDF,0xE5,0xE6,0xE7,0xE9,0xEA,0xEB,0xEC,
+	0xED,0xEE,0xEF,0xF2,0xF3,0xF4,0xF5,0xF6,
+	0xF7,0xF9,0xFA,0xFB,0xFC,0xFD,0xFE,0xFF
+};
+
+// encTable of the auxiliary bits with their 2 bit fields swapped
+#ifdef SDISK2P
+PROGMEM
+#endif
+static const uint8_t CONVERT_encFlip[] = {
+	0x96,0x9A,0x97,0x9B,0xA7,0xAC,0xAB,0xAD,
+	0x9D,0x9F,0x9E,0xA6,0xAE,0xB2,0xAF,0xB3,
+	0xD6,0xD9,0xD7,0xDA,0xDF,0xE6,0xE5,0xE7,
+	0xDB,0xDD,0xDC,0xDE,0xE9,0xEB,0xEA,0xEC,
+	0xB4,0xB6,0xB5,0xB7,0xBD,0xBF,0xBE,0xCB,
+	0xB9,0xBB,0xBA,0xBC,0xCD,0xCF,0xCE,0xD3,
+	0xED,0xEF,0xEE,0xF2,0xF7,0xFA,0xF9,0xFB,
+	0xF3,0xF5,0xF4,0xF6,0xFC,0xFE,0xFD,0xFF
+};
+#ifdef SDISK2P
+#define CONVERT_ENCFLIP(x) pgm_read_byte_near(CONVERT_encFlip+(x))
+#else
+#define CONVERT_ENCFLIP(x) (CONVERT_encFlip[(x)])
+#endif
+
+// encTable of a byte shifted right by 2, indexed by the byte itself
+static PROGMEM const uint8_t CONVERT_encShift[] = {
+	0x96,0x96,0x96,0x96,0x97,0x97,0x97,0x97,0x9A,0x9A,0x9A,0x9A,0x9B,0x9B,0x9B,0x9B,
+	0x9D,0x9D,0x9D,0x9D,0x9E,0x9E,0x9E,0x9E,0x9F,0x9F,0x9F,0x9F,0xA6,0xA6,0xA6,0xA6,
+	0xA7,0xA7,0xA7,0xA7,0xAB,0xAB,0xAB,0xAB,0xAC,0xAC,0xAC,0xAC,0xAD,0xAD,0xAD,0xAD,
+	0xAE,0xAE,0xAE,0xAE,0xAF,0xAF,0xAF,0xAF,0xB2,0xB2,0xB2,0xB2,0xB3,0xB3,0xB3,0xB3,
+	0xB4,0xB4,0xB4,0xB4,0xB5,0xB5,0xB5,0xB5,0xB6,0xB6,0xB6,0xB6,0xB7,0xB7,0xB7,0xB7,
+	0xB9,0xB9,0xB9,0xB9,0xBA,0xBA,0xBA,0xBA,0xBB,0xBB,0xBB,0xBB,0xBC,0xBC,0xBC,0xBC,
+	0xBD,0xBD,0xBD,0xBD,0xBE,0xBE,0xBE,0xBE,0xBF,0xBF,0xBF,0xBF,0xCB,0xCB,0xCB,0xCB,
+	0xCD,0xCD,0xCD,0xCD,0xCE,0xCE,0xCE,0xCE,0xCF,0xCF,0xCF,0xCF,0xD3,0xD3,0xD3,0xD3,
+	0xD6,0xD6,0xD6,0xD6,0xD7,0xD7,0xD7,0xD7,0xD9,0xD9,0xD9,0xD9,0xDA,0xDA,0xDA,0xDA,
+	0xDB,0xDB,0xDB,0xDB,0xDC,0xDC,0xDC,0xDC,0xDD,0xDD,0xDD,0xDD,0xDE,0xDE,0xDE,0xDE,
+	0xDF,0xDF,0xDF,0xDF,0xE5,0xE5,0xE5,0xE5,0xE6,0xE6,0xE6,0xE6,0xE7,0xE7,0xE7,0xE7,
+	0xE9,0xE9,0xE9,0xE9,0xEA,0xEA,0xEA,0xEA,0xEB,0xEB,0xEB,0xEB,0xEC,0xEC,0xEC,0xEC,
+	0xED,0xED,0xED,0xED,0xEE,0xEE,0xEE,0xEE,0xEF,0xEF,0xEF,0xEF,0xF2,0xF2,0xF2,0xF2,
+	0xF3,0xF3,0xF3,0xF3,0xF4,0xF4,0xF4,0xF4,0xF5,0xF5,0xF5,0xF5,0xF6,0xF6,0xF6,0xF6,
+	0xF7,0xF7,0xF7,0xF7,0xF9,0xF9,0xF9,0xF9,0xFA,0xFA,0xFA,0xFA,0xFB,0xFB,0xFB,0xFB,
+	0xFC,0xFC,0xFC,0xFC,0xFD,0xFD,0xFD,0xFD,0xFE,0xFE,0xFE,0xFE,0xFF,0xFF,0xFF,0xFF
+};
+
+PROGMEM const uint8_t CONVERT_decTable[] = {
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x01,0x00,0x00,0x02,0x03,0x00,0x04,0x05,0x06,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x07,0x08,0x00,0x00,0x00,0x09,0x0a,0x0b,0x0c,0x0d,
+	0x00,0x00,0x0e,0x0f,0x10,0x11,0x12,0x13,0x00,0x14,0x15,0x16,0x17,0x18,0x19,0x1a,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x1b,0x00,0x1c,0x1d,0x1e,
+	0x00,0x00,0x00,0x1f,0x00,0x00,0x20,0x21,0x00,0x22,0x23,0x24,0x25,0x26,0x27,0x28,
+	0x00,0x00,0x00,0x00,0x00,0x29,0x2a,0x2b,0x00,0x2c,0x2d,0x2e,0x2f,0x30,0x31,0x32,
+	0x00,0x00,0x33,0x34,0x35,0x36,0x37,0x38,0x00,0x39,0x3a,0x3b,0x3c,0x3d,0x3e,0x3f
+};
+
+// decTable with the 2 bit fields swapped, for the auxiliary nibbles
+static PROGMEM const uint8_t CONVERT_decFlip[] = {
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x02,0x00,0x00,0x01,0x03,0x00,0x08,0x0a,0x09,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x0b,0x04,0x00,0x00,0x00,0x06,0x05,0x07,0x0c,0x0e,
+	0x00,0x00,0x0d,0x0f,0x20,0x22,0x21,0x23,0x00,0x28,0x2a,0x29,0x2b,0x24,0x26,0x25,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x27,0x00,0x2c,0x2e,0x2d,
+	0x00,0x00,0x00,0x2f,0x00,0x00,0x10,0x12,0x00,0x11,0x13,0x18,0x1a,0x19,0x1b,0x14,
+	0x00,0x00,0x00,0x00,0x00,0x16,0x15,0x17,0x00,0x1c,0x1e,0x1d,0x1f,0x30,0x32,0x31,
+	0x00,0x00,0x33,0x38,0x3a,0x39,0x3b,0x34,0x00,0x36,0x35,0x37,0x3c,0x3e,0x3d,0x3f
+};
+
+// decTable shifted left by 2, for the upper 6 bits
+static PROGMEM const uint8_t CONVERT_decShift[] = {
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x04,0x00,0x00,0x08,0x0c,0x00,0x10,0x14,0x18,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x1c,0x20,0x00,0x00,0x00,0x24,0x28,0x2c,0x30,0x34,
+	0x00,0x00,0x38,0x3c,0x40,0x44,0x48,0x4c,0x00,0x50,0x54,0x58,0x5c,0x60,0x64,0x68,
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x6c,0x00,0x70,0x74,0x78,
+	0x00,0x00,0x00,0x7c,0x00,0x00,0x80,0x84,0x00,0x88,0x8c,0x90,0x94,0x98,0x9c,0xa0,
+	0x00,0x00,0x00,0x00,0x00,0xa4,0xa8,0xac,0x00,0xb0,0xb4,0xb8,0xbc,0xc0,0xc4,0xc8,
+	0x00,0x00,0xcc,0xd0,0xd4,0xd8,0xdc,0xe0,0x00,0xe4,0xe8,0xec,0xf0,0xf4,0xf8,0xfc
+};
+
+// encode a 256 byte sector into 343 disk nibbles (342 data + checksum)
+void CONVERT_encode(const uint8_t *src, uint8_t *dst)
+{
+	uint8_t i, x, ox = 0;
+
+	// 86 auxiliary nibbles, made of the low 2 bits of 3 bytes
+	for (i = 0; i < 84; i++) {
+		x = ((src[i]&3)|((src[i+86]&3)<<2)|((src[i+172]&3)<<4));
+		dst[i] = CONVERT_ENCFLIP(x^ox);
+		ox = x;
+	}
+	for (; i < 86; i++) {
+		x = ((src[i]&3)|((src[i+86]&3)<<2));
+		dst[i] = CONVERT_ENCFLIP(x^ox);
+		ox = x;
+	}
+	// 256 nibbles of the upper 6 bits, ox is the previous byte from now on
+	ox = (CONVERT_FLIP(ox)<<2);
+	dst += 86;
+	i = 0;
+	do {
+		x = src[i];
+		*(dst++) = pgm_read_byte_near(CONVERT_encShift+(x^ox));
+		ox = x;
+	} while (++i);
+	// checksum
+	*dst = pgm_read_byte_near(CONVERT_encShift+ox);
+}
 
+// decode 343 disk nibbles into a 256 byte sector
+// return 0 if the checksum matches
+uint8_t CONVERT_decode(const uint8_t *src, uint8_t *dst)
+{
+	uint8_t i, x = 0;
 
+	// 86 auxiliary nibbles, x keeps their bits swapped
+	for (i = 0; i < 84; i++) {
+		x ^= pgm_read_byte_near(CONVERT_decFlip+src[i]);
+		dst[i] = (x&3);
+		dst[i+86] = ((x>>2)&3);
+		dst[i+172] = (x>>4);
+	}
+	for (; i < 86; i++) {
+		x ^= pgm_read_byte_near(CONVERT_decFlip+src[i]);
+		dst[i] = (x&3);
+		dst[i+86] = ((x>>2)&3);
+	}
+	// 256 nibbles of the upper 6 bits, x keeps them in place
+	x = (CONVERT_FLIP(x)<<2);
+	src += 86;
+	i = 0;
+	do {
+		x ^= pgm_read_byte_near(CONVERT_decShift+*(src++));
+		dst[i] |= x;
+	} while (++i);
+	// checksum
+	return (x^pgm_read_byte_near(CONVERT_decShift+*src));
+}
@@ -0,0 +1,50 @@
+﻿/*
+ * CONVERT.h
+ * 6-and-2 encoding of Apple II disk sectors
+ * Created: 2013/11/18 22:12:23
+ *  Author: Koichi Nishida
+ */
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CONVERT_H_
+#define CONVERT_H_
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+// disk nibble encode table, in SRAM if there is room for it
+#ifdef SDISK2P
+extern PROGMEM const uint8_t CONVERT_encTable[];
+#define CONVERT_ENC(x) pgm_read_byte_near(CONVERT_encTable+(x))
+#else
+extern const uint8_t CONVERT_encTable[];
+#define CONVERT_ENC(x) (CONVERT_encTable[(x)])
+#endif
+
+// disk nibble decode table
+extern PROGMEM const uint8_t CONVERT_decTable[];
+#define CONVERT_DEC(x) pgm_read_byte_near(CONVERT_decTable+(x))
+
+// encode a 256 byte sector into 343 disk nibbles (342 data + checksum)
+void CONVERT_encode(const uint8_t *src, uint8_t *dst);
+
+// decode 343 disk nibbles into a 256 byte sector
+// return 0 if the checksum matches
+uint8_t CONVERT_decode(const uint8_t *src, uint8_t *dst);
+
+#endif /* CONVERT_H_ */
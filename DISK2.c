@@ -30,6 +30,9 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #include "COMMON.h"
 #include "BUFFER.h"
 #include "SD.h"
+#include "CONVERT.h"
+#include "TRACE.h"
+#include "HEAT.h"
 #ifndef SDISK2P
 #include "LCD.h"
 #include "UI.h"
@@ -59,6 +62,7 @@ uint8_t DISK2_tracks[DISK2_WRITE_BUF_NUM];		// for remembering written sectors &
 volatile uint8_t DISK2_WrtBuffNum;				// write buffer number
 volatile uint8_t *DISK2_writePtr;				// write buffer pointer
 volatile uint8_t DISK2_doBuffering;				// request write buffering
+uint8_t DISK2_rawSlot = 0xff;					// a slot not packed, 0xff : none
 volatile uint8_t DISK2_byteData;				// read byte
 volatile uint8_t DISK2_posBit;					// bit position of data read
 volatile uint8_t *DISK2_ptrByte;				// pointer for data read
@@ -66,43 +70,42 @@ volatile uint8_t *DISK2_ptrByte;				// pointer for data read
 // a table for head stepper motor movement
 PROGMEM const uint8_t DISK2_stepper_table[4] = {0x0f,0xed,0x03,0x21};
 
-// encode / decode table for a nib image
-PROGMEM const uint8_t DISK2_encTable[] = {
-	0x96,0x97,0x9A,0x9B,0x9D,0x9E,0x9F,0xA6,
-	0xA7,0xAB,0xAC,0xAD,0xAE,0xAF,0xB2,0xB3,
-	0xB4,0xB5,0xB6,0xB7,0xB9,0xBA,0xBB,0xBC,
-	0xBD,0xBE,0xBF,0xCB,0xCD,0xCE,0xCF,0xD3,
-	0xD6,0xD7,0xD9,0xDA,0xDB,0xDC,0xDD,0xDE,
-	0xDF,0xE5,0xE6,0xE7,0xE9,0xEA,0xEB,0xEC,
-	0xED,0xEE,0xEF,0xF2,0xF3,0xF4,0xF5,0xF6,
-	0xF7,0xF9,0xFA,0xFB,0xFC,0xFD,0xFE,0xFF
+// for dsk2Nic
+PROGMEM const uint8_t DISK2_interwieve[] = {0,13,11,9,7,5,3,1,14,12,10,8,6,4,2,15};
+PROGMEM const uint8_t DISK2_deinterwieve[] = {0,7,14,6,13,5,12,4,11,3,10,2,9,1,8,15};
+
+// conversion groups, kept below buffer2.ui.img / buffer2.ini.img (1400 bytes)
+#define DISK2_CONV_SECTORS 4		// NIC sectors per multi block write
+#define DISK2_CONV_BLOCKS 2			// DSK blocks per multi block write
+
+// NIC sector framing, streamed around the address field and the data field
+PROGMEM const uint8_t DISK2_nicHead[] = {
+	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,						// 22 ffs
+	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+	0x03,0xfc,0xff,0x3f,0xcf,0xf3,0xfc,0xff,0x3f,0xcf,0xf3,0xfc,				// sync header
+	0xd5,0xaa,0x96																// address header
 };
-
-PROGMEM const int8_t DISK2_decTable[] = {
-	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+PROGMEM const uint8_t DISK2_nicHead2[] = {
+	0xde,0xaa,0xeb,																// address trailer
+	0xff,0xff,0xff,0xff,0xff,													// sync header
+	0xd5,0xaa,0xad																// data header
+};
+PROGMEM const uint8_t DISK2_nicTail[] = {
+	0xde,0xaa,0xeb,																// data trailer
+	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,		// 14 ffs
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,	// 96 zeros
 	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
 	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
 	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
 	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x01,0x00,0x00,0x02,0x03,0x00,0x04,0x05,0x06,
-	0x00,0x00,0x00,0x00,0x00,0x00,0x07,0x08,0x00,0x00,0x00,0x09,0x0a,0x0b,0x0c,0x0d,
-	0x00,0x00,0x0e,0x0f,0x10,0x11,0x12,0x13,0x00,0x14,0x15,0x16,0x17,0x18,0x19,0x1a,
-	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x1b,0x00,0x1c,0x1d,0x1e,
-	0x00,0x00,0x00,0x1f,0x00,0x00,0x20,0x21,0x00,0x22,0x23,0x24,0x25,0x26,0x27,0x28,
-	0x00,0x00,0x00,0x00,0x00,0x29,0x2a,0x2b,0x00,0x2c,0x2d,0x2e,0x2f,0x30,0x31,0x32,
-	0x00,0x00,0x33,0x34,0x35,0x36,0x37,0x38,0x00,0x39,0x3a,0x3b,0x3c,0x3d,0x3e,0x3f
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00
 };
 
-// for dsk2Nic
-PROGMEM const uint8_t DISK2_interwieve[] = {0,13,11,9,7,5,3,1,14,12,10,8,6,4,2,15};
-PROGMEM const uint8_t DISK2_flipBit[] = { 0,  2,  1,  3  };
-PROGMEM const uint8_t DISK2_flipBit1[] = { 0, 2,  1,  3  };
-PROGMEM const uint8_t DISK2_flipBit2[] = { 0, 8,  4,  12 };
-PROGMEM const uint8_t DISK2_flipBit3[] = { 0, 32, 16, 48 };
+#ifdef DISK2_NOPACK
+#define DISK2_RAW(bn) 1
+#else
+#define DISK2_RAW(bn) ((bn) == DISK2_rawSlot)
+#endif
 
 // buffer clear
 void DISK2_clearBuffer(void)
@@ -110,9 +113,9 @@ void DISK2_clearBuffer(void)
 	uint8_t i;
 	uint16_t j;
 	
-	for (i=0; i<DISK2_WRITE_BUF_NUM; i++)
-		for (j=0; j<350; j++)
-			buffer2.disk2.writebuf[i*350+j] = 0;
+	DISK2_rawSlot = 0xff;
+	for (j=0; j<(DISK2_WRITE_BUF_NUM-1)*DISK2_SLOT_LEN+DISK2_RAW_LEN; j++)
+		buffer2.disk2.writebuf[j] = 0;
 	for (i=0; i<DISK2_WRITE_BUF_NUM; i++)
 		DISK2_sectors[i] = DISK2_tracks[i] = 0xff;
 }
@@ -161,7 +164,7 @@ void DISK2_init(void)
 	DISK2_readPulse = 0;
 	DISK2_magState = 0;
 	DISK2_WrtBuffNum = 0;
-	DISK2_writePtr = &(buffer2.disk2.writebuf[DISK2_WrtBuffNum*350+0]);
+	DISK2_writePtr = &(buffer2.disk2.writebuf[DISK2_WrtBuffNum*DISK2_SLOT_LEN+0]);
 	DISK2_ptrByte = buffer1;
 	DISK2_posBit = 1;
 
@@ -204,10 +207,39 @@ void DISK2_moveHead()
 			if (phtrk > 196) phtrk = 0;	
 			if (phtrk > 139) phtrk = 139;
 			DISK2_ph_track[current_drive] = phtrk;	
+			TRACE_ADD(TRACE_HEAD, ((uint16_t)current_drive<<8)|phtrk);
 		}
 	}
 }
 
+// the 4-and-4 encoded volume, track, sector and checksum of an address field
+static void DISK2_addressField(uint8_t *adr, uint8_t volume, uint8_t track, uint8_t sector)
+{
+	uint8_t c = (volume^track^sector);
+
+	adr[0] = ((volume>>1)|0xaa);
+	adr[1] = (volume|0xaa);
+	adr[2] = ((track>>1)|0xaa);
+	adr[3] = (track|0xaa);
+	adr[4] = ((sector>>1)|0xaa);
+	adr[5] = (sector|0xaa);
+	adr[6] = ((c>>1)|0xaa);
+	adr[7] = (c|0xaa);
+}
+
+// write the NIC framing of a sector up to its data field to spi
+void DISK2_writeNicHeader(uint8_t volume, uint8_t track, uint8_t sector, uint8_t *err)
+{
+	uint8_t adr[8];
+
+	DISK2_addressField(adr, volume, track, sector);
+	SPI_writeBytes_P(DISK2_nicHead, sizeof(DISK2_nicHead), err);
+	if (*err) return;
+	SPI_writeBytes(adr, 8, err);
+	if (*err) return;
+	SPI_writeBytes_P(DISK2_nicHead2, sizeof(DISK2_nicHead2), err);
+}
+
 void DISK2_writeBackSub(uint8_t bn, uint8_t sc, uint8_t track)
 {
 	uint8_t c, err = 0;
@@ -218,65 +250,53 @@ void DISK2_writeBackSub(uint8_t bn, uint8_t sc, uint8_t track)
 	if (imgp) {
 		FILE_writeBegin(imgp, long_sector, &err);
 	
-		// 22 ffs
-		for (i = 0; i < 22; i++) {
-			SPI_writeByte(0xff, &err);
-		}
-
-		// sync header
-		SPI_writeByte(0x03, &err);
-		SPI_writeByte(0xfc, &err);
-		SPI_writeByte(0xff, &err);
-		SPI_writeByte(0x3f, &err);
-		SPI_writeByte(0xcf, &err);
-		SPI_writeByte(0xf3, &err);
-		SPI_writeByte(0xfc, &err);
-		SPI_writeByte(0xff, &err);
-		SPI_writeByte(0x3f, &err);
-		SPI_writeByte(0xcf, &err);
-		SPI_writeByte(0xf3, &err);
-		SPI_writeByte(0xfc, &err);
-
-		// address header
-		SPI_writeByte(0xd5, &err);
-		SPI_writeByte(0xAA, &err);
-		SPI_writeByte(0x96, &err);
-		SPI_writeByte((DISK2_volume[DISK2_currentDrive]>>1)|0xaa, &err);
-		SPI_writeByte(DISK2_volume[DISK2_currentDrive]|0xaa, &err);
-		SPI_writeByte((track>>1)|0xaa, &err);
-		SPI_writeByte(track|0xaa, &err);
-		SPI_writeByte((sc>>1)|0xaa, &err);
-		SPI_writeByte(sc|0xaa, &err);
-		c = (DISK2_volume[DISK2_currentDrive]^track^sc);
-		SPI_writeByte((c>>1)|0xaa, &err);
-		SPI_writeByte(c|0xaa, &err);
-		SPI_writeByte(0xde, &err);
-		SPI_writeByte(0xAA, &err);
-		SPI_writeByte(0xeb, &err);
-
-		// sync header
-		SPI_writeByte(0xff, &err);	
-		SPI_writeByte(0xff, &err);
-		SPI_writeByte(0xff, &err);
-		SPI_writeByte(0xff, &err);
-		SPI_writeByte(0xff, &err);
+		DISK2_writeNicHeader(DISK2_volume[DISK2_currentDrive], track, sc, &err);
 
 		// data
-		for (i = 0; i < 349; i++) {
-			c = buffer2.disk2.writebuf[bn*350+i];
-			SPI_writeByte(c, &err);
-		}
-		for (i = 0; i < 14; i++) {
-			SPI_writeByte(0xff, &err);
-		}
-		for (i = 0; i < 96; i++) {
-			SPI_writeByte(0, &err);
+		{
+			uint8_t *p = &buffer2.disk2.writebuf[bn*DISK2_SLOT_LEN];
+
+			// raw : the nibbles as captured after D5 AA AD
+			if (DISK2_RAW(bn)) SPI_writeBytes(p+3, 343, &err);
+			else for (i = 0; i < 86; i++, p += 3) {
+				SPI_writeByte(CONVERT_ENC(p[0]&0x3f), &err);
+				SPI_writeByte(CONVERT_ENC(p[1]&0x3f), &err);
+				SPI_writeByte(CONVERT_ENC(p[2]&0x3f), &err);
+				if (i == 85) break;
+				c = ((p[0]>>6)|((p[1]>>4)&0x0c)|((p[2]>>2)&0x30));
+				SPI_writeByte(CONVERT_ENC(c), &err);
+			}
 		}
+		SPI_writeBytes_P(DISK2_nicTail, sizeof(DISK2_nicTail), &err);
 	
 		FILE_writeEnd(&err);
 	}
 }
 
+// the first 412 bytes of the NIC sector of a slot into buffer1, as DISK2_writeBackSub writes it
+static void DISK2_slotSector(uint8_t bn, uint8_t sc, uint8_t track)
+{
+	uint8_t *d = buffer1, *p = &buffer2.disk2.writebuf[bn*DISK2_SLOT_LEN];
+
+	memcpy_P(d, DISK2_nicHead, sizeof(DISK2_nicHead));
+	d += sizeof(DISK2_nicHead);
+	DISK2_addressField(d, DISK2_volume[DISK2_currentDrive], track, sc);
+	d += 8;
+	memcpy_P(d, DISK2_nicHead2, sizeof(DISK2_nicHead2));
+	d += sizeof(DISK2_nicHead2);
+	if (DISK2_RAW(bn)) {
+		memcpy(d, p+3, 343);
+		d += 343;
+	} else for (uint8_t i = 0; i < 86; i++, p += 3) {
+		*d++ = CONVERT_ENC(p[0]&0x3f);
+		*d++ = CONVERT_ENC(p[1]&0x3f);
+		*d++ = CONVERT_ENC(p[2]&0x3f);
+		if (i == 85) break;
+		*d++ = CONVERT_ENC((p[0]>>6)|((p[1]>>4)&0x0c)|((p[2]>>2)&0x30));
+	}
+	memcpy_P(d, DISK2_nicTail, 412-(d-buffer1));
+}
+
 // write back into the SD card
 void DISK2_writeBack(void)
 {
@@ -284,156 +304,281 @@ void DISK2_writeBack(void)
 
 	for (j=0; j<DISK2_WRITE_BUF_NUM; j++) {
 		if (DISK2_sectors[j]!=0xff) {
+			PROF_BEGIN(t);
 			for (i=0; i<DISK2_WRITE_BUF_NUM; i++) {
-				if (DISK2_sectors[i] != 0xff)
+				if (DISK2_sectors[i] != 0xff) {
+					TRACE_ADD(TRACE_FLUSH, ((uint16_t)DISK2_tracks[i]<<8)|DISK2_sectors[i]);
+					HEAT_ADD(DISK2_currentDrive, HEAT_WRITTEN);
 					DISK2_writeBackSub(i, DISK2_sectors[i], DISK2_tracks[i]);
+				}
 				DISK2_sectors[i] = 0xff;
 				DISK2_tracks[i] = 0xff;
-				buffer2.disk2.writebuf[i*350+2]=0;
+				buffer2.disk2.writebuf[i*DISK2_SLOT_LEN+2]=0;
 			}
 			DISK2_WrtBuffNum = 0;
-			DISK2_writePtr = &(buffer2.disk2.writebuf[DISK2_WrtBuffNum*350+0]);
+			DISK2_writePtr = &(buffer2.disk2.writebuf[DISK2_WrtBuffNum*DISK2_SLOT_LEN+0]);
+			DISK2_rawSlot = 0xff;
+			PROF_END(PROF_WRITEBACK, t);
 			break;
 		}
 	}
 }
 
+// pack a captured data field (D5 AA AD + 343 nibbles) into 6 bits per nibble
+// 4 nibbles go into 3 bytes, written in place from the head of the slot
+// return 0 and leave the slot raw if a nibble is not 6-and-2
+uint8_t DISK2_packBuffer(uint8_t *p)
+{
+	uint8_t *src = p+3;
+	uint8_t a, b, c, d;
+
+	for (uint16_t i = 0; i < 343; i++)
+		if (CONVERT_ENC(CONVERT_DEC(src[i])) != src[i]) return 0;
+	for (uint8_t i = 0; i < 86; i++, src += 4, p += 3) {
+		a = CONVERT_DEC(src[0]);
+		b = CONVERT_DEC(src[1]);
+		c = CONVERT_DEC(src[2]);
+		d = ((i==85)?0:CONVERT_DEC(src[3]));
+		p[0] = (a|(d<<6));
+		p[1] = (b|((d<<4)&0xc0));
+		p[2] = (c|((d<<2)&0xc0));
+	}
+	return 1;
+}
+
 // set write pointer and write back if need
 void DISK2_writeBuffering(void)
 {	
 	static uint8_t sec;
+	uint8_t *slot = &buffer2.disk2.writebuf[DISK2_WrtBuffNum*DISK2_SLOT_LEN];
 
-	if (buffer2.disk2.writebuf[DISK2_WrtBuffNum*350+2]==0xAD) {
+	if (slot[2]==0xAD) {
 		if (!DISK2_formatting) {
+#ifndef DISK2_NOPACK
+			// a raw slot runs over the next one, so it is written back at once
+			if (!DISK2_packBuffer(slot)) DISK2_rawSlot = DISK2_WrtBuffNum;
+#endif
 			DISK2_sectors[DISK2_WrtBuffNum]=DISK2_sector;
 			DISK2_tracks[DISK2_WrtBuffNum]=(DISK2_ph_track[DISK2_currentDrive]>>2);		
 			DISK2_sector=((((DISK2_sector==0xf)||(DISK2_sector==0xd))?(DISK2_sector+2):(DISK2_sector+1))&0xf);
-			if (DISK2_WrtBuffNum == (DISK2_WRITE_BUF_NUM-1)) {
+			if ((DISK2_WrtBuffNum == (DISK2_WRITE_BUF_NUM-1)) || (DISK2_rawSlot != 0xff)) {
 				DISK2_writeBack();				
 			} else {
 				DISK2_WrtBuffNum++;
-				DISK2_writePtr = &(buffer2.disk2.writebuf[DISK2_WrtBuffNum*350+0]);
+				DISK2_writePtr = &(buffer2.disk2.writebuf[DISK2_WrtBuffNum*DISK2_SLOT_LEN+0]);
+				// the raw capture ran over into this slot, so forget its marker
+				DISK2_writePtr[2] = 0;
 			}
+			return;
 		} else {
 			DISK2_sector = sec;
 			DISK2_formatting = 0;
 		}
-	} if (buffer2.disk2.writebuf[DISK2_WrtBuffNum*350+2]==0x96) {
-		sec = (((buffer2.disk2.writebuf[DISK2_WrtBuffNum*350+7]&0x55)<<1) | (buffer2.disk2.writebuf[DISK2_WrtBuffNum*350+8]&0x55));
+	} if (slot[2]==0x96) {
+		sec = (((slot[7]&0x55)<<1) | (slot[8]&0x55));
 		DISK2_formatting = 1;
 	}
 }
 
-// run the DISK2 emulator
-int DISK2_run(uint8_t (*pf)(uint8_t))
-{	
+// prepare the next sector in buffer1 for the bit stream
+// a sector still in a slot is made from the slot, it is not read back from the card
+// the slots are of the current drive, they are written back when the other one is selected
+// return 1 if it is ready
+static uint8_t DISK2_prepareSector(void)
+{
+	uint8_t err = 0, bn;
+
+	OFF_TIMER;
+
+#if DISK2_DRIVENUM == 2
+	{
+		uint8_t drv = DISK2_currentDrive;
+
+		if (!EN1) drv = 0;
+		else if (!EN2) drv = 1;
+		if (drv != DISK2_currentDrive) {
+			DISK2_writeBack();
+			DISK2_currentDrive = drv;
+		}
+	}
+#endif
+	DISK2_sector = ((DISK2_sector+1)&0xf);		
+	uint8_t trk = (DISK2_ph_track[DISK2_currentDrive]>>2);
+	
+	for (bn = 0; bn < DISK2_WRITE_BUF_NUM; bn++) {
+		if ((DISK2_sectors[bn] == DISK2_sector) && (DISK2_tracks[bn] == trk)) break;
+	}
+
+	uint16_t long_sector = (uint16_t)trk*16+DISK2_sector;
+	struct FILE *imgp = &buffer2.disk2.img[DISK2_currentDrive];
+
+	if (!imgp->valid) return 0;
+	TRACE_ADD(TRACE_PREPARE, ((uint32_t)DISK2_currentDrive<<16)|long_sector);
+	HEAT_ADD(DISK2_currentDrive, trk/HEAT_TRACKS);
+	PROF_BEGIN(t);
+	if (bn < DISK2_WRITE_BUF_NUM) {
+		DISK2_slotSector(bn, DISK2_sector, trk);
+	} else {
+		FILE_readBegin(imgp, long_sector, &err);
+		if (err) return 0;
+		for (uint16_t i = 0; i != 412; i++) buffer1[i] = SPI_readByte(&err);
+		for (uint8_t i = 0; i != 102; i++) SPI_readByte(&err);
+		FILE_readEnd(&err);
+	}
+	PROF_END(PROF_PREPARE, t);
+	DISK2_prepare = 0;
+	DISK2_ptrByte = buffer1;
+	DISK2_posBit = 1;
+
+	ON_TIMER;
+	return 1;
+}
+
+// the tasks of the main loop
+static uint8_t (*DISK2_exchange)(uint8_t);		// checks the card, 1 if it is changed
 #ifndef SDISK2P
-	uint8_t drvChange = 1;
+static uint8_t DISK2_drvShown, DISK2_trkShown;
+#endif
+
+// the display is drawn again
+static void DISK2_redraw(void)
+{
+#ifndef SDISK2P
+	DISK2_drvShown = DISK2_trkShown = 0xff;
 	LCD_locate(0,0);
 	LCD_print("DR  TR  ",8);
-#endif	
-	while (1) {			
-		struct FILE *imgp = &buffer2.disk2.img[DISK2_currentDrive];
-		// out SENSE (write protect) signal
-		
+#endif
+}
+
+// out SENSE (write protect) signal, the turn goes on
+static uint8_t DISK2_taskSense(void)
+{
+	struct FILE *imgp = &buffer2.disk2.img[DISK2_currentDrive];
+
 #ifdef SDISK2P
-		if (bit_is_set(PIND,6) || (imgp->valid && imgp->protect) || (PINC&2)) PORTD |= 0b00010000;
-		else PORTD &= ~0b00010000;
+	if (bit_is_set(PIND,6) || (imgp->valid && imgp->protect) || (PINC&2)) PORTD |= 0b00010000;
+	else PORTD &= ~0b00010000;
+	if (EN1) PORTD &= ~(1<<5);
+	else PORTD |= (1<<5);
 #else
-		if (WP || (imgp->valid && imgp->protect) || (PHASE&2)) PORTD.OUT |= PIN7_bm;
-		else PORTD.OUT &= ~PIN7_bm;
+	if (WP || (imgp->valid && imgp->protect) || (PHASE&2)) PORTD.OUT |= PIN7_bm;
+	else PORTD.OUT &= ~PIN7_bm;
 #endif
+	return 0;
+}
 
-#ifdef SDISK2P
-		if (EN1) PORTD &= ~(1<<5);
-		else PORTD |= (1<<5);
+// the slots written back when the drive stops, they are not kept in RAM while the disk is idle
+static uint8_t DISK2_taskStop(void)
+{
+#if DISK2_DRIVENUM == 2
+	if (!EN1 || !EN2) return 0;
+#else
+	if (!EN1) return 0;
 #endif
-		if (pf(0)) {
-			DISK2_clearBuffer();
-			DISK2_prepare = 1;
-			
+	if (DISK2_sectors[0] == 0xff) return 0;
+	DISK2_writeBack();
+	return 1;
+}
+
+// the next sector for the bit stream
+static uint8_t DISK2_taskPrepare(void)
+{
+	return (DISK2_prepare && DISK2_prepareSector());
+}
+
+// a written sector into a slot, which may write back
+static uint8_t DISK2_taskBuffering(void)
+{
+	if (!DISK2_doBuffering) return 0;
+	DISK2_doBuffering = 0;
+	OFF_TIMER;
+	DISK2_writeBuffering();
+	ON_TIMER;
+	return 1;
+}
+
 #ifndef SDISK2P
-			drvChange = 1;
-			LCD_locate(0,0);
-			LCD_print("DR  TR  ",8);
-#endif
-		}
-#ifndef SDISK2P		
-		if (UI_checkExecute()) {
-			DISK2_writeBack();
-			DISK2_clearBuffer();
-			DISK2_prepare = 1;
-			drvChange = 1;
-			LCD_locate(0,0);
-			LCD_print("DR  TR  ",8);
-		}
-#endif
-		if (DISK2_prepare) {
-			uint8_t err = 0;
+// the track and the drive on the LCD, redrawn when they change
+static uint8_t DISK2_taskLcd(void)
+{
+	uint8_t trk = (DISK2_ph_track[DISK2_currentDrive]>>2);
+	struct FILE *imgp = &buffer2.disk2.img[DISK2_currentDrive];
 
-			OFF_TIMER;
+	if (trk != DISK2_trkShown) {
+		LCD_locate(6,0);
+		LCD_printdec(trk,2);
+		DISK2_trkShown = trk;
+	}
+	if ((DISK2_currentDrive != DISK2_drvShown) && imgp->valid) {
+		LCD_locate(2,0);
+		LCD_printdec(DISK2_currentDrive+1,1);
+		LCD_locate(0,1);
+		LCD_print(imgp->name, 8);
+		DISK2_drvShown = DISK2_currentDrive;
+	}
+	return 0;
+}
 
-#if DISK2_DRIVENUM == 2
-			if (!EN1) {if (DISK2_currentDrive!=0) { DISK2_currentDrive = 0; drvChange = 1; }}
-			else if (!EN2) {if (DISK2_currentDrive!=1) { DISK2_currentDrive = 1; drvChange = 1; }}
-#endif
-			DISK2_sector = ((DISK2_sector+1)&0xf);		
-			uint8_t trk = (DISK2_ph_track[DISK2_currentDrive]>>2);
-	
-			if (!(
-				((DISK2_sectors[0]^DISK2_sector)|(DISK2_tracks[0]^trk))
-#if DISK2_WRITE_BUF_NUM > 1		
-				&((DISK2_sectors[1]^DISK2_sector)|(DISK2_tracks[1]^trk))
-#endif
-#if DISK2_WRITE_BUF_NUM > 2
-				&((DISK2_sectors[2]^DISK2_sector)|(DISK2_tracks[2]^trk))
-#endif
-#if DISK2_WRITE_BUF_NUM > 3
-				&((DISK2_sectors[3]^DISK2_sector)|(DISK2_tracks[3]^trk))
+// the trace and the counters, written only while the drive is off, not to disturb the bit stream
+static uint8_t DISK2_taskSave(void)
+{
+	if (EN1 && EN2) {
+#ifdef TRACE
+		TRACE_idle(1);
 #endif
-#if DISK2_WRITE_BUF_NUM > 4
-				&((DISK2_sectors[4]^DISK2_sector)|(DISK2_tracks[4]^trk))
+		HEAT_save(0);
+	}
+	return 0;
+}
 #endif
-			)) DISK2_writeBack();			
 
-			uint16_t long_sector = (uint16_t)trk*16+DISK2_sector;
+// an ejected or inserted card
+static uint8_t DISK2_taskExchange(void)
+{
+	if (!DISK2_exchange(0)) return 0;
+	DISK2_clearBuffer();
+	DISK2_prepare = 1;
+	DISK2_redraw();
+	return 1;
+}
+
+#ifndef SDISK2P
+// the menu, the drive stops while it runs
+static uint8_t DISK2_taskUI(void)
+{
+	if (!UI_checkExecute()) return 0;
+	DISK2_writeBack();
+	DISK2_clearBuffer();
+	DISK2_prepare = 1;
+	DISK2_redraw();
+	return 1;
+}
+#endif
 
+// in the order of priority
+PROGMEM static const COMMON_TASK DISK2_tasks[] = {
+	DISK2_taskSense,
+	DISK2_taskPrepare,
+	DISK2_taskBuffering,
+	DISK2_taskStop,
 #ifndef SDISK2P
-			
-			LCD_locate(6,0);
-			LCD_printdec(trk,2);		
+	DISK2_taskLcd,
+	DISK2_taskSave,
 #endif
-			struct FILE *imgp = &buffer2.disk2.img[DISK2_currentDrive];
-			if (imgp->valid) {
-#ifndef SDISK2P	
-				if (drvChange) {
-					LCD_locate(2,0);
-					LCD_printdec(DISK2_currentDrive+1,1);
-					LCD_locate(0,1);
-					LCD_print(imgp->name, 8);
-					drvChange = 0;
-				}
+	DISK2_taskExchange,
+#ifndef SDISK2P
+	DISK2_taskUI,
 #endif
-				FILE_readBegin(imgp, long_sector, &err);
-				if (!err) {
-					for (uint16_t i = 0; i != 412; i++) buffer1[i] = SPI_readByte(&err);
-					for (uint8_t i = 0; i != 102; i++) SPI_readByte(&err);
-					FILE_readEnd(&err);
-					DISK2_prepare = 0;
-					DISK2_ptrByte = buffer1;
-					DISK2_posBit = 1;
-
-					ON_TIMER;
-				}
-			}
-		}
-		if (DISK2_doBuffering) {
-			DISK2_doBuffering = 0;
-			OFF_TIMER;
-			DISK2_writeBuffering();
-			ON_TIMER;
-		}
-	}
+};
+
+// run the DISK2 emulator
+// each turn runs the tasks until one has done some work, and starts over,
+// so the next sector never waits for the tasks below it
+int DISK2_run(uint8_t (*pf)(uint8_t))
+{	
+	DISK2_exchange = pf;
+	DISK2_redraw();
+	while (1) COMMON_runTasks(DISK2_tasks, sizeof(DISK2_tasks)/sizeof(DISK2_tasks[0]));
 }
 
 #ifdef SDISK2P
@@ -447,182 +592,113 @@ void DISK2_eject()
 }
 #endif
 
+#ifndef SDISK2P
 // convert a DSK file to a NIC file
+// the DSK sectors of DISK2_CONV_SECTORS physical sectors are gathered first,
+// then the NIC sectors are written by one multi block command
 void DISK2_dsk2Nic(struct FILE *nicFile, struct FILE *dskFile, uint8_t volume, uint8_t *err)
 {
 	uint16_t i;
-	uint8_t *dst = buffer2.disk2.writebuf+512;
-
-	for (i=0; i<0x16; i++) dst[i]=0xff;
-
-	// sync header
-	dst[0x16]=0x03;
-	dst[0x17]=0xfc;
-	dst[0x18]=0xff;
-	dst[0x19]=0x3f;
-	dst[0x1a]=0xcf;
-	dst[0x1b]=0xf3;
-	dst[0x1c]=0xfc;
-	dst[0x1d]=0xff;
-	dst[0x1e]=0x3f;
-	dst[0x1f]=0xcf;
-	dst[0x20]=0xf3;
-	dst[0x21]=0xfc;
-	
-	// address header
-	dst[0x22]=0xd5;
-	dst[0x23]=0xaa;
-	dst[0x24]=0x96;
-	dst[0x2d]=0xde;
-	dst[0x2e]=0xaa;
-	dst[0x2f]=0xeb;
-	
-	// sync header
-	for (i=0x30; i<0x35; i++) dst[i]=0xff;
+	uint8_t *src = buffer2.disk2.writebuf;							// DSK sectors of a group
+	uint8_t *dst = buffer2.disk2.writebuf+256*DISK2_CONV_SECTORS;	// nibbles of a sector
 	
-	// data
-	dst[0x35]=0xd5;
-	dst[0x36]=0xaa;
-	dst[0x37]=0xad;
-	dst[0x18f]=	0xde;
-	dst[0x190]=0xaa;
-	dst[0x191]=0xeb;
-	for (i=0x192; i<0x1a0; i++) dst[i]=0xff;
-	for (i=0x1a0; i<0x200; i++) dst[i]=0x00;
-	
-#ifndef SDISK2P
 	LCD_locate(0,0);
 	LCD_print("Convert ", 8);
 	LCD_locate(0,1);
-	LCD_print("TR  SC", 6);
-#endif
+	LCD_print("TR    ", 6);
 	for (uint8_t trk = 0; trk < 35; trk++) {
-		for (uint8_t sector = 0; sector < 16; sector++) {
-#ifndef SDISK2P
-			LCD_locate(2,1);
-			LCD_printdec(trk,2);
-			LCD_locate(6,1);
-			LCD_printdec(sector,2);
-#endif
-			uint8_t *src;
-			uint16_t ph_sector = (uint16_t)pgm_read_byte_near(DISK2_interwieve+sector);
+		LCD_locate(2,1);
+		LCD_printdec(trk,2);
+		for (uint8_t ph = 0; ph < 16; ph += DISK2_CONV_SECTORS) {
+			uint8_t got = 0;
+
+			// a DSK block may hold two sectors of the group
+			for (uint8_t k = 0; k < DISK2_CONV_SECTORS; k++) {
+				if (got&(1<<k)) continue;
+				uint8_t blk = (pgm_read_byte_near(DISK2_deinterwieve+ph+k)>>1);
 
-			if ((sector&1)==0) {
-				uint32_t long_sector = (uint32_t)trk*8+(sector/2);
-				
-				FILE_readBegin(dskFile, long_sector, err);
+				FILE_readBegin(dskFile, (uint32_t)trk*8+blk, err);
 				if (*err) return;
-				for (i=0; i<512; i++) {
-					buffer2.disk2.writebuf[i]=SPI_readByte(err);
-					if (*err) return;
+				for (uint8_t h = 0; h < 2; h++) {
+					uint8_t *p = 0;
+
+					for (uint8_t m = k; m < DISK2_CONV_SECTORS; m++) {
+						if (pgm_read_byte_near(DISK2_deinterwieve+ph+m) == blk*2+h) {
+							p = src+m*256;
+							got |= (1<<m);
+						}
+					}
+					for (i=0; i<256; i++) {
+						uint8_t c = SPI_readByte(err);
+						if (*err) return;
+						if (p) p[i] = c;
+					}
 				}
 				FILE_readEnd(err);
 				if (*err) return;
-
-				src = buffer2.disk2.writebuf;
-			} else {
-				src = buffer2.disk2.writebuf+256;
 			}
-			{
-				uint8_t c, x, ox = 0;
-
-				dst[0x25]=((volume>>1)|0xaa);
-				dst[0x26]=(volume|0xaa);
-				dst[0x27]=((trk>>1)|0xaa);
-				dst[0x28]=(trk|0xaa);
-				dst[0x29]=((ph_sector>>1)|0xaa);
-				dst[0x2a]=(ph_sector|0xaa);
-				c = (volume^trk^ph_sector);
-				dst[0x2b]=((c>>1)|0xaa);
-				dst[0x2c]=(c|0xaa);
-				for (i = 0; i < 86; i++) {
-					x = (pgm_read_byte_near(DISK2_flipBit1+(src[i]&3)) |
-					pgm_read_byte_near(DISK2_flipBit2+(src[i+86]&3)) |
-					((i<=83)?pgm_read_byte_near(DISK2_flipBit3+(src[i+172]&3)):0));
-					dst[i+0x38] = pgm_read_byte_near(DISK2_encTable+(x^ox));
-					ox = x;
-				}
-				for (i = 0; i < 256; i++) {
-					x = (src[i] >> 2);
-					dst[i+0x8e] = pgm_read_byte_near(DISK2_encTable+(x^ox));
-					ox = x;
-				}
-				dst[0x18e]=pgm_read_byte_near(DISK2_encTable+ox);
-			}
-			{
-				uint32_t long_sector = (uint32_t)trk*16+ph_sector;
-
-				FILE_writeBegin(nicFile, long_sector, err);
+			FILE_writeSeqBegin(nicFile, (uint32_t)trk*16+ph, err);
+			if (*err) return;
+			for (uint8_t k = 0; k < DISK2_CONV_SECTORS; k++) {
+				CONVERT_encode(src+k*256, dst);
+				FILE_writeSeqNext(nicFile, err);
 				if (*err) return;
-				for (i=0; i<512; i++) {
-					SPI_writeByte(dst[i], err);
-					if (*err) return;
-				}
-				FILE_writeEnd(err);
+				DISK2_writeNicHeader(volume, trk, ph+k, err);
+				if (*err) return;
+				SPI_writeBytes(dst, 343, err);
+				if (*err) return;
+				SPI_writeBytes_P(DISK2_nicTail, sizeof(DISK2_nicTail), err);
 				if (*err) return;
 			}
+			FILE_writeSeqEnd(err);
+			if (*err) return;
 		}
 	}
 }
 
 // convert a NIC file to a DSK file
+// DISK2_CONV_BLOCKS DSK blocks are decoded first,
+// then written by one multi block command
 void DISK2_nic2Dsk(struct FILE *dskFile, struct FILE *nicFile, uint8_t *err)
 {
-	uint8_t track, sector;
-	uint8_t *src, *dst;
+	uint8_t track, sector, blk;
+	uint8_t *src = buffer2.disk2.writebuf+512*DISK2_CONV_BLOCKS;		// nibbles of a sector
+	uint8_t *dst = buffer2.disk2.writebuf;								// DSK blocks of a group
 	
-#ifndef SDISK2P
 	LCD_locate(0,0);
 	LCD_print("WR back ", 8);
 	LCD_locate(0,1);
-	LCD_print("TR  SC", 6);
-#endif
+	LCD_print("TR    ", 6);
 	for (track = 0; track < 35; track++) {
-		for (sector = 0; sector < 16; sector++) {
-#ifndef SDISK2P
-			LCD_locate(2,1);
-			LCD_printdec(track,2);
-			LCD_locate(6,1);
-			LCD_printdec(sector,2);
-#endif
-			uint16_t i, j;
-			uint8_t x, ox = 0;
-			uint8_t ph_sector = pgm_read_byte_near(DISK2_interwieve+sector);
-
-			FILE_readBegin(nicFile, (uint16_t)track*16+ph_sector, err);
-			if (*err) return;
-			for (i=0; i<512; i++) {
-				buffer2.disk2.writebuf[i] = SPI_readByte(err);
-				if (*err) return;
-			}
-			FILE_readEnd(err);
-			if (*err) return;
-
-			src = buffer2.disk2.writebuf;
-			dst = ((sector&1)?(buffer2.disk2.writebuf+512+256):(buffer2.disk2.writebuf+512));
-
-			for (j=0, i=0x38; i<0x8e; i++, j++) {
-				x = ((ox^pgm_read_byte_near(DISK2_decTable+src[i]))&0x3f);
-				dst[j+172] = pgm_read_byte_near(DISK2_flipBit+((x>>4)&3));
-				dst[j+86] = pgm_read_byte_near(DISK2_flipBit+((x>>2)&3));
-				dst[j] = pgm_read_byte_near(DISK2_flipBit+((x)&3));
-				ox = x;
-			}
-			for (j=0, i=0x8e; i<0x18e; i++, j++) {
-				x = ((ox^pgm_read_byte_near(DISK2_decTable+src[i]))&0x3f);
-				dst[j]|=(x<<2);
-				ox = x;
-			}
-			if (sector&1) {
-				FILE_writeBegin(dskFile, (uint32_t)track*8+sector/2, err);
+		LCD_locate(2,1);
+		LCD_printdec(track,2);
+		for (blk = 0; blk < 8; blk += DISK2_CONV_BLOCKS) {
+			for (sector = blk*2; sector < (blk+DISK2_CONV_BLOCKS)*2; sector++) {
+				uint16_t i;
+				uint8_t ph_sector = pgm_read_byte_near(DISK2_interwieve+sector);
+
+				FILE_readBegin(nicFile, (uint16_t)track*16+ph_sector, err);
 				if (*err) return;
 				for (i=0; i<512; i++) {
-					SPI_writeByte(buffer2.disk2.writebuf[512+i], err);
+					uint8_t c = SPI_readByte(err);
 					if (*err) return;
+					if ((i>=0x38)&&(i<0x38+343)) src[i-0x38] = c;
 				}
-				FILE_writeEnd(err);
+				FILE_readEnd(err);
+				if (*err) return;
+				CONVERT_decode(src, dst+(uint16_t)(sector-blk*2)*256);
+			}
+			FILE_writeSeqBegin(dskFile, (uint32_t)track*8+blk, err);
+			if (*err) return;
+			for (uint8_t k = 0; k < DISK2_CONV_BLOCKS; k++) {
+				FILE_writeSeqNext(dskFile, err);
+				if (*err) return;
+				SPI_writeBytes(dst+(uint16_t)k*512, 512, err);
 				if (*err) return;
 			}
+			FILE_writeSeqEnd(err);
+			if (*err) return;
 		}
 	}
-}
\ No newline at end of file
+}
+#endif
@@ -53,10 +53,12 @@ void DISK2_moveHead(void);
 // should be called before SDISK2P eject reset
 void DISK2_eject(void);
 
+#ifndef SDISK2P
 // convert a DSK file to a NIC file
 void DISK2_dsk2Nic(struct FILE *nicFile, struct FILE *dskFile, uint8_t volume, uint8_t *err);
 
 // convert a NIC file to a DSK file
 void DISK2_nic2Dsk(struct FILE *dskFile, struct FILE *nicFile, uint8_t *err);
+#endif
 
 #endif /* DISK2_H_ */
\ No newline at end of file
@@ -0,0 +1,121 @@
+﻿/*
+ * HEAT.c
+ *
+ * Created: 2026/10/19 13:40:05
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+#include <string.h>
+#include "HEAT.h"
+#include "SD.h"
+#include "BUFFER.h"
+#include "COMMON.h"
+
+// counted since the last write
+#define HEAT_SAVE 256
+
+PROGMEM const uint8_t HEAT_magic[8] = {'U','N','I','S','D','H','O','T'};
+
+uint16_t HEAT_cnt[HEAT_DRV][HEAT_NUM];
+static uint16_t HEAT_changes;
+static uint32_t HEAT_adr;				// the sector of the mode, 0 if none
+
+// open or create UNISDISK.HOT and load the counters of the mode
+// buffer2.sd.buf2 is used for the file while opening
+void HEAT_open(void)
+{
+	struct FILE *filep = (struct FILE *)buffer2.sd.buf2;
+	uint8_t err = 0, magic = 1;
+
+	HEAT_adr = 0;
+	HEAT_changes = 0;
+	memset(HEAT_cnt, 0, sizeof(HEAT_cnt));
+	FILE_open(filep, 0, "UNISDISK", "HOT", &err);
+	if (err) {
+		if (WP) return;
+		err = 0;
+		// Notice : buffer2.sd.buf[512] is also used!
+		FILE_create(0, "UNISDISKHOT", 1024, &err);
+		if (err) return;
+		FILE_open(filep, 0, "UNISDISK", "HOT", &err);
+		if (err) return;
+	}
+	if ((filep->extNum!=1)||(filep->length<1024)) return;
+	uint32_t adr = SD_p.userAddr+(filep->map.ext[0][0]-2)*SD_p.sectorsPerCluster+((mode==DISK2MODE)?0:1);
+
+	SD_readBlockBegin(adr, &err);
+	for (uint16_t i = 0; (i < 512) && !err; i++) {
+		uint8_t c = SPI_readByte(&err);
+
+		if (i < 8) {
+			if (c != pgm_read_byte(HEAT_magic+i)) magic = 0;
+		} else if (magic && (i < 8+sizeof(HEAT_cnt))) ((uint8_t *)HEAT_cnt)[i-8] = c;
+	}
+	if (!err) SD_readBlockEnd(&err);
+	if (err || !magic) memset(HEAT_cnt, 0, sizeof(HEAT_cnt));
+	if (!err) HEAT_adr = adr;
+}
+
+// count up
+// all counters of the drive are halved rather than stop counting
+void HEAT_add(uint8_t drv, uint8_t i)
+{
+	uint16_t *c = HEAT_cnt[drv];
+
+	if (c[i] == 0xffff) for (uint8_t j = 0; j < HEAT_NUM; j++) c[j] >>= 1;
+	c[i]++;
+	if (HEAT_changes != 0xffff) HEAT_changes++;
+}
+
+// clear the counters of a drive when the image is changed
+void HEAT_clear(uint8_t drv)
+{
+	memset(HEAT_cnt[drv], 0, sizeof(HEAT_cnt[drv]));
+	HEAT_changes = 0xffff;
+}
+
+// write the counters if many were counted since the last write or force
+// interrupts are disabled while writing
+void HEAT_save(uint8_t force)
+{
+	uint8_t err = 0, s = SREG;
+
+	if (!HEAT_adr || !SD_p.inited || EJECT || !HEAT_changes || (!force && (HEAT_changes < HEAT_SAVE))) return;
+	cli();
+	SD_writeBlockBegin(HEAT_adr, &err);
+	for (uint16_t i = 0; (i < 512) && !err; i++) {
+		uint8_t c = 0;
+
+		if (i < 8) c = pgm_read_byte(HEAT_magic+i);
+		else if (i < 8+sizeof(HEAT_cnt)) c = ((uint8_t *)HEAT_cnt)[i-8];
+		SPI_writeByte(c, &err);
+	}
+	if (!err) SD_writeBlockEnd(&err);
+	if (!err) HEAT_changes = 0;
+	SREG = s;
+}
+
+// whether a block should be read ahead for sequential reads
+// on unless it has missed more than it would have hit
+uint8_t HEAT_ahead(uint8_t drv)
+{
+	return (HEAT_cnt[drv][HEAT_HIT] >= HEAT_cnt[drv][HEAT_MISS]);
+}
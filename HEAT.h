@@ -0,0 +1,65 @@
+﻿/*
+ * HEAT.h
+ *
+ * Created: 2026/10/19 13:40:05
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HEAT_H_
+#define HEAT_H_
+
+// access counters of the mounted images (UNISDISK only)
+// kept in UNISDISK.HOT, sector 0 for DISK II drives, sector 1 for SmartPort drives
+// a sector has "UNISDHOT", then HEAT_NUM counters of 16 bits for each drive
+#define HEAT_DRV 4
+#define HEAT_NUM 8
+
+// DISK II : 0 - 6 are tracks by 5 tracks, 7 is written sectors
+#define HEAT_TRACKS 5
+#define HEAT_WRITTEN 7
+// SmartPort : 0 / 1 are reads that a block read ahead would have hit / missed,
+// 2 - 7 are blocks by a sixth of the image
+#define HEAT_HIT 0
+#define HEAT_MISS 1
+#define HEAT_RANGE 2
+
+#ifndef SDISK2P
+#define HEAT_ADD(drv, i) HEAT_add((drv), (i))
+
+extern uint16_t HEAT_cnt[HEAT_DRV][HEAT_NUM];
+
+// open or create UNISDISK.HOT and load the counters of the mode
+// the counters are only kept in memory if it fails
+void HEAT_open(void);
+
+// count up
+void HEAT_add(uint8_t drv, uint8_t i);
+
+// clear the counters of a drive when the image is changed
+void HEAT_clear(uint8_t drv);
+
+// write the counters if many were counted since the last write or force
+void HEAT_save(uint8_t force);
+
+// whether a block should be read ahead for sequential reads
+uint8_t HEAT_ahead(uint8_t drv);
+#else
+#define HEAT_ADD(drv, i)
+#endif
+
+#endif /* HEAT_H_ */
@@ -26,26 +26,35 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include "INI.h"
 #include "SD.h"
+#include "BUFFER.h"
 #include "COMMON.h"
 #include "LCD.h"
 
-// UNISDISK.INI file
-struct FILE iniFile;
+// the sector of UNISDISK.INI, the file has only one sector
+// 0 if there is no UNISDISK.INI
+static uint32_t INI_adr;
 
 // open or create UNISDISK.INI file
+// buffer2.sd.buf2 is used for the file while opening
 void INI_openCreate(uint8_t *err)
 {
-	FILE_open(&iniFile, 0, "UNISDISK", "INI", err);
-	if (*err) {
+	struct FILE *iniFile = (struct FILE *)buffer2.sd.buf2;
+
+	INI_adr = 0;
+	FILE_open(iniFile, 0, "UNISDISK", "INI", err);
+	if (!*err) INI_adr = SD_p.userAddr+(iniFile->startCluster-2)*SD_p.sectorsPerCluster;
+	else {
 		*err = 0;
 		if (WP) {
 			LCD_printAll("Write   Protect.");
 		} else {
 			FILE_create(0, "UNISDISKINI", 512, err);
 			if (*err) return;
-			FILE_open(&iniFile, 0, "UNISDISK", "INI", err);
+			FILE_open(iniFile, 0, "UNISDISK", "INI", err);
+			if (*err) return;
+			INI_adr = SD_p.userAddr+(iniFile->startCluster-2)*SD_p.sectorsPerCluster;
+			SD_writeBlockBegin(INI_adr, err);
 			if (*err) return;
-			FILE_writeBegin(&iniFile, 0, err);	
 			for (uint8_t j = 0; j < 6; j++) {
 				SPI_writeByte(0, err);
 				if (*err) return;
@@ -58,33 +67,47 @@ void INI_openCreate(uint8_t *err)
 				SPI_writeByte(' ', err);
 				if (*err) return;
 			}
-			FILE_writeEnd(err);
+			SD_writeBlockEnd(err);
 		}
 	}
 }
 
+// the sector of UNISDISK.INI, 0 if there is none
+uint32_t INI_sector(void)
+{
+	return INI_adr;
+}
+
 // read INI file to a buffer
+// read by SD_readBlock, the block is served from its cache while no other block is read
 void INI_read(uint8_t *buff, uint8_t *err)
 {
-	FILE_readBegin(&iniFile, 0, err);
-	if (*err) return;
-	for (uint16_t i=0; i<512; i++) {
-		buff[i] = SPI_readByte(err);
-		if (*err) return;
-	}
-	FILE_readEnd(err);
+	uint8_t *b = SD_p.buff;
+
+	if (!INI_adr) { *err = 1; return; }
+	SD_changeBuff(buff);
+	SD_readBlock(INI_adr, err);
+	SD_changeBuff(b);
+}
+
+// keep the INI sector in the cache of SD_readBlock while the drives are looked up
+// the other blocks read in between are not cached then
+void INI_hold(uint8_t on)
+{
+	SD_holdCache((on && INI_adr)?INI_adr:0xffffffff);
 }
 
 // write INI file
 void INI_write(uint8_t *buff, uint8_t *err)
 {
-	FILE_writeBegin(&iniFile, 0, err);
+	if (!INI_adr) { *err = 1; return; }
+	SD_writeBlockBegin(INI_adr, err);
 	if (*err) return;
 	for (uint16_t i=0; i<512; i++) {
 		SPI_writeByte(buff[i], err);
 		if (*err) return;
 	}
-	FILE_writeEnd(err);
+	SD_writeBlockEnd(err);
 }
 
 // read a file name in UNISDISK.INI
@@ -95,14 +118,35 @@ void INI_readFName(uint8_t *buff, uint8_t drv, char *name, uint8_t *err)
 	strcpy(name, (char *)buff+(uint16_t)drv*64);
 }
 
+// whether an option such as "IDX=1" is given after the file names
+// buff should have been read by INI_read
+uint8_t INI_option(uint8_t *buff, const char *opt)
+{
+	uint8_t len = strlen(opt);
+
+	for (uint16_t i=6*64; i+len<=512; i++) {
+		if (!memcmp(buff+i, opt, len)) return 1;
+	}
+	return 0;
+}
+
 // substitute a file name in UNISDISK.INI
-void INI_substitute(uint8_t *buff, uint8_t drv, char *name, uint8_t *err)
+// written only if the name is changed, return 1 then
+uint8_t INI_substitute(uint8_t *buff, uint8_t drv, char *name, uint8_t *err)
 {
+	uint8_t *slot = buff+(uint16_t)drv*64;
+	uint8_t len = strlen(name)+1, dirty = 0;
+
 	INI_read(buff, err);
-	if (*err) return;
+	if (*err) return 0;
 	for (uint8_t i=0; i<64; i++) {
-		buff[(uint16_t)drv*64+i]=' ';
+		char c = (i<len)?name[i]:' ';
+
+		if (slot[i]!=c) {
+			slot[i] = c;
+			dirty = 1;
+		}
 	}
-	strcpy((char *)buff+(uint16_t)drv*64, name);
-	INI_write(buff, err);
+	if (dirty) INI_write(buff, err);
+	return dirty;
 }
@@ -24,19 +24,27 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #ifndef INI_H_
 #define INI_H_
 
-// SDISK2.INI file
-extern struct FILE iniFile;
-
 // open or create UNISDISK.INI
 void INI_openCreate(uint8_t *err);
 
+// the sector of UNISDISK.INI, 0 if there is none
+uint32_t INI_sector(void);
+
 // read INI file to a buffer
 void INI_read(uint8_t *buff, uint8_t *err);
 
+// keep the INI sector in the cache of SD_readBlock while the drives are looked up
+void INI_hold(uint8_t on);
+
 // substitute a file name in UNISDISK.INI
-void INI_substitute(uint8_t *buff, uint8_t drv, char *name, uint8_t *err);
+// return 1 if the name is changed
+uint8_t INI_substitute(uint8_t *buff, uint8_t drv, char *name, uint8_t *err);
 
 // read a file name in UNISDISK.INI
 void INI_readFName(uint8_t *buff, uint8_t drv, char *name, uint8_t *err);
 
+// whether an option such as "IDX=1" is given after the file names
+// buff should have been read by INI_read
+uint8_t INI_option(uint8_t *buff, const char *opt);
+
 #endif /* INI_H_ */
\ No newline at end of file
@@ -23,6 +23,7 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 
 #include <string.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include "SYSTEM.h"
 #include <util/delay.h>
 #include "LCD.h"
@@ -35,6 +36,17 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #define TWI_BAUD(F_SYS, F_TWI) ((F_SYS / (2 * F_TWI)) - 5)
 #define TWI_BAUDSETTING TWI_BAUD(F_CPU, TWI_BAUDRATE)
 
+// 8 x 2 characters
+#define LCD_COLS 8
+#define LCD_ROWS 2
+
+// shadow of the display, changed cells are sent by the TWI master interrupt
+static char LCD_fb[LCD_COLS*LCD_ROWS];
+static volatile uint16_t LCD_dirty;		// a bit per cell to be sent
+static volatile uint8_t LCD_state;		// 0 : TWI idle
+static uint8_t LCD_cur;					// the cell being sent
+static uint8_t LCD_col, LCD_row;		// cursor
+
 static void twi_init(void)
 {
 	TWIC.MASTER.STATUS = TWI_MASTER_BUSSTATE_UNKNOWN_gc;
@@ -54,6 +66,77 @@ static void twi_cmd(uint8_t addr, uint8_t cmd, uint8_t data)
 	TWIC.MASTER.CTRLC = TWI_MASTER_CMD_STOP_gc;
 }
 
+// start a transaction from the first changed cell
+// called with interrupts disabled
+static void LCD_start(void)
+{
+	uint8_t i = 0;
+
+	while (!(LCD_dirty&(1U<<i))) i++;
+	LCD_cur = i;
+	LCD_state = 1;
+	TWIC.MASTER.ADDR = LCD_SLAVE_ADDRESS<<1;
+}
+
+// send the next byte of the transaction
+// a transaction is : set DDRAM address, then a run of changed cells in a row
+static void LCD_step(void)
+{
+	if (TWIC.MASTER.STATUS&(TWI_MASTER_RXACK_bm|TWI_MASTER_ARBLOST_bm|TWI_MASTER_BUSERR_bm)) {
+		// give up for now, everything is sent again next time
+		TWIC.MASTER.CTRLC = TWI_MASTER_CMD_STOP_gc;
+		TWIC.MASTER.STATUS = TWI_MASTER_WIF_bm;
+		LCD_dirty = 0xffff;
+		LCD_state = 0;
+		return;
+	}
+	switch (LCD_state) {
+		case 1:
+			TWIC.MASTER.DATA = 0x80;	// a command follows
+			LCD_state = 2;
+			break;
+		case 2:
+			TWIC.MASTER.DATA = 0x80+(LCD_cur%LCD_COLS)+(LCD_cur/LCD_COLS)*0x40;
+			LCD_state = 3;
+			break;
+		case 3:
+			TWIC.MASTER.DATA = 0x40;	// data follow
+			LCD_state = 4;
+			break;
+		case 4:
+			LCD_dirty &= ~(1U<<LCD_cur);
+			TWIC.MASTER.DATA = LCD_fb[LCD_cur++];
+			if (!(LCD_cur%LCD_COLS) || !(LCD_dirty&(1U<<LCD_cur))) LCD_state = 5;
+			break;
+		default:
+			TWIC.MASTER.CTRLC = TWI_MASTER_CMD_STOP_gc;
+			TWIC.MASTER.STATUS = TWI_MASTER_WIF_bm;
+			if (LCD_dirty) LCD_start();
+			else LCD_state = 0;
+			break;
+	}
+}
+
+ISR(TWIC_TWIM_vect)
+{
+	LCD_step();
+}
+
+// send all changed cells now
+// used where interrupts are disabled
+void LCD_flush(void)
+{
+	uint8_t s = SREG;
+
+	cli();
+	if (!LCD_state && LCD_dirty) LCD_start();
+	while (LCD_state) {
+		while (!(TWIC.MASTER.STATUS&TWI_MASTER_WIF_bm)) ;
+		LCD_step();
+	}
+	SREG = s;
+}
+
 void LCD_init(void)
 {
 	twi_init();
@@ -77,23 +160,46 @@ void LCD_init(void)
 	_delay_us(32);
 	twi_cmd(LCD_SLAVE_ADDRESS, 0, 0x01);
 	_delay_ms(2);
+
+	memset(LCD_fb, ' ', sizeof(LCD_fb));
+	LCD_dirty = 0;
+	LCD_state = 0;
+	LCD_col = LCD_row = 0;
+	TWIC.MASTER.CTRLA = TWI_MASTER_INTLVL_LO_gc|TWI_MASTER_WIEN_bm|TWI_MASTER_ENABLE_bm;
 }
 
 void LCD_locate(uint8_t x, uint8_t y)
 {
-	twi_cmd(LCD_SLAVE_ADDRESS, 0, 0x80+x+y*0x40);
+	LCD_col = x;
+	LCD_row = y;
 }
 
+// only the shadow is changed here
+// if interrupts are disabled, the cell is sent at once
 void LCD_putchar(char c)
 {
-	twi_cmd(LCD_SLAVE_ADDRESS, 0x40, c);
+	if ((LCD_col < LCD_COLS) && (LCD_row < LCD_ROWS)) {
+		uint8_t i = LCD_row*LCD_COLS+LCD_col;
+
+		if (LCD_fb[i] != c) {
+			uint8_t s = SREG;
+
+			cli();
+			LCD_fb[i] = c;
+			LCD_dirty |= (1U<<i);
+			if (!LCD_state) LCD_start();
+			SREG = s;
+			if (!(s&CPU_I_bm)) LCD_flush();
+		}
+	}
+	LCD_col++;
 }
 
 void LCD_print(char str[], uint8_t len)
 {
 	uint8_t i;
 	
-	for (i=0; i<len; i++) twi_cmd(LCD_SLAVE_ADDRESS, 0x40, str[i]);
+	for (i=0; i<len; i++) LCD_putchar(str[i]);
 }
 
 void LCD_printhex(uint32_t a, int8_t digits)
@@ -145,5 +251,6 @@ void LCD_marker(char *str)
 void LCD_markerL(char *str)
 {
 	LCD_printAll(str);
+	LCD_flush();
 	while (1) ;
 }
\ No newline at end of file
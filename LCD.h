@@ -42,6 +42,9 @@ void LCD_printAll(char *str);
 
 void LCD_cls(void);
 
+// send all changes to the display now
+void LCD_flush(void);
+
 // for debug
 void LCD_marker(char *str);
 void LCD_markerL(char *str);
@@ -23,11 +23,13 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 
 #include <string.h>
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
 #include "COMMON.h"
 #include "SD.h"
 #include "BUFFER.h"
+#include "TRACE.h"
 #ifndef SDISK2P
 #include "LCD.h"
 #endif
@@ -50,32 +52,69 @@ static void SPI_init(uint8_t clk2x, uint8_t dv, uint8_t *err)
 void SPI_writeByte(uint8_t c, uint8_t *err)
 {
 	uint16_t i=0;
-#ifdef SDISK2P
-	SPDR = c;
-	// wait for transmission complete
-	while (!(SPSR & (1<<SPIF))) if ((i++==1000) || EJECT) { *err = 1; return; }
-#else	
-	SPIC.DATA = c;
+
+	SPI_SEND(c);
 	// wait for transmission complete
-	while (!(SPIC_STATUS & SPI_IF_bm)) if ((i++==1000) || EJECT) { *err = 1; return; }
-#endif
+	while (!SPI_DONE) if ((i++==1000) || EJECT) { *err = 1; return; }
+}
+
+// write bytes to spi
+// EJECT is checked once, the transfer then runs at the spi rate
+void SPI_writeBytes(const uint8_t *p, uint16_t len, uint8_t *err)
+{
+	if (EJECT) { *err = 1; return; }
+	while (len--) {
+		uint16_t i=0;
+
+		SPI_SEND(*(p++));
+		while (!SPI_DONE) if (i++==1000) { *err = 1; return; }
+	}
+}
+
+// write bytes in the program memory to spi
+// the next byte is fetched while the current one is shifted out
+void SPI_writeBytes_P(const uint8_t *p, uint16_t len, uint8_t *err)
+{
+	uint8_t c = pgm_read_byte_near(p++);
+
+	if (EJECT) { *err = 1; return; }
+	while (len--) {
+		uint16_t i=0;
+
+		SPI_SEND(c);
+		c = pgm_read_byte_near(p++);
+		while (!SPI_DONE) if (i++==1000) { *err = 1; return; }
+	}
 }
 
 // read data from spi
 uint8_t SPI_readByte(uint8_t *err)
 {
 	uint16_t i=0;
-#ifdef SDISK2P
-	SPDR = 0xff;
-	// wait for transmission complete
-	while (!(SPSR & (1<<SPIF))) if ((i++==1000) || EJECT) { *err = 1; return 0; }
-	return SPDR;
-#else
-	SPIC.DATA = 0xff;
+
+	SPI_SEND(0xff);
 	// wait for reception complete
-	while (!(SPIC.STATUS & SPI_IF_bm)) if ((i++==1000) || EJECT) { *err = 1; return 0; }
-	return SPIC.DATA;
-#endif
+	while (!SPI_DONE) if ((i++==1000) || EJECT) { *err = 1; return 0; }
+	return SPI_RECV;
+}
+
+// start receiving bytes one after another
+void SPI_readPipeBegin(void)
+{
+	SPI_SEND(0xff);
+}
+
+// get the byte being received, and start receiving the next one if more
+// the caller can work on the byte while the next one is shifted in
+uint8_t SPI_readPipe(uint8_t more, uint8_t *err)
+{
+	uint16_t i=0;
+	uint8_t c;
+
+	while (!SPI_DONE) if ((i++==1000) || EJECT) { *err = 1; return 0; }
+	c = SPI_RECV;
+	if (more) SPI_SEND(0xff);
+	return c;
 }
 
 // ========== SD card ==========
@@ -85,10 +124,22 @@ struct SD SD_p;
 void SD_waitFinish(uint8_t *err)
 {
 	while (SPI_readByte(err) != 0xff) {
-		if (*err || EJECT) { *err = 1; return; }
+		if (*err || EJECT) { if (!*err) TRACE_ADD(TRACE_CARDERR, 3); *err = 1; return; }
 	}
 }
 
+// wait for the start token of a data block
+static void SD_waitToken(uint8_t *err)
+{
+	uint8_t ch;
+
+	do {
+		if (EJECT) { TRACE_ADD(TRACE_CARDERR, 2); *err = 1; return; }
+		ch = SPI_readByte(err);
+		if (*err) return;
+	} while (ch != 0xfe);
+}
+
 // get a command response from the SD card
 unsigned char SD_getResp(uint8_t *err)
 {
@@ -96,7 +147,7 @@ unsigned char SD_getResp(uint8_t *err)
 	uint8_t ch;
 	do {
 		ch = SPI_readByte(err);
-		if ((i++==1000) || *err || EJECT) { *err = 1; return 0; }
+		if ((i++==1000) || *err || EJECT) { if (!*err) TRACE_ADD(TRACE_CARDERR, 1); *err = 1; return 0; }
 	} while ((ch&0x80) != 0);
 
 	return ch;
@@ -152,15 +203,9 @@ void SD_cmd(uint8_t cmd, uint32_t adr, uint8_t *err)
 // issue command 17 and get ready for reading
 void SD_cmd17(uint32_t adr, uint8_t *err)
 {
-	uint8_t ch;
-
 	SD_cmd(17, adr, err);
 	if (*err) return;
-	do {
-		if (EJECT) { *err = 1; return; }
-		ch = SPI_readByte(err);
-		if (*err) return;
-	} while (ch != 0xfe);
+	SD_waitToken(err);
 }
 
 void SD_readBlockBegin(uint32_t block_adr, uint8_t *err)
@@ -177,10 +222,36 @@ void SD_readBlockEnd(uint8_t *err)
 	DISABLE_CS;
 }
 
+#ifndef SDISK2P
+// the last block read by SD_readBlock
+// FAT and directory blocks are read again and again
+static uint8_t SD_cache[512];
+static uint32_t SD_cacheAdr = 0xffffffff;	// 0xffffffff : none
+static uint32_t SD_cacheHold = 0xffffffff;	// the only block cached, 0xffffffff : any
+#define SD_INVALIDATE_CACHE SD_cacheAdr = 0xffffffff
+#else
+#define SD_INVALIDATE_CACHE
+#endif
+
+// only the block is cached from now, 0xffffffff : any block
+// other blocks read in between do not push it out
+void SD_holdCache(uint32_t block_adr)
+{
+#ifndef SDISK2P
+	SD_cacheHold = block_adr;
+#endif
+}
+
 void SD_readBlock(uint32_t block_adr, uint8_t *err)
 {
 	uint16_t i;
 	
+#ifndef SDISK2P
+	if (block_adr == SD_cacheAdr) {
+		memcpy(SD_p.buff, SD_cache, 512);
+		return;
+	}
+#endif
 	SD_readBlockBegin(block_adr, err);
 	if (*err) return;
 	for (i=0; i<512; i++) {
@@ -189,10 +260,17 @@ void SD_readBlock(uint32_t block_adr, uint8_t *err)
 		if (*err) return;
 	}
 	SD_readBlockEnd(err);
+#ifndef SDISK2P
+	if (!*err && ((SD_cacheHold == 0xffffffff) || (SD_cacheHold == block_adr))) {
+		memcpy(SD_cache, SD_p.buff, 512);
+		SD_cacheAdr = block_adr;
+	}
+#endif
 }
 
 void SD_writeBlockBegin(uint32_t block_adr, uint8_t *err)
 {
+	SD_INVALIDATE_CACHE;
 	//DISABLE_CS;
 	ENABLE_CS;
 
@@ -223,6 +301,77 @@ void SD_writeBlockEnd(uint8_t *err)
 	//ENABLE_CS;
 }
 
+#ifndef SDISK2P
+// write a block
+static void SD_writeBlock(uint32_t block_adr, uint8_t *p, uint8_t *err)
+{
+	SD_writeBlockBegin(block_adr, err);
+	if (*err) return;
+	SPI_writeBytes(p, 512, err);
+	if (*err) return;
+	SD_writeBlockEnd(err);
+}
+#endif
+
+// issue command 18 and read blocks in sequence
+void SD_readMultiBegin(uint32_t block_adr, uint8_t *err)
+{
+	ENABLE_CS;
+	SD_cmd(18, SD_p.blkAdrAccs?block_adr:(block_adr*512), err);
+}
+
+// wait for the next block of command 18
+void SD_readMultiNext(uint8_t *err)
+{
+	SD_waitToken(err);
+}
+
+// stop command 18
+void SD_readMultiEnd(uint8_t *err)
+{
+	SD_cmd(12, 0, err);
+	if (*err) return;
+	SD_waitFinish(err);
+	DISABLE_CS;
+}
+
+// issue command 25 and write blocks in sequence
+void SD_writeMultiBegin(uint32_t block_adr, uint8_t *err)
+{
+	SD_INVALIDATE_CACHE;
+	ENABLE_CS;
+	SD_cmd(25, SD_p.blkAdrAccs?block_adr:(block_adr*512), err);
+}
+
+// send the data token of the next block of command 25
+void SD_writeMultiNext(uint8_t *err)
+{
+	SPI_writeByte(0xff, err);
+	if (*err) return;
+	SPI_writeByte(0xfc, err);
+}
+
+// send CRC and wait until the block is written
+void SD_writeMultiBlockEnd(uint8_t *err)
+{
+	SPI_writeByte(0xff, err);
+	if (*err) return;
+	SPI_writeByte(0xff, err);
+	if (*err) return;
+	SD_waitFinish(err);
+}
+
+// stop command 25
+void SD_writeMultiEnd(uint8_t *err)
+{
+	SPI_writeByte(0xfd, err);
+	if (*err) return;
+	SPI_readByte(err);
+	if (*err) return;
+	SD_waitFinish(err);
+	DISABLE_CS;
+}
+
 // write bytes one by one to the SD card
 // Notice : buffer2.sd.buf[512] is also used!
 void SD_writeBytes(uint32_t adr, uint16_t ofs, uint8_t *ptr, uint16_t length, uint8_t *err)
@@ -268,12 +417,25 @@ void SD_changeBuff(uint8_t *b)
 	SD_p.buff = b;
 }
 
+#ifndef SDISK2P
+static void FILE_exMount(uint8_t *err);
+static uint8_t FILE_idxState;		// 0 : not opened, 1 : usable, 2 : not usable or not used
+static uint16_t FILE_idxSeen;		// a bit for each slot whose directory is checked since the card is inserted
+#endif
+
 // initialization SD card
 void SD_init(uint8_t *err)
 {
 	SD_p.buff = buffer1;
 	SD_p.buff2 = buffer2.sd.buf;
 	SD_p.inited = 0;
+	SD_INVALIDATE_CACHE;
+#ifndef SDISK2P
+	SD_cacheHold = 0xffffffff;
+	FILE_idxState = 2;
+	FILE_idxSeen = 0;
+	SD_p.readMulti = 1;
+#endif
 	
 	uint8_t ch, ver;
 	uint16_t resp7;
@@ -441,7 +603,7 @@ void SD_init(uint8_t *err)
 #endif
 
 	SD_p.bpbAddr = 0;
-	if (memcmp(&SD_p.buff[54], "FAT16", 5)&&memcmp(&SD_p.buff[82],"FAT32", 5)) {
+	if (memcmp(&SD_p.buff[54], "FAT16", 5)&&memcmp(&SD_p.buff[82],"FAT32", 5)&&memcmp(&SD_p.buff[3], "EXFAT   ", 8)) {
 		// read BPB
 		memcpy(&(SD_p.bpbAddr), &SD_p.buff[0x1c6], 4);
 		SD_readBlock(SD_p.bpbAddr, err);	
@@ -455,6 +617,32 @@ void SD_init(uint8_t *err)
 
 	if (!((SD_p.buff[510]==0x55)&&(SD_p.buff[511]==0xaa))) { *err = 1; return; }
 
+#ifndef SDISK2P
+	SD_p.exfat = !memcmp(&SD_p.buff[3], "EXFAT   ", 8);
+	if (SD_p.exfat) {
+		uint8_t spcShift = SD_p.buff[0x6d];
+
+		if ((SD_p.buff[0x6c]!=9)||(spcShift>15)) { *err = 1; return; }
+		SD_p.bytesPerSector = 512;
+		SD_p.sectorsPerCluster = 1U<<spcShift;
+		SD_p.numFats = 1;				// only the first FAT is used
+		SD_p.fatAddr = SD_p.bpbAddr+readmem_long(&SD_p.buff[0x50]);
+		SD_p.fatSz = readmem_long(&SD_p.buff[0x54]);
+		SD_p.fatSectors = SD_p.fatSz;
+		SD_p.userAddr = SD_p.bpbAddr+readmem_long(&SD_p.buff[0x58]);
+		SD_p.clstCount = readmem_long(&SD_p.buff[0x5c]);
+		SD_p.rootClst = readmem_long(&SD_p.buff[0x60]);
+		SD_p.rootAddr = SD_p.userAddr+(SD_p.rootClst-2)*SD_p.sectorsPerCluster;
+		SD_p.rootSectors = 0;
+		SD_p.fat32 = 1;					// FAT entries are 32 bits
+		FILE_exMount(err);
+		if (*err) return;
+		SD_p.inited = 1;
+		DISABLE_CS;
+		return;
+	}
+#endif
+
 	{
 		uint16_t BPB_RsvdSecCnt = readmem_word(&SD_p.buff[14]);
 		SD_p.numFats = SD_p.buff[16];
@@ -495,6 +683,44 @@ void SD_init(uint8_t *err)
 	}
 }
 
+#ifndef SDISK2P
+// number of blocks read by command 18 for SD_profile
+#define SD_PROFILE_BLOCKS 8
+
+// time the card on reads of a sector and the blocks after it, nothing is written
+// SD_p.buff is used
+void SD_profile(uint32_t adr)
+{
+	uint8_t err = 0;
+	uint16_t t;
+
+	SD_INVALIDATE_CACHE;
+	SD_p.readMulti = 1;
+	// command 17
+	t = TCD5.CNT;
+	SD_readBlockBegin(adr, &err);
+	SD_p.tokenTicks = TCD5.CNT-t;
+	for (uint16_t i = 0; (i < 512) && !err; i++) SD_p.buff[i] = SPI_readByte(&err);
+	if (!err) SD_readBlockEnd(&err);
+	SD_p.readTicks = TCD5.CNT-t;
+	if (err) { DISABLE_CS; return; }
+	// command 18
+	t = TCD5.CNT;
+	SD_readMultiBegin(adr, &err);
+	for (uint8_t j = 0; (j < SD_PROFILE_BLOCKS) && !err; j++) {
+		SD_readMultiNext(&err);
+		for (uint16_t i = 0; (i < 512+2) && !err; i++) SPI_readByte(&err);	// with CRC
+	}
+	if (!err) SD_readMultiEnd(&err);
+	SD_p.multiTicks = (uint16_t)(TCD5.CNT-t)/SD_PROFILE_BLOCKS;
+	if (err) { DISABLE_CS; return; }
+	// a block straddling two sectors is read by command 18
+	// if starting and stopping the sequence costs less than the two token waits of commands 17,
+	// 8 * multi = overhead + 8 * (read - token), overhead < 2 * token
+	SD_p.readMulti = ((uint32_t)SD_p.multiTicks*4+(uint32_t)SD_p.tokenTicks*3 < (uint32_t)SD_p.readTicks*4);
+}
+#endif
+
 // wait until SD initialized
 // return 1 if newly detected
 uint8_t SD_detect(uint8_t start)
@@ -526,24 +752,76 @@ uint8_t SD_detect(uint8_t start)
 
 // ========== FILE ==========
 
+// number of elements of the fat for the file
+#define FILE_FAT_NUM (SD_p.fat32?(FAT_ELEMS/2):FAT_ELEMS)
+
+static uint32_t FILE_getFat(struct FILE *filep, uint16_t i)
+{
+	return SD_p.fat32?filep->map.fat32[i]:filep->map.fat16[i];
+}
+
+static void FILE_setFat(struct FILE *filep, uint16_t i, uint32_t ft)
+{
+	if (SD_p.fat32) filep->map.fat32[i] = ft;
+	else filep->map.fat16[i] = ft;
+}
+
+// make the extents of the file
+// return 0 if the file has too many extents
+static uint8_t FILE_initExt(struct FILE *filep, uint32_t clstLen, uint8_t *err)
+{
+	uint32_t ft, i, ofs1 = 0, ofs2 = 1;
+
+	ft = filep->startCluster;
+	filep->extNum = 1;
+	filep->map.ext[0][0] = ft;
+	filep->map.ext[0][1] = 1;
+
+	for (i = 0; i < clstLen-1; i++) {
+		if (EJECT) { *err = 1; return 1; }
+		if (ofs1 != ofs2) {
+			ofs1 = ft*(SD_p.fat32?4:2)/SD_p.bytesPerSector;
+			SD_readBlock(SD_p.fatAddr+ofs1, err);
+		}
+		if (SD_p.fat32) {
+			ft = (readmem_long(&SD_p.buff[ft*4%SD_p.bytesPerSector])&0x0fffffff);
+			if (ft>0x0ffffff6) break;
+		} else {
+			ft = readmem_word(&SD_p.buff[ft*2%SD_p.bytesPerSector]);
+			if (ft>0xfff6) break;
+		}
+		if (ft == filep->map.ext[filep->extNum-1][0]+filep->map.ext[filep->extNum-1][1]) {
+			filep->map.ext[filep->extNum-1][1]++;
+		} else {
+			if (filep->extNum == FILE_EXT_NUM) { filep->extNum = 0; return 0; }
+			filep->map.ext[filep->extNum][0] = ft;
+			filep->map.ext[filep->extNum++][1] = 1;
+		}
+		ofs2 = ft*(SD_p.fat32?4:2)/SD_p.bytesPerSector;
+	}
+	return 1;
+}
+
 void FILE_initFat(struct FILE *filep, uint8_t *err)
 {
 	uint32_t sectLen, clstLen, dltClst, ft, i, ofs1 = 0, ofs2 = 1;
 
 	sectLen = (filep->length+SD_p.bytesPerSector-1)/SD_p.bytesPerSector;
 	clstLen = (sectLen+SD_p.sectorsPerCluster-1)/SD_p.sectorsPerCluster;
-	dltClst = (clstLen+FAT_ELEMS-1)/FAT_ELEMS;
+	dltClst = (clstLen+FILE_FAT_NUM-1)/FILE_FAT_NUM;
+
+	filep->prevFatNum = filep->startCluster;
+	filep->prevClstNum = 0;
+	if (FILE_initExt(filep, clstLen, err)) return;
 
-	for (i = 0; i < FAT_ELEMS; i ++) {
+	for (i = 0; i < FILE_FAT_NUM; i ++) {
 		if (EJECT) { *err = 1; return; }
-		filep->fat[i] = SD_p.fat32?0x0ffffff7:0xfff7;	// initialize
+		FILE_setFat(filep, i, SD_p.fat32?0x0ffffff7:0xfff7);	// initialize
 	}
 
 	ft = filep->startCluster;
 
-	filep->fat[0] = ft;
-	filep->prevFatNum = ft;
-	filep->prevClstNum = 0;
+	FILE_setFat(filep, 0, ft);
 
 	for (i = 0; i < clstLen-1; i++) {
 		if (EJECT) { *err = 1; return; }
@@ -557,7 +835,7 @@ void FILE_initFat(struct FILE *filep, uint8_t *err)
 			ft = readmem_word(&SD_p.buff[ft*2%SD_p.bytesPerSector]);
 
 		if ((i+1)%dltClst == 0)
-			filep->fat[(i+1)/dltClst] = ft;
+			FILE_setFat(filep, (i+1)/dltClst, ft);
 		if (SD_p.fat32) {
 			if (ft>0x0ffffff6) break;
 		} else {
@@ -567,18 +845,471 @@ void FILE_initFat(struct FILE *filep, uint8_t *err)
 	}
 }
 
+// a file list entry is given as a record of 16 bytes,
+// name and extension (11), attribute (1), start cluster (4)
+typedef void (*FILE_RECFUNC)(uint8_t *rec, uint32_t adr, uint16_t ofs, void *arg);
+
+#ifndef SDISK2P
+// ========== exFAT ==========
+// names are seen in the 8.3 form, non ASCII characters become '_'
+// a name which does not fit 8.3 as it is gets the NameHash in it, as "LO1A2B~1.PO",
+// so that two long names do not give the same form
+// names are up-cased as ASCII, so the up-case table is not read
+
+// flag of the start cluster of a contiguous directory
+#define FILE_NOCHAIN 0x40000000
+
+// a file directory entry set being read
+struct FILE_EXSET {
+	uint32_t adr;				// sector and offset of the file entry
+	uint16_t ofs;
+	uint8_t left;				// secondary entries left
+	uint8_t attr;
+	uint32_t time;				// last modified time stamp
+	uint8_t noChain;			// 1 if the clusters are contiguous
+	uint32_t clst;				// first cluster
+	uint32_t len;				// data length
+	uint8_t nameLen;
+	uint8_t n;					// characters of the name read
+	uint8_t dot;				// position of the last dot + 1, 0 if none
+	uint8_t lossy;				// 1 if the name does not fit 8.3 as it is
+	uint16_t hash;				// NameHash
+	char name[11];				// 8.3 form
+	char tail[3];				// last 3 characters
+};
+
+// directories walked from the root by FILE_makeList, for ".." entries
+#define FILE_EXDEPTH 5
+static int32_t FILE_exPath[FILE_EXDEPTH];
+static uint8_t FILE_exDepth;
+
+typedef uint8_t (*FILE_EXFUNC)(uint32_t adr, uint16_t ofs, uint8_t *p, void *arg);
+
+// next cluster, 0 if none
+static uint32_t FILE_exNext(uint32_t ft, uint8_t noChain, uint8_t *err)
+{
+	if (noChain) return ft+1;
+	SD_readBlock(SD_p.fatAddr+ft*4/SD_p.bytesPerSector, err);
+	ft = 0x0fffffff&readmem_long(&SD_p.buff[(ft*4)%SD_p.bytesPerSector]);
+	return ((ft<2)||(ft>=0x0ffffff7))?0:ft;
+}
+
+// call f for each directory entry from sector s, offset ofs of cluster ft
+// until f returns non 0
+static void FILE_exWalk(uint32_t ft, uint8_t noChain, uint16_t s, uint16_t ofs, FILE_EXFUNC f, void *arg, uint8_t *err)
+{
+	while (ft && (ft-2 < SD_p.clstCount)) {
+		for (; s<SD_p.sectorsPerCluster; s++) {
+			uint32_t adr = SD_p.userAddr+(ft-2)*SD_p.sectorsPerCluster+s;
+
+			SD_readBlock(adr, err);
+			for (; ofs<512; ofs+=32) {
+				if (EJECT) *err = 1;
+				if (*err) return;
+				if (f(adr, ofs, SD_p.buff+ofs, arg)) return;
+			}
+			ofs = 0;
+		}
+		s = 0;
+		ft = FILE_exNext(ft, noChain, err);
+	}
+}
+
+static void FILE_exChar(struct FILE_EXSET *e, uint16_t c)
+{
+	char d = (c<0x80)?c:'_';
+
+	if ((c>=0x80)||(d==' ')) e->lossy = 1;
+	if ((d>='a')&&(d<='z')) d -= 0x20;
+	if (d==' ') d = '_';
+	if (d=='.') {
+		if (e->dot) e->lossy = 1;
+		e->dot = e->n+1;
+	}
+	if (e->n<8) e->name[e->n] = d;
+	e->tail[0] = e->tail[1];
+	e->tail[1] = e->tail[2];
+	e->tail[2] = d;
+	e->n++;
+}
+
+// read a directory entry
+// return 1 if a file entry set is read, 2 at the end of the directory
+static uint8_t FILE_exEntry(struct FILE_EXSET *e, uint32_t adr, uint16_t ofs, uint8_t *p)
+{
+	uint8_t i;
+
+	if (!p[0]) return 2;
+	if (p[0]==0x85) {			// file
+		e->adr = adr;
+		e->ofs = ofs;
+		e->left = p[1];
+		e->attr = p[4];
+		e->time = readmem_long(p+12);
+		e->n = e->dot = e->lossy = 0;
+		memset(e->name, ' ', 11);
+		return 0;
+	}
+	if (!e->left) return 0;
+	if (p[0]==0xc0) {			// stream extension
+		e->noChain = (p[1]>>1)&1;
+		e->nameLen = p[3];
+		e->hash = readmem_word(p+4);
+		e->clst = readmem_long(p+20);
+		e->len = readmem_long(p+28)?0xffffffff:readmem_long(p+24);
+	} else if (p[0]==0xc1) {	// file name
+		for (i=0; (i!=15)&&(e->n!=e->nameLen); i++) FILE_exChar(e, readmem_word(p+2+i*2));
+	} else if (!(p[0]&0x80)) {	// broken set
+		e->left = 0;
+		return 0;
+	}
+	if (--e->left) return 0;
+
+	// ".", "..", "._..." are not seen
+	if (e->name[0]=='.') return 0;
+	if (e->dot && (e->n-e->dot<=3)) {
+		for (i=e->dot-1; i<8; i++) e->name[i] = ' ';
+		memcpy(e->name+8, e->tail+3-(e->n-e->dot), e->n-e->dot);
+		if ((e->dot>9)||(e->dot==e->n)) e->lossy = 1;
+	} else if ((e->n>8)||e->dot) e->lossy = 1;
+	if (e->lossy) {
+		if (e->name[1]==' ') e->name[1] = '_';
+		for (i=0; i<4; i++) {
+			uint8_t h = (e->hash>>(12-i*4))&15;
+
+			e->name[2+i] = h+((h<10)?'0':'A'-10);
+		}
+		e->name[6] = '~';
+		e->name[7] = '1';
+	}
+	for (i=0; i<8; i++) if (e->name[i]=='.') e->name[i] = '_';
+	return 1;
+}
+
+static uint8_t FILE_exBitmapSub(uint32_t adr, uint16_t ofs, uint8_t *p, void *arg)
+{
+	if (p[0]==0x81) SD_p.bitmapClst = readmem_long(p+20);
+	return (p[0]==0x81)||!p[0];
+}
+
+// find the allocation bitmap
+static void FILE_exMount(uint8_t *err)
+{
+	SD_p.bitmapClst = 0;
+	FILE_exDepth = 0;
+	FILE_exWalk(SD_p.rootClst, 0, 0, 0, FILE_exBitmapSub, 0, err);
+	if (!SD_p.bitmapClst) *err = 1;
+}
+
+struct FILE_EXOPEN {
+	struct FILE_EXSET e;
+	struct FILE *filep;
+	char *name;
+	char *exts;
+	uint32_t max;
+	uint8_t found;
+	uint8_t noChain;
+};
+
+static uint8_t FILE_exOpenSub(uint32_t adr, uint16_t ofs, uint8_t *p, void *arg)
+{
+	struct FILE_EXOPEN *o = arg;
+	uint8_t r = FILE_exEntry(&o->e, adr, ofs, p);
+
+	if (r!=1) return r;
+	if (o->e.attr&0x0e) return 0;
+	if ((!o->exts||!memcmp(o->e.name+8, o->exts, 3))&&(!o->name||!memcmp(o->e.name, o->name, 8))
+		&&(!o->found||(o->e.time>=o->max))) {
+		struct FILE *filep = o->filep;
+
+		memcpy(filep->name, o->e.name, 11);
+		filep->name[11] = 0;
+		filep->length = o->e.len;
+		filep->startCluster = o->e.clst;
+		filep->protect = o->e.attr&1;
+		filep->isDir = (o->e.attr&0x10)?1:0;
+		o->noChain = o->e.noChain;
+		o->max = o->e.time;
+		o->found = 1;
+	}
+	return 0;
+}
+
+static void FILE_exOpen(struct FILE *filep, int32_t dir_cluster, char *name, char *exts, uint8_t *err)
+{
+	struct FILE_EXOPEN o;
+
+	o.e.left = 0;
+	o.filep = filep;
+	o.name = name;
+	o.exts = exts;
+	o.found = 0;
+	filep->valid = 0;
+	FILE_exWalk(dir_cluster?(dir_cluster&~FILE_NOCHAIN):SD_p.rootClst, (dir_cluster&FILE_NOCHAIN)?1:0, 0, 0, FILE_exOpenSub, &o, err);
+	if (*err) return;
+	if (!o.found) { *err = 1; return; }
+	if (filep->isDir) {
+		if (o.noChain) filep->startCluster |= FILE_NOCHAIN;
+	} else if (o.noChain) {
+		// contiguous, a sector is mapped without reading the FAT
+		uint32_t sectLen = (filep->length+SD_p.bytesPerSector-1)/SD_p.bytesPerSector;
+
+		filep->prevFatNum = filep->startCluster;
+		filep->prevClstNum = 0;
+		filep->extNum = 1;
+		filep->map.ext[0][0] = filep->startCluster;
+		filep->map.ext[0][1] = (sectLen+SD_p.sectorsPerCluster-1)/SD_p.sectorsPerCluster;
+	} else FILE_initFat(filep, err);
+	filep->valid = 1;
+	filep->written = 0;
+}
+
+static uint8_t FILE_exGetSub(uint32_t adr, uint16_t ofs, uint8_t *p, void *arg)
+{
+	return FILE_exEntry(arg, adr, ofs, p);
+}
+
+static void FILE_exGetEntry(struct FILELST *entry, char *name, char *ext, uint8_t *attr, uint32_t *stclst, uint8_t *err)
+{
+	struct FILE_EXSET e;
+	uint32_t adr = entry->blkAdr-SD_p.userAddr;
+
+	memset(e.name, ' ', 11);
+	e.attr = 0x10;
+	e.clst = 0;
+	e.noChain = 0;
+	if (!entry->blkAdr) {
+		// "UNMOUNT" or ".."
+		if (entry->offset) {
+			memcpy(e.name, "..", 2);
+			if (FILE_exDepth>=2) e.clst = FILE_exPath[FILE_exDepth-2];
+		}
+	} else {
+		e.left = 0;
+		FILE_exWalk(adr/SD_p.sectorsPerCluster+2, entry->offset>>15, adr%SD_p.sectorsPerCluster, entry->offset&0x1ff, FILE_exGetSub, &e, err);
+	}
+	if (name) memcpy(name, e.name, 8);
+	if (ext) memcpy(ext, e.name+8, 3);
+	if (attr) *attr = e.attr;
+	if (stclst) *stclst = e.clst|(((e.attr&0x10)&&e.noChain)?FILE_NOCHAIN:0);
+}
+
+struct FILE_EXLIST {
+	struct FILE_EXSET e;
+	char *exts;
+	FILE_RECFUNC f;
+	void *arg;
+	uint16_t flag;
+};
+
+static uint8_t FILE_exListSub(uint32_t adr, uint16_t ofs, uint8_t *p, void *arg)
+{
+	struct FILE_EXLIST *l = arg;
+	uint8_t r = FILE_exEntry(&l->e, adr, ofs, p);
+	uint8_t flg = 0;
+	char *targExt = l->exts;
+
+	if (r!=1) return r;
+	if (l->e.attr&0x0e) return 0;
+	while (targExt[0]) {
+		if (memcmp(l->e.name+8, targExt, 3)==0) {
+			flg = 1;
+			break;
+		}
+		targExt += 3;
+	}
+	if (flg || (l->e.attr&0b00010000)) {
+		uint8_t rec[16];
+
+		memcpy(rec, l->e.name, 11);
+		rec[11] = l->e.attr;
+		*(uint32_t *)(rec+12) = l->e.clst|(((l->e.attr&0x10)&&l->e.noChain)?FILE_NOCHAIN:0);
+		l->f(rec, l->e.adr, l->e.ofs|l->flag, l->arg);
+	}
+	return 0;
+}
+
+// follow the directory, to give ".." its parent
+static void FILE_exPathTo(int32_t dir_cluster)
+{
+	if (!dir_cluster) FILE_exDepth = 0;
+	else if ((FILE_exDepth>=2)&&(dir_cluster==FILE_exPath[FILE_exDepth-2])) FILE_exDepth--;
+	else if ((!FILE_exDepth||(dir_cluster!=FILE_exPath[FILE_exDepth-1]))&&(FILE_exDepth<FILE_EXDEPTH))
+		FILE_exPath[FILE_exDepth++] = dir_cluster;
+}
+
+static void FILE_exScan(int32_t dir_cluster, char *exts, FILE_RECFUNC f, void *arg, uint8_t *err)
+{
+	struct FILE_EXLIST l;
+
+	l.e.left = 0;
+	l.exts = exts;
+	l.f = f;
+	l.arg = arg;
+	l.flag = (dir_cluster&FILE_NOCHAIN)?0x8000:0;
+
+	// for ".." entry, exfat has none
+	if (dir_cluster) {
+		uint8_t rec[16];
+
+		memset(rec, ' ', 11);
+		memcpy(rec, "..", 2);
+		rec[11] = 0x10;
+		*(uint32_t *)(rec+12) = (FILE_exDepth>=2)?FILE_exPath[FILE_exDepth-2]:0;
+		f(rec, 0, 1, arg);
+	}
+	FILE_exWalk(dir_cluster?(dir_cluster&~FILE_NOCHAIN):SD_p.rootClst, l.flag?1:0, 0, 0, FILE_exListSub, &l, err);
+}
+
+struct FILE_EXFREE {
+	uint32_t adr;
+	uint16_t ofs;
+	uint8_t n;
+};
+
+// find 3 unused entries in a sector
+static uint8_t FILE_exFreeSub(uint32_t adr, uint16_t ofs, uint8_t *p, void *arg)
+{
+	struct FILE_EXFREE *f = arg;
+
+	if (adr!=f->adr) {
+		f->adr = adr;
+		f->n = 0;
+	}
+	if (p[0]&0x80) {
+		f->n = 0;
+		return 0;
+	}
+	if (!f->n++) f->ofs = ofs;
+	return (f->n==3);
+}
+
+// the sector of the allocation bitmap which has byte i
+static uint32_t FILE_exBitmapAdr(uint32_t i, uint8_t *err)
+{
+	uint32_t ft = SD_p.bitmapClst;
+	uint32_t s = i/SD_p.bytesPerSector;
+
+	while (s >= SD_p.sectorsPerCluster) {
+		ft = FILE_exNext(ft, 0, err);
+		if (!ft) *err = 1;
+		if (*err) return 0;
+		s -= SD_p.sectorsPerCluster;
+	}
+	return SD_p.userAddr+(ft-2)*SD_p.sectorsPerCluster+s;
+}
+
+static uint16_t FILE_exSum(uint16_t sum, uint8_t d)
+{
+	return ((sum&1)?0x8000:0)+(sum>>1)+d;
+}
+
+// set or clear the bits of len clusters from start in the allocation bitmap
+static void FILE_exMark(uint32_t start, uint32_t len, uint8_t set, uint8_t *err)
+{
+	uint32_t i, adr = 0;
+
+	for (i=start; i<start+len; i++) {
+		if ((i==start)||!(i%(SD_p.bytesPerSector*8))) {
+			if (i!=start) SD_writeBlock(adr, SD_p.buff, err);
+			if (*err) return;
+			adr = FILE_exBitmapAdr(i/8, err);
+			SD_readBlock(adr, err);
+			if (*err) return;
+		}
+		if (set) SD_p.buff[(i/8)%SD_p.bytesPerSector] |= (1<<(i%8));
+		else SD_p.buff[(i/8)%SD_p.bytesPerSector] &= ~(1<<(i%8));
+	}
+	SD_writeBlock(adr, SD_p.buff, err);
+}
+
+// create a contiguous file
+// the clusters are marked first and freed again if the entry set is not written
+// Notice : buffer2.sd.buf[512] is also used!
+static void FILE_exCreate(int32_t dir_cluster, const char *name, uint32_t length, uint8_t *err)
+{
+	struct FILE_EXFREE f;
+	uint32_t sectNum = (length+SD_p.bytesPerSector-1)/SD_p.bytesPerSector;
+	uint32_t clstLen = (sectNum+SD_p.sectorsPerCluster-1)/SD_p.sectorsPerCluster;
+	uint32_t i, start = 0, run = 0;
+	uint8_t set[96], j, n = 0;
+	uint16_t sum = 0;
+
+	f.adr = 0;
+	f.n = 0;
+	FILE_exWalk(dir_cluster?(dir_cluster&~FILE_NOCHAIN):SD_p.rootClst, (dir_cluster&FILE_NOCHAIN)?1:0, 0, 0, FILE_exFreeSub, &f, err);
+	if (*err) return;
+	if (f.n!=3) { *err = 1; return; }
+
+	// find free clusters in a row
+	if (!clstLen) clstLen = 1;
+	for (i=0; (i<SD_p.clstCount)&&(run<clstLen); i++) {
+		if (EJECT) { *err = 1; return; }
+		if (!(i%(SD_p.bytesPerSector*8))) {
+			SD_readBlock(FILE_exBitmapAdr(i/8, err), err);
+			if (*err) return;
+		}
+		if (SD_p.buff[(i/8)%SD_p.bytesPerSector]&(1<<(i%8))) run = 0;
+		else if (!run++) start = i;
+	}
+	if (run<clstLen) { *err = 1; return; }
+	FILE_exMark(start, clstLen, 1, err);
+	if (*err) return;
+
+	// file, stream extension and file name entries
+	memset(set, 0, 96);
+	set[0] = 0x85;
+	set[1] = 2;
+	set[4] = 0x20;
+	for (j=8; j<20; j+=4) *(uint32_t *)(set+j) = 0x00210000;	// 1980/1/1
+	set[32] = 0xc0;
+	set[33] = 0x03;				// no FAT chain
+	*(uint32_t *)(set+40) = length;
+	*(uint32_t *)(set+52) = start+2;
+	*(uint32_t *)(set+56) = length;
+	set[64] = 0xc1;
+	for (j=0; (j<8)&&(name[j]!=' '); j++) set[66+(n++)*2] = name[j];
+	if (name[8]!=' ') set[66+(n++)*2] = '.';
+	for (j=8; (j<11)&&(name[j]!=' '); j++) set[66+(n++)*2] = name[j];
+	set[35] = n;
+	for (j=0; j<n; j++) {
+		uint8_t c = set[66+j*2];
+
+		sum = FILE_exSum(sum, ((c>='a')&&(c<='z'))?c-0x20:c);
+		sum = FILE_exSum(sum, 0);
+	}
+	*(uint16_t *)(set+36) = sum;
+	sum = 0;
+	for (j=0; j<96; j++) if ((j!=2)&&(j!=3)) sum = FILE_exSum(sum, set[j]);
+	*(uint16_t *)(set+2) = sum;
+	SD_writeBytes(f.adr, f.ofs, set, 96, err);
+	if (*err) {
+		uint8_t err2 = 0;
+
+		FILE_exMark(start, clstLen, 0, &err2);
+	}
+}
+#endif
+
 // open the file
 void FILE_open(struct FILE *filep, int32_t dir_cluster, char *name, char *exts, uint8_t *err)
 {
-	uint8_t i, s;
+	uint8_t i;
+	uint16_t s;
 	uint32_t max_entry_adr = 0, max_entry_offset = 0;
 	uint16_t max_time = 0, max_date = 0;
 	uint8_t isRoot = !dir_cluster;
 	uint8_t isDir = 0, max_isDir = 0;
-	uint8_t spc = (isRoot&&!SD_p.fat32)?64:SD_p.sectorsPerCluster;
+	uint16_t spc = (isRoot&&!SD_p.fat32)?64:SD_p.sectorsPerCluster;
 	uint32_t ft = isRoot?2:dir_cluster;
 	uint32_t entry_adr = isRoot?SD_p.rootAddr:(SD_p.userAddr+((ft-2)*SD_p.sectorsPerCluster));
 	
+#ifndef SDISK2P
+	if (SD_p.exfat) {
+		FILE_exOpen(filep, dir_cluster, name, exts, err);
+		return;
+	}
+#endif
 	filep->valid = 0;
 	do {
 		for (s=0; s!=spc; s++) {
@@ -689,10 +1420,14 @@ void FILE_openAbs(struct FILE *filep, char *name, uint8_t *err)
 	} while (filep->isDir);
 }
 
-// get file name, extension, attribute and start cluster from a file list entry
-// used in UI.c
-void FILE_getEntry(struct FILELST *entry, char *name, char *ext, uint8_t *attr, uint32_t *stclst, uint8_t *err)
+static void FILE_getListEntry(struct FILELST *entry, char *name, char *ext, uint8_t *attr, uint32_t *stclst, uint8_t *err)
 {
+#ifndef SDISK2P
+	if (SD_p.exfat) {
+		FILE_exGetEntry(entry, name, ext, attr, stclst, err);
+		return;
+	}
+#endif
 	SD_readBlock(entry->blkAdr, err);
 	if (name) memcpy(name, &SD_p.buff[entry->offset+0], 8);
 	if (ext) memcpy(ext, &SD_p.buff[entry->offset+8], 3);
@@ -705,8 +1440,8 @@ static int compare(struct FILELST *a, struct FILELST *b)
 	uint8_t err = 0;
 	char name1[11], name2[11];
 		
-	FILE_getEntry(a, name1, name1+8, 0, 0, &err);
-	FILE_getEntry(b, name2, name1+8, 0, 0, &err);
+	FILE_getListEntry(a, name1, name1+8, 0, 0, &err);
+	FILE_getListEntry(b, name2, name1+8, 0, 0, &err);
 	return memcmp(name1, name2, 11);
 }
 
@@ -734,21 +1469,21 @@ static void combSort(struct FILELST* array, uint16_t size){
 	}
 }
 
-// make file list and sort
-// used in UI.c
-uint16_t FILE_makeList(int32_t dir_cluster, struct FILELST *list, char *exts, uint8_t *err)
+// call f for each file of the extensions and each directory
+static void FILE_scan(int32_t dir_cluster, char *exts, FILE_RECFUNC f, void *arg, uint8_t *err)
 {
-	uint16_t entryNum = 0;
 	uint16_t i, s;
 	uint8_t isRoot = !dir_cluster;
-	uint8_t spc = (isRoot&&!SD_p.fat32)?64:SD_p.sectorsPerCluster;
+	uint16_t spc = (isRoot&&!SD_p.fat32)?64:SD_p.sectorsPerCluster;
 	uint32_t ft = isRoot?2:dir_cluster;
 	uint32_t entry_adr = isRoot?SD_p.rootAddr:(SD_p.userAddr+((ft-2)*SD_p.sectorsPerCluster));
 
-	// for "UNMOUNT" entry
-	list[entryNum].blkAdr = 0;
-	list[entryNum++].offset = 0;
-
+#ifndef SDISK2P
+	if (SD_p.exfat) {
+		FILE_exScan(dir_cluster, exts, f, arg, err);
+		return;
+	}
+#endif
 	// find extension
 	do {
 		for (s=0; s!=spc; s++) {
@@ -756,14 +1491,14 @@ uint16_t FILE_makeList(int32_t dir_cluster, struct FILELST *list, char *exts, ui
 
 			SD_readBlock(entry_adr, err);
 			for (i=0; i!=16; i++, entry_offset += 32) {
-				if (EJECT) { *err = 1; return 0; }
+				if (EJECT) { *err = 1; return; }
 				char ext_[3], name_[2], d;
 
 				memcpy(name_, &SD_p.buff[entry_offset+0], 2);
 			
 				// check first char
 				d = name_[0];
-				if (d==0x00) goto FILE_MFNL_EXIT;
+				if (d==0x00) return;
 				if (d==0xe5) continue;
 				if ((d==0x2e)&&(name_[1]!=0x2e)) continue;
 
@@ -784,10 +1519,12 @@ uint16_t FILE_makeList(int32_t dir_cluster, struct FILELST *list, char *exts, ui
 						targExt+=3;
 					}
 					if (flg || (d&0b00010000)) {
-						if (entryNum < 180) {
-							list[entryNum].blkAdr = entry_adr;
-							list[entryNum++].offset = entry_offset;
-						}
+						uint8_t rec[16];
+
+						memcpy(rec, &SD_p.buff[entry_offset+0], 11);
+						rec[11] = d;
+						*(uint32_t *)(rec+12) = readmem_word(SD_p.buff+entry_offset+26)+(uint32_t)readmem_word(SD_p.buff+entry_offset+20)*0x10000;
+						f(rec, entry_adr, entry_offset, arg);
 					}
 				}
 			}
@@ -804,21 +1541,427 @@ uint16_t FILE_makeList(int32_t dir_cluster, struct FILELST *list, char *exts, ui
 			entry_adr = SD_p.userAddr+((ft-2)*SD_p.sectorsPerCluster);
 		}
 	} while (!(isRoot&&!SD_p.fat32));
+}
 
-FILE_MFNL_EXIT:
-	combSort(list, entryNum);
-	
-	return entryNum;
+struct FILE_LIST {
+	struct FILELST *list;
+	uint16_t num;
+};
+
+static void FILE_listSub(uint8_t *rec, uint32_t adr, uint16_t ofs, void *arg)
+{
+	struct FILE_LIST *l = arg;
+
+	if (l->num < 180) {
+		l->list[l->num].blkAdr = adr;
+		l->list[l->num++].offset = ofs;
+	}
+}
+
+#ifndef SDISK2P
+// ========== index ==========
+// UNISDISK.IDX keeps the sorted file lists of directories,
+// so that thousands of entries are listed without sorting them again
+// it is used when "IDX=1" is given after the file names of UNISDISK.INI
+// sector 0 : "UNISDID2", next free sector (2), slots of 32 bytes from offset 32
+// slot : directory cluster (4), signature (4), first sector (2), number of entries (2), extensions (20)
+// a list of n sectors of records, at least one, is sorted in 2*n sectors
+// when the sectors run out, the lists are moved down over the dropped ones and the oldest is dropped
+#define FILE_IDX_SECTORS 256
+#define FILE_IDX_SLOTS 15
+#define FILE_IDX_EXTS 20
+
+static uint32_t FILE_idxAdr;		// the first sector of UNISDISK.IDX
+static uint32_t FILE_idxCur;		// the first sector of the list, 0 if not in the index
+
+// use UNISDISK.IDX or not, called after the card is inserted
+void FILE_idxEnable(uint8_t on)
+{
+	FILE_idxState = on?0:2;
+}
+
+struct FILE_IDXSIG {
+	uint32_t sig;
+	uint16_t num;
+};
+
+static void FILE_idxSigSub(uint8_t *rec, uint32_t adr, uint16_t ofs, void *arg)
+{
+	struct FILE_IDXSIG *s = arg;
+	uint8_t i;
+
+	for (i=0; i<16; i++) s->sig = ((s->sig<<1)|(s->sig>>31))+rec[i];
+	s->num++;
+}
+
+// sort 32 records of a sector
+static void FILE_idxSort(uint8_t *p)
+{
+	uint8_t i, j, t[16];
+
+	for (i=1; i<32; i++) {
+		memcpy(t, p+i*16, 16);
+		for (j=i; j && (memcmp(p+(j-1)*16, t, 11)>0); j--) memcpy(p+j*16, p+(j-1)*16, 16);
+		memcpy(p+j*16, t, 16);
+	}
+}
+
+struct FILE_IDXPUT {
+	uint8_t *buf;
+	uint32_t adr;
+	uint16_t num;
+	uint16_t max;
+	uint8_t err;
+};
+
+static void FILE_idxPutSub(uint8_t *rec, uint32_t adr, uint16_t ofs, void *arg)
+{
+	struct FILE_IDXPUT *p = arg;
+
+	if (p->num == p->max) return;
+	memcpy(p->buf+(p->num%32)*16, rec, 16);
+	if (!(++p->num%32)) {
+		FILE_idxSort(p->buf);
+		if (!p->err) SD_writeBlock(p->adr++, p->buf, &p->err);
+	}
+}
+
+static void FILE_idxLoad(uint32_t adr, uint8_t *p, uint8_t *err)
+{
+	uint8_t *b = SD_p.buff;
+
+	SD_changeBuff(p);
+	SD_readBlock(adr, err);
+	SD_changeBuff(b);
+}
+
+// merge runs of w sectors from src to dst
+// work has 2 sectors for input, SD_p.buff is for output
+static void FILE_idxMerge(uint32_t src, uint32_t dst, uint16_t len, uint16_t w, uint8_t *work, uint8_t *err)
+{
+	uint8_t *in[2] = {work, work+512};
+	uint16_t base;
+
+	for (base=0; base<len; base+=2*w) {
+		uint16_t sec[2], end[2];
+		uint8_t ofs[2] = {0, 0}, o = 0, k;
+
+		sec[0] = base;
+		end[0] = sec[1] = (base+w<len)?(base+w):len;
+		end[1] = (base+2*w<len)?(base+2*w):len;
+		for (k=0; k<2; k++) if (sec[k]<end[k]) FILE_idxLoad(src+sec[k], in[k], err);
+		while ((sec[0]<end[0])||(sec[1]<end[1])) {
+			if (EJECT) *err = 1;
+			if (*err) return;
+			k = ((sec[1]>=end[1])||((sec[0]<end[0])&&(memcmp(in[0]+ofs[0]*16, in[1]+ofs[1]*16, 11)<=0)))?0:1;
+			memcpy(SD_p.buff+o*16, in[k]+ofs[k]*16, 16);
+			if (++o==32) {
+				SD_writeBlock(dst++, SD_p.buff, err);
+				o = 0;
+			}
+			if (++ofs[k]==32) {
+				ofs[k] = 0;
+				if (++sec[k]<end[k]) FILE_idxLoad(src+sec[k], in[k], err);
+			}
+		}
+	}
+}
+
+// open or create UNISDISK.IDX, it should be contiguous
+// return 1 if usable
+static uint8_t FILE_idxOpen(uint8_t *work)
+{
+	struct FILE *filep = (struct FILE *)work;
+	uint8_t err = 0;
+
+	if (FILE_idxState) return (FILE_idxState==1);
+	FILE_idxState = 2;
+	FILE_open(filep, 0, "UNISDISK", "IDX", &err);
+	if (err) {
+		err = 0;
+		// Notice : buffer2.sd.buf[512] is also used!
+		FILE_create(0, "UNISDISKIDX", FILE_IDX_SECTORS*512UL, &err);
+		if (err) return 0;
+		FILE_open(filep, 0, "UNISDISK", "IDX", &err);
+		if (err) return 0;
+	}
+	if ((filep->extNum!=1)||(filep->length<FILE_IDX_SECTORS*512UL)) return 0;
+	FILE_idxAdr = SD_p.userAddr+(filep->map.ext[0][0]-2)*SD_p.sectorsPerCluster;
+	SD_readBlock(FILE_idxAdr, &err);
+	if (err) return 0;
+	if (memcmp(SD_p.buff, "UNISDID2", 8)) {
+		memset(SD_p.buff, 0, 512);
+		memcpy(SD_p.buff, "UNISDID2", 8);
+		*(uint16_t *)(SD_p.buff+8) = 1;
+		SD_writeBlock(FILE_idxAdr, SD_p.buff, &err);
+		if (err) return 0;
+	}
+	FILE_idxState = 1;
+	return 1;
+}
+
+// the sectors of the list of a slot
+static uint16_t FILE_idxLen(uint8_t *slot)
+{
+	uint16_t num = readmem_word(slot+10);
+
+	return num?((num+31)/32):1;
+}
+
+// the slot of the directory and the extensions, FILE_IDX_SLOTS if none
+static uint8_t FILE_idxFind(uint8_t *hdr, int32_t dir_cluster, char *exts)
+{
+	uint8_t i;
+
+	for (i=0; i<FILE_IDX_SLOTS; i++) {
+		uint8_t *slot = hdr+32+i*32;
+
+		if (readmem_word(slot+8)&&(readmem_long(slot)==dir_cluster)&&!strncmp((char *)slot+12, exts, FILE_IDX_EXTS)) break;
+	}
+	return i;
+}
+
+// the slot of the list made first, which is the lowest, FILE_IDX_SLOTS if none
+static uint8_t FILE_idxOldest(uint8_t *hdr)
+{
+	uint8_t i, k = FILE_IDX_SLOTS;
+
+	for (i=0; i<FILE_IDX_SLOTS; i++) {
+		uint16_t first = readmem_word(hdr+32+i*32+8);
+
+		if (first&&((k==FILE_IDX_SLOTS)||(first<readmem_word(hdr+32+k*32+8)))) k = i;
+	}
+	return k;
+}
+
+// move the lists down over the sectors of the dropped ones, hdr is the header and is updated
+// the slots of the lists to be moved are cleared on the card until they are moved
+static void FILE_idxCompact(uint8_t *hdr, uint8_t *err)
+{
+	uint16_t from[FILE_IDX_SLOTS], next = 1;
+	uint8_t ord[FILE_IDX_SLOTS], n, i, k, moved = 0;
+
+	for (i=0; i<FILE_IDX_SLOTS; i++) from[i] = readmem_word(hdr+32+i*32+8);
+	// the lists in the order of their sectors
+	for (n=0; n<FILE_IDX_SLOTS; n++) {
+		k = FILE_IDX_SLOTS;
+		for (i=0; i<FILE_IDX_SLOTS; i++) {
+			if (from[i]&&(!n||(from[i]>from[ord[n-1]]))&&((k==FILE_IDX_SLOTS)||(from[i]<from[k]))) k = i;
+		}
+		if (k==FILE_IDX_SLOTS) break;
+		ord[n] = k;
+	}
+	for (i=0; i<n; i++) {
+		uint8_t *slot = hdr+32+ord[i]*32;
+
+		if (from[ord[i]]!=next) {
+			*(uint16_t *)(slot+8) = 0;
+			moved = 1;
+		}
+		next += FILE_idxLen(slot);
+	}
+	*(uint16_t *)(hdr+8) = next;
+	if (!moved) return;
+	SD_writeBlock(FILE_idxAdr, hdr, err);
+	if (*err) return;
+	next = 1;
+	for (i=0; i<n; i++) {
+		uint8_t *slot = hdr+32+ord[i]*32;
+		uint16_t len = FILE_idxLen(slot), j;
+
+		if (from[ord[i]]!=next) {
+			for (j=0; j<len; j++) {
+				SD_readBlock(FILE_idxAdr+from[ord[i]]+j, err);
+				if (*err) return;
+				SD_writeBlock(FILE_idxAdr+next+j, SD_p.buff, err);
+				if (*err) return;
+			}
+			*(uint16_t *)(slot+8) = next;
+		}
+		next += len;
+	}
+	SD_writeBlock(FILE_idxAdr, hdr, err);
 }
 
+// find the list of the directory in the index, or make it
+// return the number of entries, 0 if the index is not usable
+// work should have 1024 bytes
+static uint16_t FILE_idxMake(int32_t dir_cluster, uint8_t *work, char *exts, uint8_t *err)
+{
+	struct FILE_IDXSIG s;
+	struct FILE_IDXPUT p;
+	uint8_t *hdr = work+512, *slot, i, k;
+	uint16_t next, len, w;
+	uint32_t a, b, t;
+
+	FILE_idxCur = 0;
+	if (WP || (strlen(exts)>=FILE_IDX_EXTS) || !FILE_idxOpen(work)) return 0;
+
+	// a list checked since the card is inserted is used without scanning the directory
+	SD_readBlock(FILE_idxAdr, err);
+	if (*err) return 0;
+	k = FILE_idxFind(SD_p.buff, dir_cluster, exts);
+	if ((k<FILE_IDX_SLOTS)&&((FILE_idxSeen>>k)&1)) {
+		slot = SD_p.buff+32+k*32;
+		FILE_idxCur = FILE_idxAdr+readmem_word(slot+8);
+		return readmem_word(slot+10)+1;
+	}
+
+	// the signature of the directory
+	s.sig = 0;
+	s.num = 0;
+	FILE_scan(dir_cluster, exts, FILE_idxSigSub, &s, err);
+	if (*err) return 0;
+	if (s.num > (FILE_IDX_SECTORS-1)/2*32) s.num = (FILE_IDX_SECTORS-1)/2*32;
+
+	SD_readBlock(FILE_idxAdr, err);
+	if (*err) return 0;
+	memcpy(hdr, SD_p.buff, 512);
+	if (k<FILE_IDX_SLOTS) {
+		slot = hdr+32+k*32;
+		if ((readmem_long(slot+4)==s.sig)&&(readmem_word(slot+10)==s.num)) {
+			FILE_idxSeen |= (1<<k);
+			FILE_idxCur = FILE_idxAdr+readmem_word(slot+8);
+			return s.num+1;
+		}
+		// the directory is changed
+		*(uint16_t *)(slot+8) = 0;
+	} else {
+		for (k=0; (k<FILE_IDX_SLOTS)&&readmem_word(hdr+32+k*32+8); k++) ;
+		if (k==FILE_IDX_SLOTS) {
+			k = FILE_idxOldest(hdr);
+			*(uint16_t *)(hdr+32+k*32+8) = 0;
+		}
+	}
+	FILE_idxSeen &= ~(1<<k);
+
+	// room to sort the list in
+	len = (s.num+31)/32;
+	if (!len) len = 1;
+	while (readmem_word(hdr+8)+2*len > FILE_IDX_SECTORS) {
+		FILE_idxCompact(hdr, err);
+		if (*err) return 0;
+		if (readmem_word(hdr+8)+2*len <= FILE_IDX_SECTORS) break;
+		i = FILE_idxOldest(hdr);
+		*(uint16_t *)(hdr+32+i*32+8) = 0;
+		FILE_idxSeen &= ~(1<<i);
+	}
+	next = readmem_word(hdr+8);
+	// the dropped slots are cleared on the card before their sectors are written over
+	SD_writeBlock(FILE_idxAdr, hdr, err);
+	if (*err) return 0;
+
+	// records sorted in each sector
+	a = FILE_idxAdr+next;
+	p.buf = work;
+	p.adr = a;
+	p.num = 0;
+	p.max = s.num;
+	p.err = 0;
+	FILE_scan(dir_cluster, exts, FILE_idxPutSub, &p, err);
+	if (!*err) *err = p.err;
+	if (*err) return 0;
+	if (p.num%32) {
+		memset(work+(p.num%32)*16, 0xff, (32-p.num%32)*16);
+		FILE_idxSort(work);
+		SD_writeBlock(p.adr, work, err);
+		if (*err) return 0;
+	}
+	s.num = p.num;
+
+	// merge sort
+	b = a+len;
+	for (w=1; w<(s.num+31)/32; w*=2) {
+		FILE_idxMerge(a, b, (s.num+31)/32, w, work, err);
+		if (*err) return 0;
+		t = a;
+		a = b;
+		b = t;
+	}
+
+	SD_readBlock(FILE_idxAdr, err);
+	if (*err) return 0;
+	slot = SD_p.buff+32+k*32;
+	*(uint32_t *)(slot) = dir_cluster;
+	*(uint32_t *)(slot+4) = s.sig;
+	*(uint16_t *)(slot+8) = a-FILE_idxAdr;
+	*(uint16_t *)(slot+10) = s.num;
+	strncpy((char *)slot+12, exts, FILE_IDX_EXTS);
+	*(uint16_t *)(SD_p.buff+8) = next+2*len;
+	SD_writeBlock(FILE_idxAdr, SD_p.buff, err);
+	if (*err) return 0;
+	FILE_idxSeen |= (1<<k);
+	FILE_idxCur = a;
+	return s.num+1;
+}
+#endif
+
+// make file list and sort
+// entry 0 is for "UNMOUNT", list is also used as a work area of 1024 bytes
+// used in UI.c
+uint16_t FILE_makeList(int32_t dir_cluster, struct FILELST *list, char *exts, uint8_t *err)
+{
+	struct FILE_LIST l;
+
+#ifndef SDISK2P
+	if (SD_p.exfat) FILE_exPathTo(dir_cluster);
+	l.num = FILE_idxMake(dir_cluster, (uint8_t *)list, exts, err);
+	if (l.num || *err) return l.num;
+#endif
+	l.list = list;
+	l.num = 0;
+
+	// for "UNMOUNT" entry
+	list[l.num].blkAdr = 0;
+	list[l.num++].offset = 0;
+
+	FILE_scan(dir_cluster, exts, FILE_listSub, &l, err);
+	if (*err) return 0;
+	combSort(list, l.num);
+	return l.num;
+}
+
+// get file name, extension, attribute and start cluster of entry i of the file list
+// used in UI.c
+void FILE_getEntry(struct FILELST *list, uint16_t i, char *name, char *ext, uint8_t *attr, uint32_t *stclst, uint8_t *err)
+{
+#ifndef SDISK2P
+	if (FILE_idxCur) {
+		uint8_t *rec;
+
+		i--;
+		SD_readBlock(FILE_idxCur+i/32, err);
+		rec = SD_p.buff+(i%32)*16;
+		if (name) memcpy(name, rec, 8);
+		if (ext) memcpy(ext, rec+8, 3);
+		if (attr) *attr = rec[11];
+		if (stclst) *stclst = readmem_long(rec+12);
+		return;
+	}
+#endif
+	FILE_getListEntry(&list[i], name, ext, attr, stclst, err);
+}
+
+
 void FILE_prepareFat(struct FILE *filep, uint32_t *fat, uint32_t clstLen, uint32_t clstNum, uint8_t *err)
 {
 	uint16_t dltClst;
 	uint16_t i;
 	uint32_t ofs1=0, ofs2=1;
 
-	dltClst = (clstLen+FAT_ELEMS-1)/FAT_ELEMS;
-	*fat = filep->fat[clstNum / dltClst];
+	if (filep->extNum) {
+		for (i = 0; i < filep->extNum; i++) {
+			if (clstNum < filep->map.ext[i][1]) {
+				*fat = filep->map.ext[i][0]+clstNum;
+				return;
+			}
+			clstNum -= filep->map.ext[i][1];
+		}
+		*fat = SD_p.fat32?0x0ffffff7:0xfff7;
+		return;
+	}
+	dltClst = (clstLen+FILE_FAT_NUM-1)/FILE_FAT_NUM;
+	*fat = FILE_getFat(filep, clstNum / dltClst);
 
 	for (i = 0; i < (clstNum%dltClst); i++) {
 		if (EJECT) { *err = 1; return; }
@@ -854,12 +1997,32 @@ void FILE_rw_sub(uint32_t long_sector, struct FILE *filep, uint8_t *err)
 	}
 }
 
+// block address of a sector of the file
+static uint32_t FILE_blockAdr(struct FILE *filep, uint32_t long_sector, uint8_t *err)
+{
+	FILE_rw_sub(long_sector, filep, err);
+	return SD_p.userAddr+(filep->prevFatNum-2)*SD_p.sectorsPerCluster+long_sector%SD_p.sectorsPerCluster;
+}
+
+// cluster on the card of a sector of the file
+uint32_t FILE_cluster(struct FILE *filep, uint32_t long_sector, uint8_t *err)
+{
+	FILE_rw_sub(long_sector, filep, err);
+	return filep->prevFatNum;
+}
+
+// give the cluster on the card of a sector of the file to skip walking the FAT
+void FILE_setCluster(struct FILE *filep, uint32_t long_sector, uint32_t fat)
+{
+	filep->prevClstNum = long_sector/SD_p.sectorsPerCluster;
+	filep->prevFatNum = fat;
+}
+
 // prepare reading a sector from the file
 void FILE_readBegin(struct FILE *filep, uint32_t long_sector, uint8_t *err)
 {
 	if (!filep->valid) {*err=1; return;}
-	FILE_rw_sub(long_sector, filep, err);
-	SD_readBlockBegin(SD_p.userAddr+(filep->prevFatNum-2)*SD_p.sectorsPerCluster+long_sector%SD_p.sectorsPerCluster, err);
+	SD_readBlockBegin(FILE_blockAdr(filep, long_sector, err), err);
 }
 
 // end the reading
@@ -877,12 +2040,20 @@ void FILE_read(struct FILE *filep, uint32_t long_sector, uint8_t *err)
 	FILE_readEnd(err);
 }
 
+#ifndef SDISK2P
+// read a sector from the file through the cache of SD_readBlock
+void FILE_readCached(struct FILE *filep, uint32_t long_sector, uint8_t *err)
+{
+	if (!filep->valid) {*err=1; return;}
+	SD_readBlock(FILE_blockAdr(filep, long_sector, err), err);
+}
+#endif
+
 // prepare writing a sector to the file
 void FILE_writeBegin(struct FILE *filep, uint32_t long_sector, uint8_t *err)
 {
 	if (!filep->valid) {*err=1; return;}
-	FILE_rw_sub(long_sector, filep, err);
-	SD_writeBlockBegin(SD_p.userAddr+(filep->prevFatNum-2)*SD_p.sectorsPerCluster+long_sector%SD_p.sectorsPerCluster, err);
+	SD_writeBlockBegin(FILE_blockAdr(filep, long_sector, err), err);
 	if (!*err) filep->written = 1;
 }
 
@@ -891,6 +2062,106 @@ void FILE_writeEnd(uint8_t *err)
 {
 	SD_writeBlockEnd(err);
 }
+
+// prepare reading sectors in sequence from the file
+// a multi block command is kept running inside each cluster
+void FILE_readSeqBegin(struct FILE *filep, uint32_t long_sector, uint8_t *err)
+{
+	if (!filep->valid) {*err=1; return;}
+	SD_p.seqSector = long_sector;
+	SD_p.seqState = 0;
+}
+
+// get ready for reading the next sector of the sequence
+void FILE_readSeqNext(struct FILE *filep, uint8_t *err)
+{
+#ifndef SDISK2P
+	if (!SD_p.readMulti) {
+		if (SD_p.seqState == 3) SD_readBlockEnd(err);
+		SD_p.seqState = 0;
+		if (*err) return;
+		SD_readBlockBegin(FILE_blockAdr(filep, SD_p.seqSector, err), err);
+		if (*err) return;
+		SD_p.seqSector++;
+		SD_p.seqState = 3;
+		return;
+	}
+#endif
+	if (SD_p.seqState == 2) {
+		SPI_readByte(err);			// discard CRC
+		SPI_readByte(err);
+		if (*err) return;
+		SD_p.seqState = 1;
+	}
+	if (!SD_p.seqState || !(SD_p.seqSector%SD_p.sectorsPerCluster)) {
+		if (SD_p.seqState) SD_readMultiEnd(err);
+		SD_p.seqState = 0;
+		if (*err) return;
+		SD_readMultiBegin(FILE_blockAdr(filep, SD_p.seqSector, err), err);
+		if (*err) return;
+		SD_p.seqState = 1;
+	}
+	SD_readMultiNext(err);
+	if (*err) return;
+	SD_p.seqSector++;
+	SD_p.seqState = 2;
+}
+
+// end reading the sequence
+void FILE_readSeqEnd(uint8_t *err)
+{
+	if (SD_p.seqState == 3) {
+		SD_readBlockEnd(err);
+		SD_p.seqState = 0;
+		return;
+	}
+	if (SD_p.seqState == 2) {
+		SPI_readByte(err);			// discard CRC
+		SPI_readByte(err);
+	}
+	if (SD_p.seqState) SD_readMultiEnd(err);
+	SD_p.seqState = 0;
+}
+
+// prepare writing sectors in sequence to the file
+// a multi block command is kept running inside each cluster
+void FILE_writeSeqBegin(struct FILE *filep, uint32_t long_sector, uint8_t *err)
+{
+	if (!filep->valid) {*err=1; return;}
+	SD_p.seqSector = long_sector;
+	SD_p.seqState = 0;
+	filep->written = 1;
+}
+
+// get ready for writing the next sector of the sequence
+void FILE_writeSeqNext(struct FILE *filep, uint8_t *err)
+{
+	if (SD_p.seqState == 2) {
+		SD_writeMultiBlockEnd(err);
+		if (*err) return;
+		SD_p.seqState = 1;
+	}
+	if (!SD_p.seqState || !(SD_p.seqSector%SD_p.sectorsPerCluster)) {
+		if (SD_p.seqState) SD_writeMultiEnd(err);
+		SD_p.seqState = 0;
+		if (*err) return;
+		SD_writeMultiBegin(FILE_blockAdr(filep, SD_p.seqSector, err), err);
+		if (*err) return;
+		SD_p.seqState = 1;
+	}
+	SD_writeMultiNext(err);
+	if (*err) return;
+	SD_p.seqSector++;
+	SD_p.seqState = 2;
+}
+
+// end writing the sequence
+void FILE_writeSeqEnd(uint8_t *err)
+{
+	if (SD_p.seqState == 2) SD_writeMultiBlockEnd(err);
+	if (SD_p.seqState) SD_writeMultiEnd(err);
+	SD_p.seqState = 0;
+}
 	
 void SD_alloc(uint32_t adr, uint16_t ofsH, uint16_t ofsL, uint32_t clstLen, uint8_t isFat, uint8_t isClr, uint8_t *err)
 {
@@ -913,7 +2184,7 @@ void SD_alloc(uint32_t adr, uint16_t ofsH, uint16_t ofsL, uint32_t clstLen, uint
 		} else ft = (SD_p.fat32?0xfffffff:0xffff);
 		if ((clstNum==clstLen) || (d==0)) {
 			if ((d==0)&&isClr&&(clstNum<clstLen)) {
-				for (uint8_t s=0; s<SD_p.sectorsPerCluster; s++) {
+				for (uint16_t s=0; s<SD_p.sectorsPerCluster; s++) {
 					SD_writeBlockBegin(SD_p.userAddr+(ft-2)*SD_p.sectorsPerCluster+s, err);
 					for (uint16_t j=0; j<512; j++) {
 						SPI_writeByte(0, err);
@@ -951,16 +2222,24 @@ void SD_alloc(uint32_t adr, uint16_t ofsH, uint16_t ofsL, uint32_t clstLen, uint
 // Notice : buffer2.sd.buf[512] is also used!
 void FILE_create(int32_t dir_cluster, const char *name, uint32_t length, uint8_t *err)
 {
-	uint8_t i, s, found = 0;
-	uint16_t entry_offset;
+	uint8_t i, found = 0;
+	uint16_t s, entry_offset;
 	uint8_t isRoot = !dir_cluster;
-	uint8_t spc = (isRoot&&!SD_p.fat32)?64:SD_p.sectorsPerCluster;
+	uint16_t spc = (isRoot&&!SD_p.fat32)?64:SD_p.sectorsPerCluster;
 	uint32_t ft = isRoot?2:dir_cluster;
 	uint32_t entry_adr = isRoot?SD_p.rootAddr:(SD_p.userAddr+((ft-2)*SD_p.sectorsPerCluster));
 	uint32_t sectNum = (length+SD_p.bytesPerSector-1)/SD_p.bytesPerSector;
 	uint32_t adr;
 	uint16_t ofsH, ofsL;
 
+#ifndef SDISK2P
+	// the lists of the index are checked again
+	FILE_idxSeen = 0;
+	if (SD_p.exfat) {
+		FILE_exCreate(dir_cluster, name, length, err);
+		return;
+	}
+#endif
 	do {
 		for (s=0; s!=spc; s++) {
 			entry_offset = 0;
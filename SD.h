@@ -26,11 +26,25 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 
 #include <avr/io.h>
 
-#ifdef SDISK2P
+// the SPI functions touch the hardware only through SPI_SEND, SPI_RECV and SPI_DONE
+#if defined(HOST)
+#define SPI_SS_bm	0b00010000
+#define SPI_MOSI_bm	0b10000000
+#define SPI_MISO_bm	0b01000000
+#define SPI_SCK_bm	0b00100000
+#define SPI_SEND(c) HAL_spiSend(c)
+#define SPI_RECV HAL_spiRecv()
+#define SPI_DONE HAL_spiDone()
+#define EJECT (VPORT0_IN&PIN5_bm)
+#define WP (VPORT1_IN&PIN3_bm)
+#elif defined(SDISK2P)
 #define SPI_SS_bm	0b00000100
 #define SPI_MOSI_bm	0b00001000
 #define SPI_MISO_bm	0b00010000
 #define SPI_SCK_bm	0b00100000
+#define SPI_SEND(c) (SPDR=(c))
+#define SPI_RECV SPDR
+#define SPI_DONE (SPSR&(1<<SPIF))
 #define EJECT (PIND&(1<<3))
 #define WP (PIND&(1<<6))
 #else
@@ -40,6 +54,9 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #define SPI_MOSI_bm	0b10000000
 #define SPI_MISO_bm	0b01000000
 #define SPI_SCK_bm	0b00100000
+#define SPI_SEND(c) (SPIC.DATA=(c))
+#define SPI_RECV SPIC.DATA
+#define SPI_DONE (SPIC.STATUS&SPI_IF_bm)
 #endif
 
 // SD card properties
@@ -50,7 +67,7 @@ struct SD {
 	uint32_t bpbAddr;
 	uint8_t blkAdrAccs;			// 1 if block address access
 	uint16_t bytesPerSector;
-	uint8_t sectorsPerCluster;
+	uint16_t sectorsPerCluster;
 	uint32_t fatAddr;			// the beginning of FAT
 	uint32_t fatSectors;
 	uint32_t fatSz;
@@ -58,7 +75,20 @@ struct SD {
 	uint32_t rootAddr;			// the beginning of RDE
 	uint32_t rootSectors;
 	uint32_t userAddr;			// the beginning of user area
-	uint8_t fat32;				// 0 : fat16, 1 : fat32
+	uint8_t fat32;				// 0 : fat16, 1 : fat32 or exfat
+#ifndef SDISK2P
+	uint8_t exfat;				// 1 : exfat
+	uint32_t rootClst;			// first cluster of the root directory, exfat
+	uint32_t clstCount;			// number of clusters, exfat
+	uint32_t bitmapClst;		// first cluster of the allocation bitmap, exfat
+	// measured by SD_profile, in 8u sec ticks
+	uint16_t tokenTicks;		// command 17 until the data token
+	uint16_t readTicks;			// a block by command 17
+	uint16_t multiTicks;		// a block in a command 18 sequence
+	uint8_t readMulti;			// 1 : FILE_readSeq uses command 18
+#endif
+	uint32_t seqSector;			// next sector of FILE_readSeq / FILE_writeSeq
+	uint8_t seqState;			// 0 : no command, 1 : command issued, 2 : in a block, 3 : in a single block
 };
 extern struct SD SD_p;
 
@@ -68,22 +98,31 @@ extern struct SD SD_p;
 #define FAT_ELEMS 64
 #endif
 
+// extents of a file, if the file has more, the fat is used
+#define FILE_EXT_NUM (FAT_ELEMS/4)
+
 // FILE properties
-// 291 bytes for UNISDISK, 163 bytes for SDISP2P
+// 161 bytes for UNISDISK, 97 bytes for SDISP2P
 struct FILE {
 	uint8_t valid;
 	uint32_t startCluster;		// start cluster
-	uint32_t fat[FAT_ELEMS];	// the fat for the file
+	uint8_t extNum;				// number of extents, 0 : the fat is used
+	union {
+		uint32_t ext[FILE_EXT_NUM][2];	// extents : first cluster and number of clusters
+		uint32_t fat32[FAT_ELEMS/2];	// the fat for the file, FAT32, half the entries to keep 512 bytes of SRAM
+		uint16_t fat16[FAT_ELEMS];		// the fat for the file, FAT16
+	} map;
 	uint32_t prevFatNum;		// previous Fat number for the file
 	uint32_t prevClstNum;		// previous cluster number for the file
 	uint8_t protect;			// write protect
 	uint32_t length;			// file length
-	uint32_t isDir;
+	uint8_t isDir;
 	char name[12];				// file name and extension
 	uint8_t written;
 };
 
 // used by UI
+// on exfat, bit 15 of offset is set if the directory is contiguous
 struct FILELST {
 	uint32_t blkAdr;
 	uint16_t offset;
@@ -92,12 +131,47 @@ struct FILELST {
 // write a byte data to spi
 void SPI_writeByte(uint8_t c, uint8_t *err);
 
+// write bytes to spi
+void SPI_writeBytes(const uint8_t *p, uint16_t len, uint8_t *err);
+
+// write bytes in the program memory to spi
+void SPI_writeBytes_P(const uint8_t *p, uint16_t len, uint8_t *err);
+
 // read data from spi
 uint8_t SPI_readByte(uint8_t *err);
 
+// start receiving bytes one after another
+void SPI_readPipeBegin(void);
+
+// get the byte being received, and start receiving the next one if more
+uint8_t SPI_readPipe(uint8_t more, uint8_t *err);
+
 // initialization SD card
 void SD_init(uint8_t *err);
 
+#ifndef SDISK2P
+// time the card on reads from a sector
+void SD_profile(uint32_t adr);
+#endif
+
+// prepare reading a block
+void SD_readBlockBegin(uint32_t block_adr, uint8_t *err);
+
+// end reading the block
+void SD_readBlockEnd(uint8_t *err);
+
+// read a block into SD_p.buff, the last block read is cached on UNISDISK
+void SD_readBlock(uint32_t block_adr, uint8_t *err);
+
+// only the block is cached from now, 0xffffffff : any block
+void SD_holdCache(uint32_t block_adr);
+
+// prepare writing a block
+void SD_writeBlockBegin(uint32_t block_adr, uint8_t *err);
+
+// end writing the block
+void SD_writeBlockEnd(uint8_t *err);
+
 // change buffer
 void SD_changeBuff(uint8_t *b);
 
@@ -124,6 +198,11 @@ void FILE_openAbs(struct FILE *filep, char *name, uint8_t *err);
 // read a sector from the file
 void FILE_read(struct FILE *filep, uint32_t long_sector, uint8_t *err);
 
+#ifndef SDISK2P
+// read a sector from the file into SD_p.buff, the last one read so is kept in RAM
+void FILE_readCached(struct FILE *filep, uint32_t long_sector, uint8_t *err);
+#endif
+
 // prepare reading a sector from the file
 void FILE_readBegin(struct FILE *filep, uint32_t long_sector, uint8_t *err);
 
@@ -136,11 +215,41 @@ void FILE_writeBegin(struct FILE *filep, uint32_t long_sector, uint8_t *err);
 // end the writing
 void FILE_writeEnd(uint8_t *err);
 
-// get file name, extension, attribute and start cluster from an file list entry
+// cluster on the card of a sector of the file
+uint32_t FILE_cluster(struct FILE *filep, uint32_t long_sector, uint8_t *err);
+
+// give the cluster on the card of a sector of the file to skip walking the FAT
+void FILE_setCluster(struct FILE *filep, uint32_t long_sector, uint32_t fat);
+
+// prepare reading sectors in sequence from the file
+void FILE_readSeqBegin(struct FILE *filep, uint32_t long_sector, uint8_t *err);
+
+// get ready for reading the next sector of the sequence
+void FILE_readSeqNext(struct FILE *filep, uint8_t *err);
+
+// end reading the sequence
+void FILE_readSeqEnd(uint8_t *err);
+
+// prepare writing sectors in sequence to the file
+void FILE_writeSeqBegin(struct FILE *filep, uint32_t long_sector, uint8_t *err);
+
+// get ready for writing the next sector of the sequence
+void FILE_writeSeqNext(struct FILE *filep, uint8_t *err);
+
+// end writing the sequence
+void FILE_writeSeqEnd(uint8_t *err);
+
+// get file name, extension, attribute and start cluster of entry i of the file list
 // used in UI.c
-void FILE_getEntry(struct FILELST *e, char *name, char *ext, uint8_t *attr, uint32_t *stclst, uint8_t *err);
+void FILE_getEntry(struct FILELST *list, uint16_t i, char *name, char *ext, uint8_t *attr, uint32_t *stclst, uint8_t *err);
+
+#ifndef SDISK2P
+// use UNISDISK.IDX or not, called after the card is inserted
+void FILE_idxEnable(uint8_t on);
+#endif
 
-// make file list and sort
+// make file list and sort, the list is kept in UNISDISK.IDX if it is used
+// entry 0 is for "UNMOUNT", list is also used as a work area of 1024 bytes
 // used in UI.c
 uint16_t FILE_makeList(int32_t dir_cluster, struct FILELST *list, char *targExt, uint8_t *err);
 
@@ -36,6 +36,7 @@ int main(void)
 	sei();
 
 	if (memcmp(buffer2.smart.img[0].name+8, "PO ", 3)==0) {
+		SMART_mount(0);
 		mode = SMARTMODE;
 		SMART_init();
 		SMART_run(exchangeSD);
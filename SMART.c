@@ -28,12 +28,15 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <avr/interrupt.h>
 #include <string.h>
 #include "COMMON.h"
 #include "SD.h"
 #include "BUFFER.h"
 #include "DISK2.h"
+#include "TRACE.h"
+#include "HEAT.h"
 
 #ifndef SDISK2P
 #include "LCD.h"
@@ -48,6 +51,23 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #define SMART_PARTITION_MAX 4
 #endif
 
+// a large image holding a ProDOS volume at every 32MB is carved into units
+#ifdef SDISK2P
+#define SMART_UNIT_MAX 4
+#else
+#define SMART_UNIT_MAX 8
+#endif
+#define SMART_UNIT_BLOCKS 65536UL
+
+// define to answer WriteBlock as soon as the checksum of the data packet is checked
+// the block is kept in buffer2.smart.buf2 and written to the card by the main loop,
+// a command that comes before is served after it. no room for it on SDISK2P
+// the blocks of a 2MG image whose data is not at a multiple of 512 are written at once
+//#define SMART_WRITE_BEHIND
+#ifdef SDISK2P
+#undef SMART_WRITE_BEHIND
+#endif
+
 #ifdef SDISK2P
 #define REQ PINC&(1<<0)
 #define ACK_HIGH PORTD|=(1<<4)
@@ -62,7 +82,9 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 const uint8_t UI_running = 0;
 #endif
 
-uint8_t SMART_is2mg[4];
+// data offset and length of 2MG images, offset is 0 for other images
+static uint32_t SMART_offset[SMART_PARTITION_MAX];
+static uint32_t SMART_length[SMART_PARTITION_MAX];
 
 void SMART_encodePacket (uint8_t source, uint8_t type, uint8_t status, uint16_t length);	//encode SmartPort packet
 uint8_t SMART_decodePacket (uint16_t length);			//decode SmartPort packet
@@ -72,17 +94,423 @@ extern uint8_t SMART_SendPacket(uint8_t*);				//send SmartPort packet assembler
 
 struct FILE *SMART_image[SMART_PARTITION_MAX];			//disk images
 
-uint8_t SMART_device_id[SMART_PARTITION_MAX];			//to hold assigned device id's for the partitions
+uint8_t SMART_device_id[SMART_UNIT_MAX];				//to hold assigned device id's for the units
+
+// units : partition of the unit and the 32MB segment of the image
+static uint8_t SMART_unitNum;
+static uint8_t SMART_unitPart[SMART_UNIT_MAX];
+static uint8_t SMART_unitSeg[SMART_UNIT_MAX];
+static uint8_t SMART_segs[SMART_PARTITION_MAX];	// number of units carved, 0 : the whole image is a unit
 uint8_t SMART_partition_num;
 uint8_t SMART_number_partitions_initialised;
 uint8_t SMART_partition_num;
 uint8_t SMART_desktop;
 
+// AUX byte of the packets sent, 0xc0 while an extended command is serviced
+static uint8_t SMART_aux = 0x80;
+
+#ifndef SDISK2P
+// read-ahead block in buffer2.smart.buf2
+static uint8_t SMART_aheadPart = 0xff;	// 0xff : none
+static uint32_t SMART_aheadBlock;
+// the block to be read ahead by the main loop, a new command cancels it
+static volatile uint8_t SMART_wantPart = 0xff;	// 0xff : none
+static uint32_t SMART_wantBlock;
+#ifdef PROF
+uint16_t SMART_aheadReads, SMART_aheadHits;
+uint16_t SMART_aheadLate, SMART_aheadLateMax;
+#endif
+// the last block read, to detect sequential reads
+static uint8_t SMART_lastPart = 0xff;
+static uint32_t SMART_lastBlock;
+static uint8_t SMART_lastSeq;			// the last read was sequential
+// the last sector written to a 2MG image in buffer2.smart.buf2
+static uint8_t SMART_mergePart = 0xff;	// 0xff : none
+static uint32_t SMART_mergeSector;
+#endif
+#ifdef SMART_WRITE_BEHIND
+// the block acknowledged and not yet written, in buffer2.smart.buf2
+static volatile uint8_t SMART_behindPart = 0xff;	// 0xff : none
+static uint32_t SMART_behindBlock;
+#endif
+
+// sector of the image where a block begins
+// block_num*512 would overflow from 8M blocks on, the offset is divided alone
+static uint32_t SMART_sector(uint8_t partition, uint32_t block_num)
+{
+	return SMART_offset[partition]/512+block_num;
+}
+
+// clusters of the ProDOS volume directory and bitmap
+// their card clusters are kept so that the FAT is not walked for them
+// an image mapped by extents is not walked anyway and has none
+#define SMART_PIN_NUM 3
+struct SMART_PIN {
+	uint32_t clst;		// cluster of the image, 0xffffffff : none
+	uint32_t fat;		// cluster on the card
+};
+static struct SMART_PIN SMART_pin[SMART_PARTITION_MAX][SMART_PIN_NUM];
+static uint8_t SMART_volChecked;	// a bit for each partition whose block 2 is checked
+#ifndef SDISK2P
+// the volume directory key block and the bitmap blocks are read through the sector cache of SD.c
+static uint16_t SMART_bitmap[SMART_PARTITION_MAX];		// first bitmap block, 0 : not a ProDOS volume
+static uint16_t SMART_bitmapEnd[SMART_PARTITION_MAX];	// last bitmap block
+#endif
+
+// forget the read-ahead block and the pinned clusters
+// should be called when images are changed or buffer2 is used for other purposes
+void SMART_invalidate(void)
+{
+#ifndef SDISK2P
+	SMART_aheadPart = 0xff;
+	SMART_wantPart = 0xff;
+	SMART_lastPart = 0xff;
+	SMART_lastSeq = 0;
+	SMART_mergePart = 0xff;
+#endif
+#ifdef SMART_WRITE_BEHIND
+	SMART_behindPart = 0xff;
+#endif
+	memset(SMART_pin, 0xff, sizeof(SMART_pin));
+	SMART_volChecked = 0;
+#ifndef SDISK2P
+	memset(SMART_bitmap, 0, sizeof(SMART_bitmap));
+#endif
+}
+
+// use the pinned cluster if the sector is in it
+static void SMART_seek(uint8_t partition, uint32_t long_sector)
+{
+	uint32_t clst = long_sector/SD_p.sectorsPerCluster;
+
+	if (clst == buffer2.smart.img[partition].prevClstNum) return;
+	for (uint8_t i=0; i<SMART_PIN_NUM; i++) {
+		if (SMART_pin[partition][i].clst == clst) {
+			FILE_setCluster(&buffer2.smart.img[partition], long_sector, SMART_pin[partition][i].fat);
+			return;
+		}
+	}
+}
+
+// check a ProDOS volume directory key block
+static uint8_t SMART_isVolume(uint8_t *buf)
+{
+	return (!buf[0] && !buf[1] && ((buf[4]&0xf0) == 0xf0) && (buf[0x23] == 0x27) && (buf[0x24] == 0x0d));
+}
+
+// pin the clusters of the volume directory and the bitmap
+// buf is the volume directory key block (block 2), it is checked once
+static void SMART_pinVolume(uint8_t partition, uint8_t *buf, uint8_t *err)
+{
+	uint32_t blk[SMART_PIN_NUM];	// sectors
+	uint16_t bitmap = buf[0x27]+buf[0x28]*256;
+	uint16_t total = buf[0x29]+buf[0x2a]*256;
+
+	SMART_volChecked |= (1<<partition);
+	if (!SMART_isVolume(buf)) return;
+#ifndef SDISK2P
+	SMART_bitmap[partition] = bitmap;
+	SMART_bitmapEnd[partition] = bitmap+(total?(total-1):0)/4096;
+#endif
+	if (buffer2.smart.img[partition].extNum) return;
+	blk[0] = SMART_sector(partition, 2);
+	blk[1] = SMART_sector(partition, bitmap);
+	blk[2] = SMART_sector(partition, bitmap+(total?(total-1):0)/4096);
+	for (uint8_t i=0; i<SMART_PIN_NUM; i++) {
+		uint32_t clst = blk[i]/SD_p.sectorsPerCluster;
+		uint8_t j;
+
+		for (j=0; j<i; j++) if (SMART_pin[partition][j].clst == clst) break;
+		if (j<i) continue;
+		SMART_pin[partition][i].fat = FILE_cluster(&buffer2.smart.img[partition], blk[i], err);
+		if (*err) return;
+		SMART_pin[partition][i].clst = clst;
+	}
+}
+
+// block number of the received command packet
+static uint32_t SMART_blockNum(uint8_t ext)
+{
+	uint32_t block_num;
+
+	if (ext) {
+		// command, parameter count, buffer pointer (4 bytes), block number (4 bytes)
+		SMART_decodePacket((buffer2.smart.buf[11]&0x7f)+(buffer2.smart.buf[12]&0x7f)*7);
+		return readmem_long(&buffer1[6]);
+	}
+	// block num 1st byte
+	block_num = ((buffer2.smart.buf[19] & 0x7f) | ((buffer2.smart.buf[16] << 3) & 0x80));
+	// block num second byte
+	block_num += ((uint32_t)((buffer2.smart.buf[20] & 0x7f) | ((buffer2.smart.buf[16] << 4) & 0x80))*256);
+	// block num third byte
+	block_num += ((uint32_t)((buffer2.smart.buf[21] & 0x7f) | ((buffer2.smart.buf[16] << 5) & 0x80))*65536);
+	return block_num;
+}
+
+// number of blocks of a partition
+static uint32_t SMART_blocks(uint8_t partition)
+{
+	return ((SMART_offset[partition]?SMART_length[partition]:buffer2.smart.img[partition].length)+511)/512;
+}
+
+#ifndef SDISK2P
+// count an access to the sixth of the image
+static void SMART_heat(uint8_t partition, uint32_t block_num)
+{
+	uint32_t i = HEAT_RANGE+block_num*(HEAT_NUM-HEAT_RANGE)/(SMART_blocks(partition)+1);
+
+	HEAT_add(partition, (i < HEAT_NUM)?i:(HEAT_NUM-1));
+}
+#endif
+
+// read a block of a partition into dst
+static void SMART_readBlock(uint8_t partition, uint32_t block_num, uint8_t *dst, uint8_t *err)
+{
+	struct FILE *filep = &buffer2.smart.img[partition];
+	uint32_t sector = SMART_sector(partition, block_num);
+	uint16_t ofs = SMART_offset[partition]%512;
+
+	SD_changeBuff(buffer2.smart.buf);
+	SMART_seek(partition, sector);
+	if (!ofs) {
+		FILE_readBegin(filep, sector, err);
+		for (uint16_t i=0; i<512; i++) {
+			dst[i]=SPI_readByte(err);
+		}
+		FILE_readEnd(err);
+	} else {
+		// the block straddles two sectors, read them with one command
+		FILE_readSeqBegin(filep, sector, err);
+		FILE_readSeqNext(filep, err);
+		for (uint16_t i=0; i<ofs; i++) {
+			SPI_readByte(err);
+		}
+		for (uint16_t i=0; i<512-ofs; i++) {
+			dst[i] = SPI_readByte(err);
+		}
+		FILE_readSeqNext(filep, err);
+		for (uint16_t i=512-ofs; i<512; i++) {
+			dst[i] = SPI_readByte(err);
+		}
+		for (uint16_t i=0; i<512-ofs; i++) {
+			SPI_readByte(err);
+		}
+		FILE_readSeqEnd(err);
+	}
+	SD_changeBuff(buffer1);
+}
+
+#ifndef SDISK2P
+// whether the block is the volume directory key block or a bitmap block of a ProDOS volume
+// the offset of the partition should be a multiple of 512
+static uint8_t SMART_isCached(uint8_t partition, uint32_t block_num)
+{
+	if (SMART_offset[partition]%512) return 0;
+	if (block_num == 2) return 1;
+	return (SMART_bitmap[partition] && (block_num >= SMART_bitmap[partition]) && (block_num <= SMART_bitmapEnd[partition]));
+}
+
+// read such a block into buffer1 through the sector cache, which keeps the last one
+static void SMART_readCached(uint8_t partition, uint32_t block_num, uint8_t *err)
+{
+	uint32_t sector = SMART_sector(partition, block_num);
+
+	SMART_seek(partition, sector);
+	FILE_readCached(&buffer2.smart.img[partition], sector, err);
+}
+#endif
+
+// read a block of a partition and encode it into a data packet at once
+// each byte is encoded while the next one is received
+// the offset of the partition should be a multiple of 512
+static void SMART_readEncode(uint8_t partition, uint32_t block_num, uint8_t source, uint8_t *err)
+{
+	uint8_t *p = buffer2.smart.buf;
+	uint8_t checksum, c;
+	uint16_t n = 512;
+
+	SMART_seek(partition, SMART_sector(partition, block_num));
+	FILE_readBegin(&buffer2.smart.img[partition], SMART_sector(partition, block_num), err);
+	if (*err) return;
+
+	p[0] = 0xff;			// sync bytes
+	p[1] = 0x3f;
+	p[2] = 0xcf;
+	p[3] = 0xf3;
+	p[4] = 0xfc;
+	p[5] = 0xff;
+	p[6] = 0xc3;			// PBEGIN
+	p[7] = 0x80;			// DEST
+	p[8] = 0x80|source;		// SRC
+	p[9] = 0x82;			// TYPE : data
+	p[10] = SMART_aux;		// AUX
+	p[11] = 0x80;			// STAT
+	p[12] = 0x80|(512%7);	// ODDCNT
+	p[13] = 0x80|(512/7);	// GRP7CNT
+	checksum = p[7]^p[8]^p[9]^p[10]^p[11]^p[12]^p[13];
+
+	SPI_readPipeBegin();
+	// an odd byte
+	c = SPI_readPipe(--n != 0, err);
+	checksum ^= c;
+	p[14] = 0x80|((c>>1)&0x40);
+	p[15] = c|0x80;
+	p += 16;
+	// groups of 7
+	while (n) {
+		uint8_t grpmsb = 1;
+
+		for (uint8_t i=1; i<8; i++) {
+			c = SPI_readPipe(--n != 0, err);
+			checksum ^= c;
+			grpmsb = (grpmsb<<1)|(c>>7);
+			p[i] = c|0x80;
+		}
+		p[0] = grpmsb;
+		p += 8;
+	}
+	FILE_readEnd(err);
+
+	p[0] = checksum|0xaa;		// 1 c6 1 c4 1 c2 1 c0
+	p[1] = checksum>>1|0xaa;	// 1 c7 1 c5 1 c3 1 c1
+	p[2] = 0xc8;				// pkt end
+	p[3] = 0x00;				// mark the end of the packet_buffer
+}
+
+// write a block in src, buffer1 or buffer2.smart.buf2, to a partition
+static void SMART_writeBlock(uint8_t partition, uint32_t block_num, uint8_t *src, uint8_t *err)
+{
+	struct FILE *filep = &buffer2.smart.img[partition];
+	uint32_t sector = SMART_sector(partition, block_num);
+	uint16_t ofs = SMART_offset[partition]%512;
+
+#ifndef SDISK2P
+	if (ofs) {
+		// the block straddles two sectors
+		// buffer2.smart.buf : the first sector, buffer2.smart.buf2 : the second sector
+		// the second sector is kept, the next block begins with it
+		uint8_t *first = buffer2.smart.buf, *second = buffer2.smart.buf2;
+
+		if ((SMART_mergePart == partition) && (SMART_mergeSector == sector)) {
+			memcpy(first, second, 512);
+		} else {
+			SD_changeBuff(first);
+			SMART_seek(partition, sector);
+			FILE_read(filep, sector, err);
+		}
+		SMART_mergePart = 0xff;
+		SD_changeBuff(second);
+		SMART_seek(partition, sector+1);
+		FILE_read(filep, sector+1, err);
+		SD_changeBuff(buffer1);
+		if (*err) return;
+		memcpy(first+ofs, src, 512-ofs);
+		memcpy(second, src+512-ofs, ofs);
+		SMART_seek(partition, sector);
+		FILE_writeSeqBegin(filep, sector, err);
+		FILE_writeSeqNext(filep, err);
+		SPI_writeBytes(first, 512, err);
+		FILE_writeSeqNext(filep, err);
+		SPI_writeBytes(second, 512, err);
+		FILE_writeSeqEnd(err);
+		if (!*err) {
+			SMART_mergePart = partition;
+			SMART_mergeSector = sector+1;
+		}
+		return;
+	}
+#endif
+	SD_changeBuff(buffer2.smart.buf);
+	SMART_seek(partition, sector);
+	FILE_writeBegin(filep, sector, err);
+	SD_changeBuff(buffer1);
+	for (uint16_t i=0; i<512; i++) {
+		SPI_writeByte(src[i], err);
+	}
+	FILE_writeEnd(err);
+}
+
+// read the header of a 2MG image
+static void SMART_read2mg(uint8_t partition)
+{
+	struct FILE *filep = &buffer2.smart.img[partition];
+	uint8_t err = 0;
+
+	// 64 bytes header if the header is broken
+	SMART_offset[partition] = 64;
+	SMART_length[partition] = (filep->length>64)?(filep->length-64):0;
+	FILE_read(filep, 0, &err);
+	if (err || memcmp(buffer1, "2IMG", 4)) return;
+	{
+		uint32_t ofs = readmem_long(&buffer1[0x18]);
+		uint32_t len = readmem_long(&buffer1[0x1c]);
+
+		if (!ofs || (ofs >= filep->length)) return;
+		if (!len || (len > filep->length-ofs)) len = filep->length-ofs;
+		SMART_offset[partition] = ofs;
+		SMART_length[partition] = len;
+		if (buffer1[0x13]&0x80) filep->protect = 1;	// locked
+	}
+}
+
+// make the unit table
+// each image gets a unit first, then the other volumes of the carved ones in turn
+// a partition without an image or with an empty one gets none,
+// except the first unit out of the desktop mode, where a disk can be put in it from the menu
+static void SMART_mapUnits(void)
+{
+	SMART_unitNum = 0;
+	for (uint8_t seg=0; seg<SMART_UNIT_MAX; seg++) {
+		for (uint8_t partition=0; partition<SMART_PARTITION_MAX; partition++) {
+			if ((seg || SMART_desktop) && (!buffer2.smart.img[partition].valid || !SMART_blocks(partition))) continue;
+			if (seg && (seg >= SMART_segs[partition])) continue;
+			if (SMART_unitNum == SMART_UNIT_MAX) return;
+			SMART_unitPart[SMART_unitNum] = partition;
+			SMART_unitSeg[SMART_unitNum++] = seg;
+		}
+	}
+}
+
+// number of blocks of a unit
+static uint32_t SMART_unitBlocks(uint8_t unit)
+{
+	uint8_t partition = SMART_unitPart[unit];
+	uint32_t blocks = SMART_blocks(partition);
+
+	if (!SMART_segs[partition]) return blocks;
+	blocks -= SMART_unitSeg[unit]*SMART_UNIT_BLOCKS;
+	return (blocks > 0xffff)?0xffff:blocks;
+}
+
+// mount a SmartPort disk image
+void SMART_mount(uint8_t partition)
+{
+	struct FILE *filep = &buffer2.smart.img[partition];
+
+	SMART_offset[partition] = 0;
+	SMART_segs[partition] = 0;
+	if (filep->valid && !memcmp(filep->name+8, "2MG", 3)) SMART_read2mg(partition);
+	// is there another volume at 32MB?
+	if (filep->valid && (SMART_blocks(partition) > SMART_UNIT_BLOCKS+2)) {
+		uint8_t err = 0;
+
+		SMART_readBlock(partition, SMART_UNIT_BLOCKS+2, buffer1, &err);
+		if (!err && SMART_isVolume(buffer1)) {
+			uint32_t segs = (SMART_blocks(partition)+SMART_UNIT_BLOCKS-1)/SMART_UNIT_BLOCKS;
+
+			SMART_segs[partition] = (segs > SMART_UNIT_MAX)?SMART_UNIT_MAX:segs;
+		}
+	}
+	SMART_mapUnits();
+}
+
 // initialize SmartPort device emulator
 void SMART_init()
 {	
 	for (uint8_t i=0 ; i < SMART_PARTITION_MAX; i++)
 		SMART_image[i] = 0;
+	SMART_invalidate();
+	SMART_mapUnits();
 
 #ifdef SDISK2P
 	// OFF WREQ
@@ -94,18 +522,129 @@ void SMART_init()
 }
 
 // run the SmartPort device emulator
-void SMART_run(uint8_t (*pf)(uint8_t))
-{	
-	while (1) {
-		pf(0);
 #ifndef SDISK2P
-		UI_checkExecute();
+// read the block asked by the last sequential read, unless a command has come since
+// the card is not touched by the interrupt meanwhile
+// the read is not given up once begun, a command that comes in the middle of it
+// waits until the block is read, the card access and 512 bytes, under 1ms on a class 10 card
+static uint8_t SMART_taskReadAhead(void)
+{
+	uint8_t err = 0, s = SREG, done = 0;
+
+	cli();
+	// a command on its way, the bus is being enabled
+	if (((PHASE&0b1010)==0b1010) || ((PHASE&0b0101)==0b0101)) SMART_wantPart = 0xff;
+	if ((SMART_wantPart != 0xff) && !UI_running) {
+		PROF_BEGIN(t);
+		SMART_mergePart = 0xff;
+		SMART_readBlock(SMART_wantPart, SMART_wantBlock, buffer2.smart.buf2, &err);
+		if (!err) {
+			SMART_aheadPart = SMART_wantPart;
+			SMART_aheadBlock = SMART_wantBlock;
+#ifdef PROF
+			SMART_aheadReads++;
 #endif
-	}	
+		}
+#ifdef PROF
+		if (((PHASE&0b1010)==0b1010) || ((PHASE&0b0101)==0b0101)) {
+			uint16_t ticks = TCD5.CNT-t;
+
+			SMART_aheadLate++;
+			if (ticks > SMART_aheadLateMax) SMART_aheadLateMax = ticks;
+		}
+#endif
+		SMART_wantPart = 0xff;
+		done = 1;
+	}
+	SREG = s;
+	return done;
+}
+#endif
+
+static void SMART_protocol(void);
+
+#ifdef SMART_WRITE_BEHIND
+// write the block acknowledged by the interrupt, it is then kept as if read ahead
+// a command or a bus reset that has come meanwhile is served after it
+static uint8_t SMART_taskBehind(void)
+{
+	uint8_t err = 0, s = SREG;
+
+	cli();
+	if (SMART_behindPart == 0xff) {
+		SREG = s;
+		return 0;
+	}
+	SMART_writeBlock(SMART_behindPart, SMART_behindBlock, buffer2.smart.buf2, &err);
+	if (!err) {
+		SMART_aheadPart = SMART_behindPart;
+		SMART_aheadBlock = SMART_behindBlock;
+	}
+	SMART_behindPart = 0xff;
+	SMART_protocol();
+	SREG = s;
+	return 1;
+}
+#endif
+
+// write the block acknowledged and not yet written, before the images are changed
+void SMART_flush(void)
+{
+#ifdef SMART_WRITE_BEHIND
+	SMART_taskBehind();
+#endif
+}
+
+// the tasks of the main loop, the commands are served by the interrupt
+static uint8_t (*SMART_exchange)(uint8_t);		// checks the card, 1 if it is changed
+
+// an ejected or inserted card
+static uint8_t SMART_taskExchange(void)
+{
+	return SMART_exchange(0);
+}
+
+#ifndef SDISK2P
+// the menu, the commands are refused while it runs
+static uint8_t SMART_taskUI(void)
+{
+	return UI_checkExecute();
+}
+
+// the trace and the counters
+static uint8_t SMART_taskSave(void)
+{
+#ifdef TRACE
+	TRACE_idle(0);
+#endif
+	HEAT_save(0);
+	return 0;
+}
+#endif
+
+// in the order of priority
+PROGMEM static const COMMON_TASK SMART_tasks[] = {
+#ifdef SMART_WRITE_BEHIND
+	SMART_taskBehind,
+#endif
+#ifndef SDISK2P
+	SMART_taskReadAhead,
+#endif
+	SMART_taskExchange,
+#ifndef SDISK2P
+	SMART_taskUI,
+	SMART_taskSave,
+#endif
+};
+
+// each turn runs the tasks until one has done some work, and starts over
+void SMART_run(uint8_t (*pf)(uint8_t))
+{	
+	SMART_exchange = pf;
+	while (1) COMMON_runTasks(SMART_tasks, sizeof(SMART_tasks)/sizeof(SMART_tasks[0]));
 }
 
 // execute SmartPort protocol
-//void SMART_protocol()
 #ifdef SDISK2P
 ISR(PCINT1_vect)
 #else
@@ -115,8 +654,14 @@ ISR(PORTA_INT_vect)
 #ifndef SDISK2P
 	PORTA.INTFLAGS |= PHASE_bm;
 #endif
+	SMART_protocol();
+}
+
+// served by the interrupt at a change of the phase lines, and by the main loop after a block written behind
+static void SMART_protocol(void)
+{
 	if (mode == SMARTMODE) {
-		uint8_t source, status, partition;
+		uint8_t source, status, partition, unit;
 		uint8_t phase = PHASE;
 
 		if (!(((phase&0b1010)==0b1010)||((phase&0b0101)==0b0101))) {
@@ -134,10 +679,14 @@ ISR(PORTA_INT_vect)
 				}
 #endif
 				// monitor phase lines for reset to clear
+#ifdef SMART_WRITE_BEHIND
+				// unless the main loop is to write a block while the reset is held
+				if (SMART_behindPart == 0xff)
+#endif
 				while (PHASE == 0x05);
 				SMART_number_partitions_initialised = 0;  // reset number of partitions init'd
-				for (partition = 0; partition < SMART_PARTITION_MAX; partition++) // clear device_id table
-					SMART_device_id[partition] = 0;
+				for (unit = 0; unit < SMART_UNIT_MAX; unit++) // clear device_id table
+					SMART_device_id[unit] = 0;
 				break;
 			// phase lines for SmartPort bus enable
 			// ph3=1 ph2=x ph1=1 ph0=x
@@ -145,6 +694,10 @@ ISR(PORTA_INT_vect)
 			case 0x0b:
 			case 0x0e:
 			case 0x0f:
+#ifdef SMART_WRITE_BEHIND
+				// the command is not acknowledged until the main loop has written the block
+				if (SMART_behindPart != 0xff) return;
+#endif
 				{
 					uint16_t i = 0;
 
@@ -159,31 +712,52 @@ ISR(PORTA_INT_vect)
 				}
 				status = SMART_ReceivePacket(buffer2.smart.buf);
 				if (status) return; // timeout
+#ifndef SDISK2P
+				SMART_wantPart = 0xff;
+#endif
 
 				// assume it's a cmd packet, cmd code is in byte 14
-				switch (buffer2.smart.buf[14]) {
+				// extended commands (0xc0-) have 4 bytes block numbers
+				uint8_t ext = (buffer2.smart.buf[14]&0x40);
+
+				SMART_aux = ext?0xc0:0x80;
+				PROF_BEGIN(t);
+				uint8_t cmd = (buffer2.smart.buf[14]&~0x40);
+				switch (cmd) {
 					case 0x80:  //is a status cmd
 						source = buffer2.smart.buf[6];
-						SMART_decodePacket(5);
-						uint8_t flg = (buffer1[2]==0x20);
+						TRACE_ADD(0x80, source);
+						uint8_t flg;
+						if (ext) {
+							// command, parameter count, buffer pointer (4 bytes), status code
+							SMART_decodePacket((buffer2.smart.buf[11]&0x7f)+(buffer2.smart.buf[12]&0x7f)*7);
+							flg = (buffer1[6]==0x03);
+						} else {
+							SMART_decodePacket(5);
+							flg = (buffer1[2]==0x20);
+						}
 
-						for (partition = 0; partition < SMART_PARTITION_MAX; partition++) {	// Check if its one of ours
-							if (SMART_device_id[partition] == source) {					// yes it is, then reply
-								uint32_t partition_block_num = (buffer2.smart.img[partition].valid&&!UI_running)?((SMART_is2mg[partition]?(buffer2.smart.img[partition].length-64+511):(buffer2.smart.img[partition].length+511))/512):0;
+						for (unit = 0; unit < SMART_unitNum; unit++) {	// Check if its one of ours
+							partition = SMART_unitPart[unit];
+							if (SMART_device_id[unit] == source) {					// yes it is, then reply
+								uint32_t partition_block_num = (buffer2.smart.img[partition].valid&&!UI_running)?SMART_unitBlocks(unit):0;
+								uint8_t *p = buffer1+(ext?1:0);		// the block count has one more byte
 		
+								if (!ext && (partition_block_num > 0xffffff)) partition_block_num = 0xffffff;
 								buffer1[0]=0xe8 // BlockDevice,ReadWriteAllowed,FormatAllowed
 								| ((buffer2.smart.img[partition].valid&&!UI_running)?0x10:0)						// DiskInDrive
 								| ((buffer2.smart.img[partition].valid)?((buffer2.smart.img[partition].protect||WP)?0x04:0):0x04);	// WriteProtect
 								buffer1[1] = (partition_block_num&0xff);
 								buffer1[2] = ((partition_block_num>>8)&0xff);
 								buffer1[3] = ((partition_block_num>>16)&0xff);
-								buffer1[4]=0;
-								memcpy(&buffer1[5], "                ", 16);
-								buffer1[21]=0x02; // hard disk
-								buffer1[22]=0x00; // removable media
-								buffer1[23]=0x00;
-								buffer1[24]=0x00;
-								SMART_encodePacket(source, 0x01, 0x00, flg?25:4);
+								buffer1[4] = ((partition_block_num>>24)&0xff);
+								p[4]=0;
+								memcpy(&p[5], "                ", 16);
+								p[21]=0x02; // hard disk
+								p[22]=0x00; // removable media
+								p[23]=0x00;
+								p[24]=0x00;
+								SMART_encodePacket(source, 0x01, 0x00, (flg?25:4)+(ext?1:0));
 								status = SMART_SendPacket(buffer2.smart.buf);
 							}
 						}
@@ -191,18 +765,15 @@ ISR(PORTA_INT_vect)
 					case 0x81:	// is a readblock cmd
 						if (UI_running) break;		
 						source = buffer2.smart.buf[6];
-						for (partition = 0; partition < SMART_PARTITION_MAX; partition++) {	// Check if its one of ours
+						for (unit = 0; unit < SMART_unitNum; unit++) {	// Check if its one of ours
+							partition = SMART_unitPart[unit];
 							if (!buffer2.smart.img[partition].valid) break;
 
-							if ((SMART_device_id[partition] == source)&&buffer2.smart.img[partition].valid&&!UI_running) {	// yes it is, then do the read
-								uint8_t err;
+							if ((SMART_device_id[unit] == source)&&buffer2.smart.img[partition].valid&&!UI_running) {	// yes it is, then do the read
+								uint8_t err = 0;
 								uint32_t block_num; 
-								// block num 1st byte
-								block_num = ((buffer2.smart.buf[19] & 0x7f) | ((buffer2.smart.buf[16] << 3) & 0x80));
-								// block num second byte
-								block_num += ((uint32_t)((buffer2.smart.buf[20] & 0x7f) | ((buffer2.smart.buf[16] << 4) & 0x80))*256);
-								// block num third byte
-								block_num += ((uint32_t)((buffer2.smart.buf[21] & 0x7f) | ((buffer2.smart.buf[16] << 5) & 0x80))*65536);
+								block_num = SMART_blockNum(ext)+SMART_unitSeg[unit]*SMART_UNIT_BLOCKS;
+								TRACE_ADD(0x81, block_num);
 #ifdef SDISK2P
 								LED_ON;
 #else
@@ -214,54 +785,66 @@ ISR(PORTA_INT_vect)
 									LCD_print(buffer2.smart.img[partition].name,8);
 								}
 #endif
-								if (SMART_is2mg[partition]) {
-									SD_changeBuff(buffer2.smart.buf);
-									FILE_readBegin(&buffer2.smart.img[partition], block_num, &err);
-									for (uint16_t i=0; i<64; i++) {
-										SPI_readByte(&err);
-									}
-									for (uint16_t i=0; i<448; i++) {
-										buffer1[i] = SPI_readByte(&err);
-									}
-									FILE_readEnd(&err);
-									FILE_readBegin(&buffer2.smart.img[partition], block_num+1, &err);
-									for (uint16_t i=0; i<64; i++) {
-										buffer1[i+448] = SPI_readByte(&err);
-									}
-									for (uint16_t i=0; i<448; i++) {
-										SPI_readByte(&err);
-									}
-									FILE_readEnd(&err);
-									SD_changeBuff(buffer1);
+								// block 2 is kept in buffer1 to pin the volume
+								uint8_t pin = ((block_num == 2) && !(SMART_volChecked&(1<<partition)));
+#ifndef SDISK2P
+								if ((SMART_aheadPart == partition) && (SMART_aheadBlock == block_num)) {
+									memcpy(buffer1, buffer2.smart.buf2, 512);
+									SMART_encodePacket(source, 0x02, 0x00, 512);
+#ifdef PROF
+									SMART_aheadHits++;
+#endif
+								} else if (SMART_isCached(partition, block_num)) {
+									SMART_readCached(partition, block_num, &err);
+									SMART_encodePacket(source, 0x02, 0x00, 512);
+								} else
+#endif
+								if (!pin && !(SMART_offset[partition]%512)) {
+									SMART_readEncode(partition, block_num, source, &err);
 								} else {
-									FILE_readBegin(&buffer2.smart.img[partition], block_num, &err);
-									for (uint16_t i=0; i<512; i++) {
-										buffer1[i]=SPI_readByte(&err);
-									}
-									FILE_readEnd(&err);
+									SMART_readBlock(partition, block_num, buffer1, &err);
+									SMART_encodePacket(source, 0x02, 0x00, 512);
 								}
 #ifdef SDISK2P
 								LED_OFF;
+#else
+								SMART_aheadPart = 0xff;
 #endif
-								SMART_encodePacket(source, 0x02, 0x00, 512);
+								if (err) SMART_encodePacket(source, 0x01, 0x27, 0);	// I/O error
 								status = SMART_SendPacket(buffer2.smart.buf);
+								if (pin && !err) {
+									SMART_pinVolume(partition, buffer1, &err);
+								}
+#ifndef SDISK2P
+								uint8_t seq = ((SMART_lastPart == partition) && (SMART_lastBlock+1 == block_num));
+
+								// whether the block read ahead at the last read would have been used
+								if (SMART_lastSeq) HEAT_add(SMART_lastPart, seq?HEAT_HIT:HEAT_MISS);
+								SMART_lastSeq = seq;
+								SMART_heat(partition, block_num);
+								// sequential reading, the main loop reads the next block while the host is busy
+								// unless this image does not make use of it
+								if (seq && HEAT_ahead(partition) && (block_num+1 < SMART_blocks(partition))) {
+									SMART_wantPart = partition;
+									SMART_wantBlock = block_num+1;
+								}
+								SMART_lastPart = partition;
+								SMART_lastBlock = block_num;
+#endif
 							}
 						}				
 						break;
 					case 0x82:  // is a writeblock cmd
 						source = buffer2.smart.buf[6];
-						for (partition = 0; partition < SMART_PARTITION_MAX; partition++) {	// Check if its one of ours
-							if ((SMART_device_id[partition] == source)&&buffer2.smart.img[partition].valid&&!UI_running) {	// yes it is, then do the write
+						for (unit = 0; unit < SMART_unitNum; unit++) {	// Check if its one of ours
+							partition = SMART_unitPart[unit];
+							if ((SMART_device_id[unit] == source)&&buffer2.smart.img[partition].valid&&!UI_running) {	// yes it is, then do the write
 							// if (SMART_device_id[partition] == source) {		// yes it is, then do the write
-								uint8_t err;
+								uint8_t err = 0;
 								uint32_t block_num;
 	
-								// block num 1st byte
-								block_num = ((buffer2.smart.buf[19] & 0x7f) | ((buffer2.smart.buf[16] << 3) & 0x80));
-								// block num second byte
-								block_num += ((uint32_t)((buffer2.smart.buf[20] & 0x7f) | ((buffer2.smart.buf[16] << 4) & 0x80))*256);
-								// block num third byte
-								block_num += ((uint32_t)((buffer2.smart.buf[21] & 0x7f) | ((buffer2.smart.buf[16] << 5) & 0x80))*65536);
+								block_num = SMART_blockNum(ext)+SMART_unitSeg[unit]*SMART_UNIT_BLOCKS;
+								TRACE_ADD(0x82, block_num);
 	
 								// get write data packet
 								ACK_HIGH;
@@ -269,6 +852,9 @@ ISR(PORTA_INT_vect)
 	
 								status = SMART_ReceivePacket(buffer2.smart.buf);
 								status = SMART_decodePacket(512);
+#ifndef SDISK2P
+								SMART_aheadPart = 0xff;
+#endif
 
 								if (status==0) { // ok	
 #ifdef SDISK2P
@@ -283,47 +869,17 @@ ISR(PORTA_INT_vect)
 									}
 #endif
 #ifndef SDISK2P
-									if (SMART_is2mg[partition]) {
-										SD_changeBuff(buffer2.smart.buf);
-										FILE_readBegin(&buffer2.smart.img[partition], block_num, &err);
-										for (uint16_t i=0; i<512; i++) {
-											buffer2.smart.buf2[i]=SPI_readByte(&err);
-										}
-										FILE_readEnd(&err);
-										FILE_writeBegin(&buffer2.smart.img[partition], block_num, &err);
-										for (uint16_t i=0; i<64; i++) {
-											SPI_writeByte(buffer2.smart.buf2[i], &err);
-										}
-										for (uint16_t i=0; i<448; i++) {
-											SPI_writeByte(buffer1[i], &err);
-										}
-										FILE_writeEnd(&err);
-										FILE_readBegin(&buffer2.smart.img[partition], block_num+1, &err);
-										for (uint16_t i=0; i<512; i++) {
-											buffer2.smart.buf2[i]=SPI_readByte(&err);
-										}
-										FILE_readEnd(&err);
-										FILE_writeBegin(&buffer2.smart.img[partition], block_num+1, &err);
-										for (uint16_t i=0; i<64; i++) {
-											SPI_writeByte(buffer1[448+i], &err);
-										}
-										for (uint16_t i=0; i<448; i++) {
-											SPI_writeByte(buffer2.smart.buf2[i+64], &err);
-										}
-										FILE_writeEnd(&err);
-										SD_changeBuff(buffer1);
+									SMART_heat(partition, block_num);
+#endif
+#ifdef SMART_WRITE_BEHIND
+									if (!(SMART_offset[partition]%512)) {
+										memcpy(buffer2.smart.buf2, buffer1, 512);
+										SMART_mergePart = 0xff;
+										SMART_behindPart = partition;
+										SMART_behindBlock = block_num;
 									} else
 #endif
-									{
-										// write block
-										SD_changeBuff(buffer2.smart.buf);
-										FILE_writeBegin(&buffer2.smart.img[partition], block_num, &err);
-										SD_changeBuff(buffer1);
-										for (uint16_t i=0; i<512; i++) {
-											SPI_writeByte(buffer1[i], &err);
-										}
-										FILE_writeEnd(&err);
-									}
+									SMART_writeBlock(partition, block_num, buffer1, &err);
 #ifdef SDISK2P
 									LED_OFF;
 #endif							
@@ -335,8 +891,10 @@ ISR(PORTA_INT_vect)
 						break;
 					case 0x83:  // is a format cmd
 						source = buffer2.smart.buf[6];
-						for (partition = 0; partition < SMART_PARTITION_MAX; partition++) {	// Check if its one of ours
-							if ((SMART_device_id[partition] == source)&&buffer2.smart.img[partition].valid&&!UI_running) {	// yes it is, then do the read
+						TRACE_ADD(0x83, source);
+						for (unit = 0; unit < SMART_unitNum; unit++) {	// Check if its one of ours
+							partition = SMART_unitPart[unit];
+							if ((SMART_device_id[unit] == source)&&buffer2.smart.img[partition].valid&&!UI_running) {	// yes it is, then do the read
 							// if (SMART_device_id[partition] == source) {		// yes it is, then reply to the format cmd
 #ifndef SDISK2P
 								if (!UI_running) {
@@ -344,7 +902,7 @@ ISR(PORTA_INT_vect)
 									LCD_print("FORMAT  ",8);
 									LCD_locate(0,1);
 									LCD_print("DRV",3);
-									LCD_printdec(partition+1,1);
+									LCD_printdec(unit+1,1);
 									LCD_print("    ", 4);
 								}
 #endif								
@@ -359,9 +917,12 @@ ISR(PORTA_INT_vect)
 					case 0x85:  // is an init cmd
 						if (UI_running) break;
 						source = buffer2.smart.buf[6];
-						SMART_device_id[SMART_number_partitions_initialised] = source;				// remember source id for partition
+						TRACE_ADD(0x85, source);
+						if (SMART_number_partitions_initialised < SMART_UNIT_MAX) {
+							SMART_device_id[SMART_number_partitions_initialised] = source;			// remember source id for unit
+						}
 						SMART_number_partitions_initialised++;
-						if (SMART_number_partitions_initialised < (SMART_desktop?SMART_partition_num:SMART_PARTITION_MAX)) {			// are all init'd yet
+						if (SMART_number_partitions_initialised < SMART_unitNum) {			// are all init'd yet
 							status = 0x80;          // no, so status=0
 						} else {					// the last one
 							status = 0xff;          // yes, so status=non zero
@@ -372,6 +933,7 @@ ISR(PORTA_INT_vect)
 					default:
 						break;
 				}
+				PROF_END((cmd==0x81)?PROF_SMARTREAD:((cmd==0x82)?PROF_SMARTWRITE:PROF_SMARTOTHER), t);
 			}
 	} else {
 		DISK2_moveHead();
@@ -396,7 +958,7 @@ void SMART_encodePacket (uint8_t source, uint8_t type, uint8_t status, uint16_t
     buffer2.smart.buf[7] =0x80;			// DEST - dest id - host
     buffer2.smart.buf[8] =0x80|source;	// SRC - source id - us
     buffer2.smart.buf[9] =0x80|type;		// TYPE
-    buffer2.smart.buf[10]=0x80;			// AUX
+    buffer2.smart.buf[10]=SMART_aux;		// AUX
     buffer2.smart.buf[11]=0x80|status;	// STAT
 	
     buffer2.smart.buf[12]=oddlen|0x80;	// ODDCNT
@@ -406,7 +968,7 @@ void SMART_encodePacket (uint8_t source, uint8_t type, uint8_t status, uint16_t
 	if (oddlen != 0) {
 		uint8_t pch = 0x80;
 		for (uint8_t oddcount=0; oddcount<oddlen; oddcount++) {
-			pch += ((buffer1[oddcount]>>(oddcount+1))&0x40);
+			pch |= ((buffer1[oddcount]>>(oddcount+1))&(0x80>>(oddcount+1)));
 			buffer2.smart.buf[15+oddcount]= buffer1[oddcount] | 0x80;
 		}
 		buffer2.smart.buf[14]=pch;
@@ -33,7 +33,6 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #include "SD.h"
 #include "UI.h"
 
-extern uint8_t SMART_is2mg[];
 extern uint8_t SMART_partition_num;
 extern uint8_t SMART_desktop;
 
@@ -41,7 +40,8 @@ extern uint8_t SMART_desktop;
 void SMART_init(void);
 
 // mount a SmartPort disk image
-void SMART_mount(struct FILE *img, uint8_t partition);
+// should be called after opening the image of the partition
+void SMART_mount(uint8_t partition);
 
 // unmount a SmartPort disk image
 void SMART_unmount(uint8_t partition);
@@ -54,6 +54,21 @@ void SMART_run(uint8_t (*pf)(uint8_t));
 void SMART_eject(void);
 #endif
 
+// forget the read-ahead block and the pinned clusters
+void SMART_invalidate(void);
+
+// write the block of WriteBlock answered before it is written, if any
+// should be called before the images are changed
+void SMART_flush(void);
+
+#if defined(PROF) && !defined(SDISK2P)
+// blocks read ahead, and of them sent to the host
+extern uint16_t SMART_aheadReads, SMART_aheadHits;
+// reads ahead that a command came in the middle of, and the longest of them in 8u sec ticks
+// the command waits for the rest of the read
+extern uint16_t SMART_aheadLate, SMART_aheadLateMax;
+#endif
+
 // execute SmartPort protocol
 //void SMART_protocol(void);
 
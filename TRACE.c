@@ -0,0 +1,183 @@
+﻿/*
+ * TRACE.c
+ *
+ * Created: 2026/10/19 10:12:40
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "TRACE.h"
+#include "SD.h"
+#include "BUFFER.h"
+#include "COMMON.h"
+
+#ifdef TRACE
+
+// events kept until written, a power of 2
+#define TRACE_NUM 32
+
+static uint32_t TRACE_time[TRACE_NUM];
+static uint32_t TRACE_value[TRACE_NUM];		// type<<24 | value
+static volatile uint8_t TRACE_head, TRACE_tail;
+static volatile uint16_t TRACE_lost;
+static uint16_t TRACE_hi;					// upper word of the time
+static uint32_t TRACE_adr;					// the first sector of UNISDISK.TRC, 0 if none
+static uint32_t TRACE_seq, TRACE_boot;
+
+// 8u sec ticks, called with interrupts disabled
+// TCD5 overflows every 0.5 sec, so this has to be called more often than that
+static uint32_t TRACE_now(void)
+{
+	uint16_t t = TCD5.CNT;
+
+	if (TCD5.INTFLAGS & TC5_OVFIF_bm) {
+		TCD5.INTFLAGS = TC5_OVFIF_bm;
+		TRACE_hi++;
+		t = TCD5.CNT;
+	}
+	return ((uint32_t)TRACE_hi<<16)|t;
+}
+
+// the sequence number of a sector, 0xffffffff if it is not written
+// boot is set to the boot number of the sector
+static uint32_t TRACE_readSeq(uint32_t adr, uint32_t *boot, uint8_t *err)
+{
+	uint8_t rec[8];
+
+	SD_readBlockBegin(adr, err);
+	for (uint16_t i = 0; (i < 512) && !*err; i++) {
+		uint8_t c = SPI_readByte(err);
+		if (i < 8) rec[i] = c;
+	}
+	if (!*err) SD_readBlockEnd(err);
+	if (*err || (rec[7]!=TRACE_SEQ)) return 0xffffffff;
+	*boot = readmem_long(rec+4)&0xffffff;
+	return readmem_long(rec);
+}
+
+// open or create UNISDISK.TRC, recording stops if it fails
+// buffer2.sd.buf2 is used for the file while opening
+void TRACE_open(void)
+{
+	struct FILE *filep = (struct FILE *)buffer2.sd.buf2;
+	uint8_t err = 0;
+
+	TRACE_adr = 0;
+	TRACE_head = TRACE_tail = 0;
+	TRACE_lost = 0;
+	TRACE_seq = 0;
+	FILE_open(filep, 0, "UNISDISK", "TRC", &err);
+	if (err) {
+		if (WP) return;
+		err = 0;
+		// Notice : buffer2.sd.buf[512] is also used!
+		FILE_create(0, "UNISDISKTRC", TRACE_SECTORS*512UL, &err);
+		if (err) return;
+		FILE_open(filep, 0, "UNISDISK", "TRC", &err);
+		if (err) return;
+	}
+	if ((filep->extNum!=1)||(filep->length<TRACE_SECTORS*512UL)) return;
+	uint32_t adr = SD_p.userAddr+(filep->map.ext[0][0]-2)*SD_p.sectorsPerCluster;
+
+	// the sectors from the first up to the last written one have the sequence numbers seq0, seq0+1, ...
+	// the last written one is searched by halves, the boot goes on after it
+	uint32_t boot, seq0 = TRACE_readSeq(adr, &boot, &err);
+	if (err) return;
+	if (seq0 != 0xffffffff) {
+		uint16_t lo = 0, hi = TRACE_SECTORS;
+
+		while (hi-lo > 1) {
+			uint16_t mid = (lo+hi)/2;
+			uint32_t b;
+
+			if (TRACE_readSeq(adr+mid, &b, &err) == seq0+mid) {
+				lo = mid;
+				boot = b;
+			} else hi = mid;
+			if (err) return;
+		}
+		TRACE_seq = seq0+lo+1;
+		TRACE_boot = (boot+1)&0xffffff;
+	} else {
+		// not written yet, clear old contents
+		TRACE_boot = 0;
+		for (uint16_t s = 0; s < TRACE_SECTORS; s++) {
+			SD_writeBlockBegin(adr+s, &err);
+			for (uint16_t i = 0; (i < 512) && !err; i++) SPI_writeByte(0, &err);
+			if (!err) SD_writeBlockEnd(&err);
+			if (err) return;
+		}
+	}
+	TRACE_adr = adr;
+}
+
+// record an event, may be called from ISRs
+void TRACE_add(uint8_t type, uint32_t value)
+{
+	uint8_t s = SREG;
+
+	cli();
+	uint8_t next = ((TRACE_head+1)&(TRACE_NUM-1));
+	if (next == TRACE_tail) {
+		if (TRACE_lost != 0xffff) TRACE_lost++;
+	} else {
+		TRACE_time[TRACE_head] = TRACE_now();
+		TRACE_value[TRACE_head] = ((uint32_t)type<<24)|(value&0xffffff);
+		TRACE_head = next;
+	}
+	SREG = s;
+}
+
+static void TRACE_writeRecord(uint32_t time, uint32_t value, uint8_t *err)
+{
+	for (uint8_t i = 0; i < 4; i++, time >>= 8) SPI_writeByte(time&0xff, err);
+	for (uint8_t i = 0; i < 4; i++, value >>= 8) SPI_writeByte(value&0xff, err);
+}
+
+// write recorded events to the card
+// written if quiet or the ring is half full
+void TRACE_idle(uint8_t quiet)
+{
+	uint8_t err = 0, n, s = SREG;
+
+	cli();
+	TRACE_now();
+	n = ((TRACE_head-TRACE_tail)&(TRACE_NUM-1));
+	if (!TRACE_adr || !SD_p.inited || EJECT || !n || (!quiet && (n < TRACE_NUM/2))) {
+		SREG = s;
+		return;
+	}
+	SD_writeBlockBegin(TRACE_adr+(TRACE_seq%TRACE_SECTORS), &err);
+	if (!err) TRACE_writeRecord(TRACE_seq, ((uint32_t)TRACE_SEQ<<24)|TRACE_boot, &err);
+	if (!err) TRACE_writeRecord(TRACE_now(), ((uint32_t)TRACE_LOST<<24)|TRACE_lost, &err);
+	for (uint8_t i = 2; (i < 64) && !err; i++) {
+		if (TRACE_tail != TRACE_head) {
+			TRACE_writeRecord(TRACE_time[TRACE_tail], TRACE_value[TRACE_tail], &err);
+			TRACE_tail = ((TRACE_tail+1)&(TRACE_NUM-1));
+		} else TRACE_writeRecord(0, 0, &err);
+	}
+	if (!err) SD_writeBlockEnd(&err);
+	if (!err) {
+		TRACE_seq++;
+		TRACE_lost = 0;
+	}
+	SREG = s;
+}
+
+#endif
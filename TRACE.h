@@ -0,0 +1,69 @@
+﻿/*
+ * TRACE.h
+ *
+ * Created: 2026/10/19 10:12:40
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+// define to record accesses into UNISDISK.TRC (UNISDISK only)
+#ifndef SDISK2P
+//#define TRACE
+#endif
+
+// UNISDISK.TRC is TRACE_SECTORS contiguous sectors used as a ring
+// a sector has 64 records of 8 bytes, little endian
+//   uint32_t time : 8u sec ticks
+//   uint8_t value[3]
+//   uint8_t type : TRACE_NONE is an unused record
+// the first record of a sector is TRACE_SEQ,
+// its time is the sequence number of the sector and its value is the boot number
+// the sequence numbers go on across boots, a boot writes after the last sector of the one before
+// the second is TRACE_LOST, its value is the number of events dropped before the sector
+#define TRACE_SECTORS 256
+
+enum TRACE_TYPE {
+	TRACE_NONE,
+	TRACE_SEQ,
+	TRACE_LOST,			// events dropped before this sector
+	TRACE_HEAD,			// drive<<8 | physical track
+	TRACE_PREPARE,		// drive<<16 | track*16+sector
+	TRACE_FLUSH,		// track<<8 | sector of a written sector
+	TRACE_CARDERR		// 1 : no response, 2 : ejected before the data token, 3 : ejected while busy
+	// 0x80 - : SmartPort command code, value is the block number or the unit id
+};
+
+#ifdef TRACE
+#define TRACE_ADD(type, value) TRACE_add((type), (value))
+
+// open or create UNISDISK.TRC, recording stops if it fails
+void TRACE_open(void);
+
+// record an event, may be called from ISRs
+void TRACE_add(uint8_t type, uint32_t value);
+
+// write recorded events to the card
+// written if quiet or the ring is half full
+void TRACE_idle(uint8_t quiet);
+#else
+#define TRACE_ADD(type, value)
+#endif
+
+#endif /* TRACE_H_ */
@@ -31,6 +31,7 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #include "INI.h"
 #include "DISK2.h"
 #include "SMART.h"
+#include "HEAT.h"
 #include <string.h>
 
 // properties
@@ -133,10 +134,10 @@ uint8_t UI_chooseFile(void *tempBuff, uint8_t *err)
 			if (UI_name[UI_drv]) {
 				for (i=0; i<num; i++) {
 					OFF_PHASEINT;
-					if ((list[UI_cur].blkAdr==0)&&(list[UI_cur].offset==0)) {
+					if (i==0) {
 						memcpy(name_, "UNMOUNT ", 8);
 						memcpy(ext_, "   ",3);
-					} else FILE_getEntry(&list[i], name_, ext_, 0, 0, err);
+					} else FILE_getEntry(list, i, name_, ext_, 0, 0, err);
 					ON_PHASEINT;
 					if (*err) return 0;
 					if ((memcmp(name_, UI_name, 8)==0)&&(memcmp(ext_, UI_name+8, 3)==0)) {
@@ -174,11 +175,11 @@ uint8_t UI_chooseFile(void *tempBuff, uint8_t *err)
 					prevCur = UI_cur;
 					OFF_PHASEINT;
 					
-					if ((list[UI_cur].blkAdr==0)&&(list[UI_cur].offset==0)) {
+					if (UI_cur==0) {
 						memcpy(name_, "UNMOUNT ", 8);
 						memcpy(ext_, "   ",3);
 						attr = 0;
-					} else FILE_getEntry(&list[UI_cur], name_, ext_, &attr, 0, err);
+					} else FILE_getEntry(list, UI_cur, name_, ext_, &attr, 0, err);
 					ON_PHASEINT;
 					if (*err) return 0;
 					LCD_locate(5,0);
@@ -199,12 +200,12 @@ uint8_t UI_chooseFile(void *tempBuff, uint8_t *err)
 				LCD_print((timerBlink?name_:"        "), 8);
 			}
 			OFF_PHASEINT;
-			if ((list[UI_cur].blkAdr==0)&&(list[UI_cur].offset==0)) {
+			if (UI_cur==0) {
 				memcpy(name_, "UNMOUNT ", 8);
 				memcpy(ext_, "   ",3);
 				attr = 0;
 				stclst = 0;
-			} else FILE_getEntry(&list[UI_cur], name_, ext_, &attr, &stclst, err);
+			} else FILE_getEntry(list, UI_cur, name_, ext_, &attr, &stclst, err);
 			ON_PHASEINT;
 			if (*err) return 0;
 			if (attr&0b00010000) {
@@ -247,6 +248,69 @@ uint8_t UI_chooseFile(void *tempBuff, uint8_t *err)
 	}
 }
 
+#ifdef PROF
+// page through p50 / p99 / max of the latency histograms
+// PSW1 : next, PSW2 : previous, PSW4 : exit
+static void UI_showProf(void)
+{
+	static const char kind[PROF_KINDS][5] = {"PREP", "WBAK", "SPRD", "SPWR", "SPOT"};
+	static const char stat[3][4] = {"p50", "p99", "max"};
+	uint8_t page = 0, prev = 0xff;
+
+	while (!PSW1) ;
+	while (!button(4)) {
+		if (button(1) && (page < PROF_KINDS*3-1)) page++;
+		if (button(2) && (page > 0)) page--;
+		if (page != prev) {
+			uint8_t k = page/3, s = page%3;
+			uint16_t v = (s==2) ? PROF_max[k] : PROF_percentile(k, s?99:50);
+
+			prev = page;
+			LCD_locate(0,0);
+			LCD_print((char *)kind[k], 4);
+			LCD_print(" ", 1);
+			LCD_print((char *)stat[s], 3);
+			LCD_locate(0,1);
+			LCD_printdec((uint32_t)v*8, 6);
+			LCD_print("us", 2);
+		}
+	}
+	LCD_cls();
+}
+#endif
+
+// page through the access counters of the drives
+// RA is shown while blocks are read ahead for the drive
+// PSW1 : next, PSW2 : previous, PSW4 : exit
+static void UI_showHeat(uint8_t isDsk2)
+{
+	static const char label[2][HEAT_NUM][4] = {
+		{"HIT", "MIS", "R1 ", "R2 ", "R3 ", "R4 ", "R5 ", "R6 "},
+		{"T00", "T05", "T10", "T15", "T20", "T25", "T30", "WRT"}};
+	uint8_t page = 0, prev = 0xff, pages = (isDsk2?2:4)*HEAT_NUM;
+
+	while (!PSW2) ;
+	while (!button(4)) {
+		if (button(1) && (page < pages-1)) page++;
+		if (button(2) && (page > 0)) page--;
+		if (page != prev) {
+			uint8_t drv = page/HEAT_NUM, i = page%HEAT_NUM;
+
+			prev = page;
+			LCD_locate(0,0);
+			LCD_print("DR", 2);
+			LCD_printdec(drv+1, 1);
+			LCD_print(" ", 1);
+			LCD_print((char *)label[isDsk2][i], 3);
+			LCD_print(" ", 1);
+			LCD_locate(0,1);
+			LCD_printdec(HEAT_cnt[drv][i], 5);
+			LCD_print((!isDsk2 && HEAT_ahead(drv))?" RA":"   ", 3);
+		}
+	}
+	LCD_cls();
+}
+
 // called from DISK2 / SmartPort emulator
 uint8_t UI_checkExecute()
 {
@@ -260,16 +324,27 @@ uint8_t UI_checkExecute()
 		ON_TIMER2;
 		
 		UI_running = 1;
+		SMART_flush();
+		SMART_invalidate();
+#ifdef PROF
+		if (!PSW1) {
+			UI_showProf();
+			UI_running = 0;
+		} else
+#endif
+		if (!PSW2) {
+			UI_showHeat(isDsk2);
+			UI_running = 0;
+		} else
 		if (isDsk2 && !PSW3) {
 			if (!WP) {
-				uint8_t err = 0;
-				
-				INI_read(buffer2.ini.ini, &err);
-				if (err) { UI_running = 0; return 0; }
 				for (uint8_t drv = 0; drv < 2; drv++) {
 					if (buffer2.disk2.img[drv].valid && buffer2.disk2.img[drv].written) {
 						uint8_t err = 0;
 
+						// the conversion overwrites buffer2.ini.ini
+						INI_read(buffer2.ini.ini, &err);
+						if (err) { UI_running = 0; return 0; }
 						FILE_openAbs(&buffer2.ini.img[drv], (char *)buffer2.ini.ini+drv*64, &err);
 						if (!err && !buffer2.ini.img[drv].protect) {
 							DISK2_nic2Dsk(&buffer2.ini.img[drv], &buffer2.disk2.img[drv], &err);
@@ -287,7 +362,11 @@ uint8_t UI_checkExecute()
 			if (err) { UI_running = 0; return 0; }
 			if (UI_chooseFile((void *)buffer2.ui.filelist, &err)) {
 				//OFF_PHASEINT;
-				INI_substitute(buffer2.ui.filelist, isDsk2?UI_drv:(UI_drv+2), (char *)buffer2.ui.fullpath, &err);
+				if (INI_substitute(buffer2.ui.filelist, isDsk2?UI_drv:(UI_drv+2), (char *)buffer2.ui.fullpath, &err)) {
+					// another image, start counting again
+					HEAT_clear(UI_drv);
+					HEAT_save(1);
+				}
 				//ON_PHASEINT;
 				//OFF_PHASEINT;
 				if (memcmp(buffer2.ui.fullpath, "           ",11) == 0) buffer2.smart.img[UI_drv].valid = 0; 
@@ -317,7 +396,7 @@ uint8_t UI_checkExecute()
 					} else buffer2.disk2.img[UI_drv].valid = 0;
 					sei();
 				} else {
-					SMART_is2mg[UI_drv] = (!err && buffer2.smart.img[UI_drv].valid && (memcmp(buffer2.smart.img[UI_drv].name+8, "2MG", 3)==0));
+					SMART_mount(UI_drv);
 				}
 			}
 			//ON_PHASEINT;
@@ -34,6 +34,8 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #include "UI.h"
 #include "INI.h"
 #include "BUFFER.h"
+#include "TRACE.h"
+#include "HEAT.h"
 
 #define EEP_MODE (uint8_t *)0x0001
 
@@ -54,18 +56,28 @@ uint8_t exchangeSD(uint8_t start)
 		UI_clearProperties();
 	}
 	if (!SD_detect(start)) return 0;
+	SMART_invalidate();
 	cli();
 	INI_openCreate(&err);
+	// the card is timed on reads of the INI sector
+	if (!err && INI_sector()) SD_profile(INI_sector());
+	if (!err) HEAT_open();
+#ifdef TRACE
+	if (!err) TRACE_open();
+#endif
 	sei();
 	if (err) return 0;
 	
 	SMART_partition_num = 0;
+	INI_hold(1);
 	for (uint8_t drv = 0; drv < drvNum; drv++) {
 		uint8_t n = (isDsk2?drv:(drv+2));
 		err = 0;
 		cli();
+		// read again for each drive, the interrupt handlers may overwrite buffer2.ini.ini in between
 		INI_read(buffer2.ini.ini, &err);
-		if (err) { sei(); return 0; }
+		if (err) { INI_hold(0); sei(); return 0; }
+		if (!drv) FILE_idxEnable(INI_option(buffer2.ini.ini, "IDX=1"));
 		FILE_openAbs(isDsk2?&buffer2.ini.img[drv]:&buffer2.smart.img[drv], (char *)buffer2.ini.ini+n*64, &err);
 		sei();
 		if (err) { if (isDsk2) buffer2.disk2.img[drv].valid=0; else buffer2.smart.img[drv].valid = 0; continue; }
@@ -93,8 +105,13 @@ uint8_t exchangeSD(uint8_t start)
 				LCD_printAll("Write   protect.");
 			}
 			sei();
-		} else 	SMART_is2mg[drv] = (!err && buffer2.smart.img[drv].valid && (memcmp(buffer2.smart.img[drv].name+8, "2MG", 3)==0));
+		} else {
+			cli();
+			SMART_mount(drv);
+			sei();
+		}
 	}
+	INI_hold(0);
 	return 1;
 }
 
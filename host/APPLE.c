@@ -0,0 +1,491 @@
+﻿/*
+ * APPLE.c
+ *
+ * Created: 2026/10/19 07:34:56
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// the Apple II for the host build, as a task beside the firmware
+// SmartPort is driven on the phases, REQ and ACK as the IIgs and the Liron card do
+
+#include <string.h>
+#include "avr/io.h"
+#include "HAL.h"
+#include "SDCARD.h"
+#include "APPLE.h"
+#include "RIG.h"
+
+// ========== SmartPort ==========
+
+#define APPLE_REQ PIN0_bm
+#define APPLE_ENABLE 0x0a				// PH1 and PH3, the bus is enabled
+#define APPLE_ACK (VPORT2_OUT&PIN7_bm)
+#define APPLE_WAIT (1000*RIG_MS)		// for ACK, longer than the slowest card
+
+uint8_t APPLE_resp[1024];
+uint16_t APPLE_respLen;
+
+uint16_t APPLE_encode(uint8_t *pkt, uint8_t dest, uint8_t type, uint8_t aux, const uint8_t *data, uint16_t len)
+{
+	static const uint8_t sync[7] = {0xff, 0x3f, 0xcf, 0xf3, 0xfc, 0xff, 0xc3};
+	uint8_t odd = len%7, grp = len/7;
+	uint8_t checksum = 0, msb = 0x80;
+	uint16_t i, p;
+
+	memcpy(pkt, sync, 7);
+	pkt[7] = 0x80|dest;
+	pkt[8] = 0x80;						// SRC : the host
+	pkt[9] = 0x80|type;
+	pkt[10] = aux;
+	pkt[11] = 0x80;						// STAT
+	pkt[12] = 0x80|odd;
+	pkt[13] = 0x80|grp;
+	for (i=7; i<14; i++) checksum ^= pkt[i];
+	for (i=0; i<len; i++) checksum ^= data[i];
+	p = 14;
+	if (odd) {
+		for (i=0; i<odd; i++) {
+			msb |= (data[i]>>(i+1))&(0x80>>(i+1));
+			pkt[p+1+i] = data[i]|0x80;
+		}
+		pkt[p] = msb;
+		p += 1+odd;
+	}
+	for (i=0; i<grp; i++) {
+		const uint8_t *g = data+odd+i*7;
+		uint8_t j;
+
+		msb = 0x80;
+		for (j=0; j<7; j++) {
+			msb |= (g[j]>>(j+1))&(0x80>>(j+1));
+			pkt[p+1+j] = g[j]|0x80;
+		}
+		pkt[p] = msb;
+		p += 8;
+	}
+	pkt[p++] = checksum|0xaa;
+	pkt[p++] = (checksum>>1)|0xaa;
+	pkt[p++] = 0xc8;
+	return p;
+}
+
+int16_t APPLE_decode(const uint8_t *pkt, uint16_t len, uint8_t *data, uint16_t max)
+{
+	uint8_t odd, grp, checksum = 0;
+	uint16_t i, n, p;
+
+	if (len < 17) return -1;
+	odd = pkt[12]&0x7f;
+	grp = pkt[13]&0x7f;
+	n = odd+grp*7;
+	if ((n > max) || (len < 14+(odd?1+odd:0)+grp*8+3)) return -1;
+	p = 14;
+	if (odd) {
+		for (i=0; i<odd; i++) data[i] = ((pkt[p]<<(i+1))&0x80)|(pkt[p+1+i]&0x7f);
+		p += 1+odd;
+	}
+	for (i=0; i<grp; i++) {
+		uint8_t j;
+
+		for (j=0; j<7; j++) data[odd+i*7+j] = ((pkt[p]<<(j+1))&0x80)|(pkt[p+1+j]&0x7f);
+		p += 8;
+	}
+	for (i=7; i<14; i++) checksum ^= pkt[i];
+	for (i=0; i<n; i++) checksum ^= data[i];
+	if (checksum != ((pkt[p]&0x55)|((pkt[p+1]&0x55)<<1))) return -1;
+	return n;
+}
+
+// wait until ACK is as asked, 0 if not in time
+static uint8_t APPLE_ack(uint8_t high)
+{
+	uint64_t end = HAL_now+APPLE_WAIT;
+
+	while (!APPLE_ACK != !high) {
+		if (HAL_now >= end) return 0;
+		HAL_sleep(1000);
+	}
+	return 1;
+}
+
+// send a packet while the bus is enabled
+static uint8_t APPLE_send(const uint8_t *pkt, uint16_t len)
+{
+	if (!APPLE_ack(1)) return 0;
+	HAL_hostSend(pkt, len);
+	HAL_setIn(0, APPLE_REQ, APPLE_REQ);
+	if (!APPLE_ack(0)) return 0;
+	HAL_setIn(0, APPLE_REQ, 0);
+	return 1;
+}
+
+// receive a packet while the bus is enabled
+static uint8_t APPLE_receive(void)
+{
+	if (!APPLE_ack(1)) return 0;
+	HAL_setIn(0, APPLE_REQ, APPLE_REQ);
+	if (!APPLE_ack(0)) return 0;
+	APPLE_respLen = HAL_hostTake(APPLE_resp, sizeof(APPLE_resp));
+	return 1;
+}
+
+uint16_t APPLE_command(uint8_t unit, uint8_t cmd, const uint8_t *params, uint8_t n, const uint8_t *data)
+{
+	uint8_t buf[16], pkt[1024];
+	uint8_t aux = (cmd&APPLE_EXT)?0xc0:0x80;
+	uint16_t r = APPLE_TIMEOUT;
+
+	buf[0] = cmd;
+	memcpy(buf+1, params, n);
+	APPLE_respLen = 0;
+	HAL_setIn(0, PIN3_bm|PIN2_bm|PIN1_bm|PIN0_bm, APPLE_ENABLE);
+	if (!APPLE_send(pkt, APPLE_encode(pkt, unit, 0x00, aux, buf, 1+n))) goto end;
+	if (data && !APPLE_send(pkt, APPLE_encode(pkt, unit, 0x02, aux, data, 512))) goto end;
+	if (!APPLE_receive()) goto end;
+	r = (APPLE_respLen < 17) ? APPLE_BADPACKET : (APPLE_resp[11]&0x7f);
+end:
+	// the bus is disabled
+	HAL_setIn(0, PIN3_bm|PIN2_bm|PIN1_bm|PIN0_bm, 0);
+	return r;
+}
+
+uint8_t APPLE_smartInit(void)
+{
+	static const uint8_t params[8] = {0x02};
+	uint8_t unit;
+
+	for (unit=1; unit<16; unit++) {
+		uint16_t r = APPLE_command(unit, APPLE_INIT, params, 8, 0);
+
+		if (r > 0x7f) return unit-1;
+		if (r) return unit;					// the last unit
+	}
+	return unit-1;
+}
+
+// parameters of READ and WRITE, the buffer at 0x2000
+static uint8_t APPLE_params(uint8_t *p, uint32_t block, uint8_t ext)
+{
+	if (ext) {
+		uint8_t q[9] = {0x03, 0x00, 0x20, 0x00, 0x00, block, block>>8, block>>16, block>>24};
+
+		memcpy(p, q, 9);
+		return 9;
+	} else {
+		uint8_t q[8] = {0x03, 0x00, 0x20, block, block>>8, block>>16, 0x00, 0x00};
+
+		memcpy(p, q, 8);
+		return 8;
+	}
+}
+
+uint16_t APPLE_smartRead(uint8_t unit, uint32_t block, uint8_t ext, uint8_t *data)
+{
+	uint8_t p[9];
+	uint16_t r = APPLE_command(unit, APPLE_READ|(ext?APPLE_EXT:0), p, APPLE_params(p, block, ext), 0);
+
+	if (r) return r;
+	if (((APPLE_resp[9]&0x7f) != 0x02) || (APPLE_decode(APPLE_resp, APPLE_respLen, data, 512) != 512)) return APPLE_BADPACKET;
+	return APPLE_OK;
+}
+
+uint16_t APPLE_smartWrite(uint8_t unit, uint32_t block, uint8_t ext, const uint8_t *data)
+{
+	uint8_t p[9];
+
+	return APPLE_command(unit, APPLE_WRITE|(ext?APPLE_EXT:0), p, APPLE_params(p, block, ext), data);
+}
+
+int64_t APPLE_smartBlocks(uint8_t unit, uint8_t ext)
+{
+	uint8_t p[9] = {0x03, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	uint8_t d[32];
+	int16_t n;
+
+	if (APPLE_command(unit, APPLE_STATUS|(ext?APPLE_EXT:0), p, ext?6:4, 0)) return -1;
+	n = APPLE_decode(APPLE_resp, APPLE_respLen, d, sizeof(d));
+	if (n < (ext?5:4)) return -1;
+	return d[1]|(d[2]<<8)|((uint32_t)d[3]<<16)|(ext?((uint32_t)d[4]<<24):0);
+}
+
+// until the card is not accessed for a while, as the firmware is idle
+static void APPLE_settle(void)
+{
+	uint32_t last = 0xffffffff;
+
+	while (1) {
+		uint32_t n = 0;
+		uint8_t i;
+
+		for (i=0; i<64; i++) n += SDCARD_stat.cmds[i];
+		if (n == last) return;
+		last = n;
+		HAL_sleep(50*RIG_MS);
+	}
+}
+
+void APPLE_smartReady(void)
+{
+	while (!buffer2.smart.img[0].valid) HAL_sleep(RIG_MS);
+	APPLE_settle();
+}
+
+// ========== Disk II ==========
+
+#define APPLE_EN1 PIN6_bm
+#define APPLE_EN2 PIN5_bm
+#define APPLE_WREQ PIN2_bm
+#define APPLE_PHASES (PIN3_bm|PIN2_bm|PIN1_bm|PIN0_bm)
+#define APPLE_STEP (3*RIG_MS)			// a half track, as RWTS does at its slowest
+#define APPLE_SETTLE (20*RIG_MS)
+#define APPLE_BIT 4000ULL
+#define APPLE_TRIES 48					// address fields, as RWTS does
+
+const uint8_t APPLE_skew[16] = {0, 13, 11, 9, 7, 5, 3, 1, 14, 12, 10, 8, 6, 4, 2, 15};
+
+static const uint8_t APPLE_nib[64] = {
+	0x96, 0x97, 0x9a, 0x9b, 0x9d, 0x9e, 0x9f, 0xa6, 0xa7, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb2, 0xb3,
+	0xb4, 0xb5, 0xb6, 0xb7, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf, 0xcb, 0xcd, 0xce, 0xcf, 0xd3,
+	0xd6, 0xd7, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf, 0xe5, 0xe6, 0xe7, 0xe9, 0xea, 0xeb, 0xec,
+	0xed, 0xee, 0xef, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+static uint8_t APPLE_six[256];			// 0xff : not a nibble
+
+static int16_t APPLE_half = -1;			// the half track of the head, -1 : not known
+static uint8_t APPLE_bits[4096];
+static uint32_t APPLE_bitNum, APPLE_bitPos;
+static uint8_t APPLE_shift;
+
+// the low 2 bits of 3 bytes, the bits of each pair swapped
+static uint8_t APPLE_aux(const uint8_t *src, uint8_t i)
+{
+	uint8_t x = 0, k;
+
+	for (k=0; k<3; k++) {
+		uint16_t j = i+k*86;
+
+		if (j < 256) x |= (((src[j]&1)<<1)|((src[j]>>1)&1))<<(k*2);
+	}
+	return x;
+}
+
+// 256 bytes to 342 nibbles and the checksum
+static void APPLE_encode62(const uint8_t *src, uint8_t *dst)
+{
+	uint8_t prev = 0, x;
+	uint16_t i;
+
+	for (i=0; i<86; i++) {
+		x = APPLE_aux(src, i);
+		dst[i] = APPLE_nib[x^prev];
+		prev = x;
+	}
+	for (i=0; i<256; i++) {
+		x = src[i]>>2;
+		dst[86+i] = APPLE_nib[x^prev];
+		prev = x;
+	}
+	dst[342] = APPLE_nib[prev];
+}
+
+// 343 nibbles to 256 bytes, 0 if the checksum matches
+static uint8_t APPLE_decode62(const uint8_t *src, uint8_t *dst)
+{
+	uint8_t aux[86], prev = 0, x;
+	uint16_t i;
+
+	for (i=0; i<343; i++) if (APPLE_six[src[i]] == 0xff) return 1;
+	for (i=0; i<86; i++) {
+		x = prev^APPLE_six[src[i]];
+		aux[i] = x;
+		prev = x;
+	}
+	for (i=0; i<256; i++) {
+		uint8_t a = aux[i%86]>>((i/86)*2);
+
+		x = prev^APPLE_six[src[86+i]];
+		dst[i] = (x<<2)|((a&1)<<1)|((a>>1)&1);
+		prev = x;
+	}
+	return (prev^APPLE_six[src[342]]) != 0;
+}
+
+// the next nibble on RDR, 0 if none until the time
+static uint8_t APPLE_nibble(uint64_t end)
+{
+	while (1) {
+		while (APPLE_bitPos < APPLE_bitNum) {
+			APPLE_shift = (APPLE_shift<<1)|(APPLE_bits[APPLE_bitPos++]&1);
+			if (APPLE_shift&0x80) {
+				uint8_t n = APPLE_shift;
+
+				APPLE_shift = 0;
+				return n;
+			}
+		}
+		if (HAL_now >= end) return 0;
+		HAL_sleep(25*APPLE_BIT);
+		APPLE_bitNum = HAL_rdrTake(APPLE_bits, 0, sizeof(APPLE_bits));
+		APPLE_bitPos = 0;
+	}
+}
+
+static uint8_t APPLE_44(uint64_t end)
+{
+	uint8_t a = APPLE_nibble(end);
+
+	return ((a<<1)|1)&APPLE_nibble(end);
+}
+
+// find the address field of the sector on the track, 0 if not
+static uint8_t APPLE_address(uint8_t track, uint8_t phys)
+{
+	// a revolution is 16 sectors of 412 bytes and the time to prepare each
+	uint64_t end = HAL_now+3*16*(412*8*APPLE_BIT+5*RIG_MS);
+	uint8_t tries = APPLE_TRIES;
+
+	while (tries) {
+		uint8_t v, t, s, c;
+
+		if (APPLE_nibble(end) != 0xd5) { if (HAL_now >= end) return 0; continue; }
+		if (APPLE_nibble(end) != 0xaa) continue;
+		if (APPLE_nibble(end) != 0x96) continue;
+		tries--;
+		v = APPLE_44(end);
+		t = APPLE_44(end);
+		s = APPLE_44(end);
+		c = APPLE_44(end);
+		if ((v^t^s) != c) continue;
+		if ((t == track) && (s == phys)) return 1;
+	}
+	return 0;
+}
+
+void APPLE_diskOn(uint8_t drive)
+{
+	uint8_t i;
+
+	if (!APPLE_six[0]) {
+		memset(APPLE_six, 0xff, sizeof(APPLE_six));
+		for (i=0; i<64; i++) APPLE_six[APPLE_nib[i]] = i;
+	}
+	HAL_setIn(2, APPLE_EN1|APPLE_EN2, drive ? APPLE_EN1 : APPLE_EN2);
+	HAL_rdrListen(1);
+	APPLE_bitNum = APPLE_bitPos = 0;
+	APPLE_shift = 0;
+}
+
+void APPLE_diskOff(void)
+{
+	HAL_setIn(2, APPLE_EN1|APPLE_EN2, APPLE_EN1|APPLE_EN2);
+	HAL_rdrListen(0);
+}
+
+// a half track in or out, the next phase on before the last one off
+static void APPLE_step(int8_t dir)
+{
+	uint8_t from = 1<<(APPLE_half&3);
+
+	APPLE_half += dir;
+	HAL_setIn(0, APPLE_PHASES, from|(1<<(APPLE_half&3)));
+	HAL_sleep(RIG_MS);
+	HAL_setIn(0, APPLE_PHASES, 1<<(APPLE_half&3));
+	HAL_sleep(APPLE_STEP);
+}
+
+void APPLE_seek(uint8_t track)
+{
+	if (APPLE_half < 0) {
+		// recalibrate, from track 40 to 0 as RWTS does
+		APPLE_half = 80;
+		while (APPLE_half) APPLE_step(-1);
+	}
+	while (APPLE_half < track*2) APPLE_step(1);
+	while (APPLE_half > track*2) APPLE_step(-1);
+	HAL_setIn(0, APPLE_PHASES, 0);
+	HAL_sleep(APPLE_SETTLE);
+}
+
+uint16_t APPLE_readNibbles(uint8_t sector, uint8_t *nib)
+{
+	uint64_t end;
+	uint16_t i;
+
+	if (!APPLE_address(APPLE_half/2, APPLE_skew[sector&15])) return APPLE_NOSECTOR;
+	end = HAL_now+64*8*APPLE_BIT;
+	for (i=0; i<32; i++) {
+		if (APPLE_nibble(end) != 0xd5) continue;
+		if (APPLE_nibble(end) != 0xaa) continue;
+		if (APPLE_nibble(end) == 0xad) break;
+	}
+	if (i == 32) return APPLE_BADDATA;
+	end = HAL_now+400*8*APPLE_BIT;
+	for (i=0; i<343; i++) nib[i] = APPLE_nibble(end);
+	return APPLE_OK;
+}
+
+uint16_t APPLE_readSector(uint8_t sector, uint8_t *data)
+{
+	uint8_t nib[343];
+	uint16_t r = APPLE_readNibbles(sector, nib);
+
+	if (r) return r;
+	if (APPLE_decode62(nib, data)) return APPLE_BADDATA;
+	return APPLE_OK;
+}
+
+uint16_t APPLE_writeNibbles(uint8_t sector, const uint8_t *data)
+{
+	static const uint8_t head[3] = {0xd5, 0xaa, 0xad}, tail[4] = {0xde, 0xaa, 0xeb, 0xff};
+	uint8_t nib[5+3+343+4], bits[sizeof(nib)];
+	uint16_t i, n = 0;
+	uint64_t t = 0;
+
+	if (!APPLE_address(APPLE_half/2, APPLE_skew[sector&15])) return APPLE_NOSECTOR;
+	APPLE_nibble(HAL_now+64*8*APPLE_BIT);				// DE AA of the address field
+	APPLE_nibble(HAL_now+64*8*APPLE_BIT);
+	for (i=0; i<5; i++) { nib[n] = 0xff; bits[n++] = 10; }	// sync
+	for (i=0; i<3; i++) { nib[n] = head[i]; bits[n++] = 8; }
+	for (i=0; i<343; i++) { nib[n] = data[i]; bits[n++] = 8; }
+	for (i=0; i<4; i++) { nib[n] = tail[i]; bits[n++] = 8; }
+	for (i=0; i<n; i++) t += bits[i]*APPLE_BIT;
+	HAL_writeStart(nib, bits, n);
+	HAL_setIn(2, APPLE_WREQ, 0);
+	HAL_sleep(t);
+	HAL_setIn(2, APPLE_WREQ, APPLE_WREQ);
+	// the bits sent meanwhile are not read
+	HAL_rdrTake(APPLE_bits, 0, sizeof(APPLE_bits));
+	APPLE_bitNum = APPLE_bitPos = 0;
+	APPLE_shift = 0;
+	return APPLE_OK;
+}
+
+uint16_t APPLE_writeSector(uint8_t sector, const uint8_t *data)
+{
+	uint8_t nib[343];
+
+	APPLE_encode62(data, nib);
+	return APPLE_writeNibbles(sector, nib);
+}
+
+void APPLE_diskReady(void)
+{
+	// the timer of the bit stream is set by DISK2_init
+	while (!buffer2.disk2.img[0].valid || !TCC4.CTRLA) HAL_sleep(RIG_MS);
+	APPLE_settle();
+}
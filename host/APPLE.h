@@ -0,0 +1,91 @@
+﻿/*
+ * APPLE.h
+ *
+ * Created: 2026/10/19 07:34:56
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// the Apple II for the host build, as a task beside the firmware
+
+#ifndef APPLE_H_
+#define APPLE_H_
+
+#include <stdint.h>
+
+// ========== SmartPort ==========
+
+// the commands, the extended ones have 0x40 more
+#define APPLE_STATUS 0x00
+#define APPLE_READ 0x01
+#define APPLE_WRITE 0x02
+#define APPLE_FORMAT 0x03
+#define APPLE_INIT 0x05
+#define APPLE_EXT 0x40
+
+// status of a response and the errors of this model
+#define APPLE_OK 0x00
+#define APPLE_IOERR 0x27
+#define APPLE_TIMEOUT 0x100			// no response
+#define APPLE_BADPACKET 0x101		// checksum or type
+
+// a packet as sent on the bus, return the length
+uint16_t APPLE_encode(uint8_t *pkt, uint8_t dest, uint8_t type, uint8_t aux, const uint8_t *data, uint16_t len);
+// the data of a packet, return the length or -1 on a bad checksum
+int16_t APPLE_decode(const uint8_t *pkt, uint16_t len, uint8_t *data, uint16_t max);
+
+// a command to a unit from 1, with the data packet to write if any
+// the response is in APPLE_resp, return its status or an error of this model
+uint16_t APPLE_command(uint8_t unit, uint8_t cmd, const uint8_t *params, uint8_t n, const uint8_t *data);
+extern uint8_t APPLE_resp[1024];
+extern uint16_t APPLE_respLen;
+
+// INIT the units, return the number of them
+uint8_t APPLE_smartInit(void);
+uint16_t APPLE_smartRead(uint8_t unit, uint32_t block, uint8_t ext, uint8_t *data);
+uint16_t APPLE_smartWrite(uint8_t unit, uint32_t block, uint8_t ext, const uint8_t *data);
+// the status of the unit, return the number of blocks or -1
+int64_t APPLE_smartBlocks(uint8_t unit, uint8_t ext);
+
+// wait until the firmware serves SmartPort
+void APPLE_smartReady(void);
+
+// ========== Disk II ==========
+
+// errors of RWTS
+#define APPLE_NOSECTOR 0x40			// the address field is not found
+#define APPLE_BADDATA 0x10			// the data field is not found or broken
+
+// the drive 0 or 1 on or off
+void APPLE_diskOn(uint8_t drive);
+void APPLE_diskOff(void);
+// move the head by the phases, the first seek recalibrates on track 0
+void APPLE_seek(uint8_t track);
+// a sector of DOS 3.3 of the track under the head, 256 bytes
+// return APPLE_OK or an error
+uint16_t APPLE_readSector(uint8_t sector, uint8_t *data);
+uint16_t APPLE_writeSector(uint8_t sector, const uint8_t *data);
+// the 343 nibbles of the data field as they are
+uint16_t APPLE_readNibbles(uint8_t sector, uint8_t *nib);
+uint16_t APPLE_writeNibbles(uint8_t sector, const uint8_t *nib);
+// the logical sector of DOS 3.3 in a physical sector
+extern const uint8_t APPLE_skew[16];
+
+// wait until the firmware serves the drive 0
+void APPLE_diskReady(void);
+
+#endif /* APPLE_H_ */
@@ -0,0 +1,265 @@
+﻿/*
+ * BENCH.c
+ *
+ * Created: 2026/10/19 07:32:56
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// benchmarks of the host build, in simulated time on each profile of the card
+// each runs the firmware in a process of its own, as the tests do
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "HAL.h"
+#include "SDCARD.h"
+#include "IMAGE.h"
+#include "RIG.h"
+#include "APPLE.h"
+#include "../UI.h"
+
+static uint8_t BENCH_profile;
+static uint8_t (*BENCH_until)(void);
+static uint64_t BENCH_at;
+
+// the task, until the firmware gets there
+static void BENCH_wait(void)
+{
+	while (!BENCH_until()) HAL_sleep(100000);
+	BENCH_at = HAL_now;
+}
+
+static void BENCH_report(const char *what, uint64_t ns)
+{
+	printf("%-8s %-10s %9.1f ms  read %6u  written %5u  access max %6.2f ms  busy max %6.2f ms\n",
+		SDCARD_profiles[BENCH_profile].name, what, ns/1e6,
+		SDCARD_stat.readBlocks, SDCARD_stat.writeBlocks,
+		SDCARD_stat.maxAccess/1e6, SDCARD_stat.maxBusy/1e6);
+}
+
+// ========== mount ==========
+
+static uint8_t BENCH_smartMounted(void) { return buffer2.smart.img[0].valid; }
+
+// power on until the SmartPort image is mounted
+static void BENCH_mount(uint8_t fs, const char *what)
+{
+	uint8_t *d = RIG_blocks(1600);
+	const char *paths[6] = {0, 0, "TEST    PO "};
+
+	IMAGE_new(fs, 64, 1);
+	RIG_ini(0, paths);
+	IMAGE_addFile(0, "TEST.PO", d, 1600*512, 0);
+	RIG_insert(1);
+	SDCARD_setProfile(BENCH_profile, 1);
+	BENCH_until = BENCH_smartMounted;
+	RIG_boot(BENCH_wait);
+	BENCH_report(what, BENCH_at);
+	free(d);
+}
+
+static void BENCH_mountFat16(void) { BENCH_mount(IMAGE_FAT16, "fat16"); }
+static void BENCH_mountFat32(void) { BENCH_mount(IMAGE_FAT32, "fat32"); }
+static void BENCH_mountExfat(void) { BENCH_mount(IMAGE_EXFAT, "exfat"); }
+
+// ========== DSK to NIC ==========
+
+static uint8_t BENCH_disk2Mounted(void) { return buffer2.disk2.img[0].valid; }
+
+// power on until the DSK is converted and mounted
+static void BENCH_dsk2Nic(void)
+{
+	uint8_t *d = RIG_blocks(280);
+	const char *paths[6] = {"TEST    DSK"};
+
+	IMAGE_new(IMAGE_FAT16, 64, 0);
+	RIG_ini(0, paths);
+	IMAGE_addFile(0, "TEST.DSK", d, 280*512, 0);
+	RIG_insert(0);
+	SDCARD_setProfile(BENCH_profile, 1);
+	BENCH_until = BENCH_disk2Mounted;
+	RIG_boot(BENCH_wait);
+	BENCH_report("dsk2nic", BENCH_at);
+	free(d);
+}
+
+// ========== fragmented FAT32 ==========
+
+#define BENCH_FRAG_BLOCKS 32768
+#define BENCH_FRAG_READS 200
+
+static uint64_t BENCH_fragTime;
+static uint32_t BENCH_fragReads;
+
+// SmartPort reads at random blocks, the FAT is walked from the skip table
+static void BENCH_fragTask(void)
+{
+	uint8_t data[512];
+	uint32_t r = 1, reads;
+	uint64_t t;
+	uint16_t i;
+
+	APPLE_smartReady();
+	APPLE_smartInit();
+	reads = SDCARD_stat.readBlocks;
+	t = HAL_now;
+	for (i=0; i<BENCH_FRAG_READS; i++) {
+		r = r*1103515245+12345;
+		if (APPLE_smartRead(1, (r>>8)%BENCH_FRAG_BLOCKS, 0, data) != APPLE_OK) RIG_FAIL("read");
+	}
+	BENCH_fragTime = HAL_now-t;
+	BENCH_fragReads = SDCARD_stat.readBlocks-reads;
+}
+
+// a 16MB image with a free cluster after each 8, too many extents for the map of struct FILE
+static void BENCH_fragFat32(void)
+{
+	uint8_t *d = RIG_blocks(BENCH_FRAG_BLOCKS);
+	const char *paths[6] = {0, 0, "TEST    PO "};
+
+	IMAGE_new(IMAGE_FAT32, 64, 1);
+	RIG_ini(0, paths);
+	IMAGE_addFile(0, "TEST.PO", d, BENCH_FRAG_BLOCKS*512, 8);
+	RIG_insert(1);
+	SDCARD_setProfile(BENCH_profile, 1);
+	RIG_boot(BENCH_fragTask);
+	printf("%-8s %-10s %6.2f ms  %5.2f card reads a block\n", SDCARD_profiles[BENCH_profile].name, "fragFat32",
+		BENCH_fragTime/1e6/BENCH_FRAG_READS, (double)BENCH_fragReads/BENCH_FRAG_READS);
+	free(d);
+}
+
+// ========== UNISDISK.INI ==========
+
+static struct SDCARD_stat BENCH_from;
+
+static uint8_t BENCH_uiDone(void) { return !UI_running; }
+
+// push a button of the UI and release it
+static void BENCH_push(uint8_t port, uint8_t mask)
+{
+	HAL_setIn(port, mask, 0);
+	HAL_sleep(100*RIG_MS);
+	HAL_setIn(port, mask, mask);
+}
+
+static void BENCH_iniReport(const char *what, uint64_t ns)
+{
+	printf("%-8s %-10s %9.1f ms  read %6u  written %5u  INI read %2u  written %u  INI card %6.2f ms\n",
+		SDCARD_profiles[BENCH_profile].name, what, ns/1e6,
+		SDCARD_stat.readBlocks-BENCH_from.readBlocks, SDCARD_stat.writeBlocks-BENCH_from.writeBlocks,
+		SDCARD_stat.watchReads-BENCH_from.watchReads, SDCARD_stat.watchWrites-BENCH_from.watchWrites,
+		(SDCARD_stat.watchTime-BENCH_from.watchTime)/1e6);
+	BENCH_from = SDCARD_stat;
+}
+
+// PSW4 : the list, PSW1 : next, PSW3 : select
+// the time of the select is until the image is mounted
+static void BENCH_iniSelect(const char *what, uint8_t next)
+{
+	uint64_t t;
+
+	BENCH_push(2, PIN1_bm);
+	HAL_sleep(1000*RIG_MS);
+	if (next) {
+		BENCH_push(0, PIN4_bm);
+		HAL_sleep(1000*RIG_MS);
+	}
+	BENCH_push(2, PIN3_bm);
+	t = HAL_now;
+	BENCH_until = BENCH_uiDone;
+	BENCH_wait();
+	BENCH_iniReport(what, BENCH_at-t);
+}
+
+static void BENCH_iniTask(void)
+{
+	BENCH_until = BENCH_smartMounted;
+	BENCH_wait();
+	// the other drives are looked up after the first is mounted
+	HAL_sleep(1000*RIG_MS);
+	BENCH_iniReport("iniMount", BENCH_at);
+	BENCH_iniSelect("iniSwap", 1);
+	if (memcmp(buffer2.smart.img[0].name, "B       PO ", 11)) RIG_FAIL("B.PO not mounted");
+	HAL_sleep(1000*RIG_MS);
+	BENCH_iniSelect("iniSame", 0);
+	if (memcmp(buffer2.smart.img[0].name, "B       PO ", 11)) RIG_FAIL("B.PO not kept");
+}
+
+// the reads and writes of UNISDISK.INI at the mount, at a swap of the image and at choosing the same one
+static void BENCH_ini(void)
+{
+	uint8_t *d = RIG_blocks(1600), ini[512];
+	const char *paths[6] = {0, 0, "A       PO "};
+	uint32_t lba;
+
+	IMAGE_new(IMAGE_FAT32, 64, 1);
+	RIG_ini(0, paths);
+	IMAGE_addFile(0, "A.PO", d, 1600*512, 0);
+	IMAGE_addFile(0, "B.PO", d, 1600*512, 0);
+	IMAGE_readFile(0, "UNISDISK.INI", ini, 512);
+	for (lba=0; lba<64*2048; lba++) if (!memcmp(IMAGE_sector(lba), ini, 512)) break;
+	SDCARD_watch = lba;
+	RIG_insert(1);
+	SDCARD_setProfile(BENCH_profile, 1);
+	RIG_boot(BENCH_iniTask);
+	free(d);
+}
+
+// ========== all ==========
+
+static const struct RIG_case BENCH_cases[] = {
+	{"mountFat16", BENCH_mountFat16},
+	{"mountFat32", BENCH_mountFat32},
+	{"mountExfat", BENCH_mountExfat},
+	{"dsk2Nic", BENCH_dsk2Nic},
+	{"fragFat32", BENCH_fragFat32},
+	{"ini", BENCH_ini},
+	{0, 0}
+};
+
+// bench [profile [case]]
+int main(int argc, char *argv[])
+{
+	const struct RIG_case *t;
+	int failed = 0;
+
+	setvbuf(stdout, 0, _IONBF, 0);
+	for (BENCH_profile=0; BENCH_profile<SDCARD_PROFILES; BENCH_profile++) {
+		if ((argc > 1) && strcmp(argv[1], SDCARD_profiles[BENCH_profile].name)) continue;
+		for (t=BENCH_cases; t->name; t++) {
+			pid_t pid;
+			int st;
+
+			if ((argc > 2) && strcmp(argv[2], t->name)) continue;
+			pid = fork();
+			if (!pid) {
+				t->f();
+				exit(0);
+			}
+			waitpid(pid, &st, 0);
+			RIG_clean(pid);
+			if (!WIFEXITED(st) || WEXITSTATUS(st)) {
+				printf("%-8s %-10s failed\n", SDCARD_profiles[BENCH_profile].name, t->name);
+				failed++;
+			}
+		}
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,194 @@
+﻿/*
+ * CODEC.c
+ *
+ * Created: 2026/10/19 08:34:35
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// the 6-and-2 codec of CONVERT.c against the loops it replaced, cycles per sector
+// it checks both give the same nibbles and bytes and times them with the TSC
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CODEC_TSC() __rdtsc()
+#else
+#define CODEC_TSC() 0
+#endif
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "../CONVERT.h"
+
+#define CODEC_SECTORS 4
+
+// the tables and loops of DISK2_dsk2Nic and DISK2_nic2Dsk before CONVERT.c, all in flash
+static PROGMEM const uint8_t CODEC_flipBit[] = { 0, 2, 1, 3 };
+static PROGMEM const uint8_t CODEC_flipBit1[] = { 0, 2, 1, 3 };
+static PROGMEM const uint8_t CODEC_flipBit2[] = { 0, 8, 4, 12 };
+static PROGMEM const uint8_t CODEC_flipBit3[] = { 0, 32, 16, 48 };
+static PROGMEM const uint8_t CODEC_encTable[] = {
+	0x96,0x97,0x9A,0x9B,0x9D,0x9E,0x9F,0xA6,
+	0xA7,0xAB,0xAC,0xAD,0xAE,0xAF,0xB2,0xB3,
+	0xB4,0xB5,0xB6,0xB7,0xB9,0xBA,0xBB,0xBC,
+	0xBD,0xBE,0xBF,0xCB,0xCD,0xCE,0xCF,0xD3,
+	0xD6,0xD7,0xD9,0xDA,0xDB,0xDC,0xDD,0xDE,
+	0xDF,0xE5,0xE6,0xE7,0xE9,0xEA,0xEB,0xEC,
+	0xED,0xEE,0xEF,0xF2,0xF3,0xF4,0xF5,0xF6,
+	0xF7,0xF9,0xFA,0xFB,0xFC,0xFD,0xFE,0xFF
+};
+
+static __attribute__((noinline)) void CODEC_oldEncode(const uint8_t *src, uint8_t *dst)
+{
+	uint16_t i;
+	uint8_t x, ox = 0;
+
+	for (i = 0; i < 86; i++) {
+		x = (pgm_read_byte_near(CODEC_flipBit1+(src[i]&3)) |
+		pgm_read_byte_near(CODEC_flipBit2+(src[i+86]&3)) |
+		((i<=83)?pgm_read_byte_near(CODEC_flipBit3+(src[i+172]&3)):0));
+		dst[i] = pgm_read_byte_near(CODEC_encTable+(x^ox));
+		ox = x;
+	}
+	for (i = 0; i < 256; i++) {
+		x = (src[i] >> 2);
+		dst[i+86] = pgm_read_byte_near(CODEC_encTable+(x^ox));
+		ox = x;
+	}
+	dst[342]=pgm_read_byte_near(CODEC_encTable+ox);
+}
+
+// dst has to hold 258 bytes, the last auxiliary nibbles spill over the sector
+static __attribute__((noinline)) void CODEC_oldDecode(const uint8_t *src, uint8_t *dst)
+{
+	uint16_t i, j;
+	uint8_t x, ox = 0;
+
+	for (j=0, i=0; i<86; i++, j++) {
+		x = ((ox^pgm_read_byte_near(CONVERT_decTable+src[i]))&0x3f);
+		dst[j+172] = pgm_read_byte_near(CODEC_flipBit+((x>>4)&3));
+		dst[j+86] = pgm_read_byte_near(CODEC_flipBit+((x>>2)&3));
+		dst[j] = pgm_read_byte_near(CODEC_flipBit+((x)&3));
+		ox = x;
+	}
+	for (j=0, i=86; i<342; i++, j++) {
+		x = ((ox^pgm_read_byte_near(CONVERT_decTable+src[i]))&0x3f);
+		dst[j]|=(x<<2);
+		ox = x;
+	}
+}
+
+static uint8_t CODEC_src[CODEC_SECTORS][256];
+static uint8_t CODEC_nic[CODEC_SECTORS][343];
+static uint8_t CODEC_dst[258];
+
+static void CODEC_fill(uint32_t seed)
+{
+	uint16_t s, i;
+
+	for (s=0; s<CODEC_SECTORS; s++) for (i=0; i<256; i++) {
+		seed = seed*1103515245+12345;
+		CODEC_src[s][i] = (seed>>16);
+	}
+}
+
+// the best of the batches, the others were interrupted
+#define CODEC_BATCHES 50
+#define CODEC_RUNS 10000
+
+static uint8_t CODEC_failures;
+
+static void CODEC_check(uint8_t ok, const char *what)
+{
+	if (ok) return;
+	printf("FAIL %s\n", what);
+	CODEC_failures++;
+}
+
+// the new codec gives what the old loops gave, and gets the sector back
+static void CODEC_compare(void)
+{
+	static uint8_t a[343], b[343], c[258], d[258];
+	uint16_t n;
+	uint8_t s;
+
+	for (n=0; n<1000; n++) {
+		CODEC_fill(n);
+		for (s=0; s<CODEC_SECTORS; s++) {
+			CODEC_oldEncode(CODEC_src[s], a);
+			CONVERT_encode(CODEC_src[s], b);
+			CODEC_check(!memcmp(a, b, 343), "encode differs from the old loops");
+			CODEC_oldDecode(a, c);
+			CODEC_check(!CONVERT_decode(b, d), "checksum of a sector");
+			CODEC_check(!memcmp(c, d, 256), "decode differs from the old loops");
+			CODEC_check(!memcmp(d, CODEC_src[s], 256), "decode of an encoded sector");
+			b[n%342] ^= 1;
+			CODEC_check(CONVERT_decode(b, d) != 0, "checksum of a bad nibble");
+		}
+	}
+}
+
+static uint64_t CODEC_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec*1000000000+t.tv_nsec;
+}
+
+static void CODEC_time(const char *what, uint8_t which)
+{
+	uint64_t c0, n0, c = ~0ULL, n = ~0ULL;
+	uint32_t b, r;
+	uint8_t s, sink = 0;
+
+	for (b=0; b<CODEC_BATCHES; b++) {
+		c0 = CODEC_TSC();
+		n0 = CODEC_ns();
+		for (r=0; r<CODEC_RUNS; r++) {
+			s = (r%CODEC_SECTORS);
+			switch (which) {
+			case 1: CODEC_oldEncode(CODEC_src[s], CODEC_nic[s]); break;
+			case 2: CONVERT_encode(CODEC_src[s], CODEC_nic[s]); break;
+			case 3: CODEC_oldDecode(CODEC_nic[s], CODEC_dst); break;
+			case 4: sink += CONVERT_decode(CODEC_nic[s], CODEC_dst); break;
+			}
+		}
+		c0 = CODEC_TSC()-c0;
+		n0 = CODEC_ns()-n0;
+		if (c0 < c) c = c0;
+		if (n0 < n) n = n0;
+	}
+	printf("x86      %-14s %8.1f cycles %7.1f ns a sector\n", what, (double)c/CODEC_RUNS, (double)n/CODEC_RUNS);
+	CODEC_check(!sink, "checksum while timing");
+}
+
+int main(void)
+{
+	CODEC_compare();
+	CODEC_fill(1);
+	for (uint8_t s=0; s<CODEC_SECTORS; s++) CONVERT_encode(CODEC_src[s], CODEC_nic[s]);
+	CODEC_time("old encode", 1);
+	CODEC_time("encode", 2);
+	CODEC_time("old decode", 3);
+	CODEC_time("decode", 4);
+	printf("%s\n", CODEC_failures ? "FAILED" : "OK");
+	return CODEC_failures != 0;
+}
@@ -0,0 +1,97 @@
+﻿/*
+ * DISK2ASM.c
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// the model of DISK2ASM.S for the host build
+// the bits and the nibbles are timed as on the chip, the cycles are approximate
+
+#include "avr/io.h"
+#include "avr/interrupt.h"
+#include "HAL.h"
+extern uint8_t buffer1[];
+
+extern volatile uint8_t DISK2_readPulse;
+extern volatile uint8_t DISK2_magState;
+extern volatile uint8_t DISK2_prepare;
+extern volatile uint8_t *DISK2_writePtr;
+extern volatile uint8_t DISK2_doBuffering;
+extern volatile uint8_t DISK2_byteData;
+extern volatile uint8_t DISK2_posBit;
+extern volatile uint8_t *DISK2_ptrByte;
+
+#define DISK2ASM_ENABLED ((VPORT2_IN&(PIN5_bm|PIN6_bm)) != (PIN5_bm|PIN6_bm))
+
+// a bit to RDR every 4 usec
+ISR(TCC4_OVF_vect)
+{
+	if (DISK2_prepare == 1) return;
+	if (!DISK2ASM_ENABLED) return;
+	HAL_rdr(DISK2_readPulse&1);
+	HAL_cycles(30);
+	if (!--DISK2_posBit) {
+		DISK2_posBit = 8;
+		DISK2_byteData = *DISK2_ptrByte++;
+		if (DISK2_ptrByte == buffer1+412) {
+			DISK2_prepare = 1;
+			DISK2_ptrByte = buffer1;
+		}
+	}
+	DISK2_readPulse = DISK2_byteData>>7;
+	DISK2_byteData <<= 1;
+}
+
+// nibbles written by the Apple II, from the first 0xD5 up to 349 of them
+// the nibbles begun before the interrupt are lost as the chip loses their bits,
+// when the Apple II stops writing before 349 nibbles the chip waits for another bit,
+// here it waits for WREQ going high
+ISR(PORTD_INT_vect)
+{
+	DISK2_magState = 0;
+	if (DISK2ASM_ENABLED) {
+		const uint8_t *nib;
+		const uint64_t *start;
+		uint64_t end;
+		uint16_t n = HAL_writeNibbles(&nib, &start, &end);
+		uint16_t i = 0, left = 349;
+		volatile uint8_t *p = DISK2_writePtr;
+		uint8_t storing = 0;
+
+		while ((i < n) && (start[i] < HAL_now)) i++;
+		for (; i < n; i++) {
+			uint64_t done = (i+1 < n) ? start[i+1] : end;
+
+			// WREQ is sampled every bit
+			while (HAL_now < done) {
+				if (VPORT2_IN&PIN2_bm) goto write_end;
+				HAL_cycles(128);
+			}
+			if (nib[i] == 0xD5) storing = 1;
+			if (storing) {
+				*p++ = nib[i];
+				if (!--left) goto write_end;
+			}
+		}
+		while (!(VPORT2_IN&PIN2_bm)) HAL_cycles(128);
+write_end:
+		DISK2_doBuffering = 1;
+	}
+	VPORT2_INTFLAGS = PIN2_bm;
+}
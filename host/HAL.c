@@ -0,0 +1,489 @@
+﻿/*
+ * HAL.c
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// hardware abstraction of the host build
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <ucontext.h>
+#include "avr/io.h"
+#include "HAL.h"
+#include "SDCARD.h"
+
+// ========== registers ==========
+
+PORT_t PORTA, PORTC, PORTD, PORTR;
+SPI_t SPIC;
+TWI_t TWIC;
+TC_t TCC4, TCC5, TCD5;
+PMIC_t PMIC;
+PORTCFG_t PORTCFG;
+OSC_t OSC;
+CLK_t CLK;
+DFLL_t DFLLRC32M;
+volatile uint8_t SREG, CCP, NVM_LOCKBITS, GPIO0;
+volatile uint8_t SPIC_CTRL, SPIC_STATUS, PORTC_DIRSET, PORTC_PIN6CTRL, TCC5_INTFLAGS;
+volatile uint8_t VPORT2_OUT, VPORT2_INTFLAGS;
+
+// the interrupts of the firmware
+void TCC4_OVF_vect(void);
+void TCC5_OVF_vect(void);
+void PORTA_INT_vect(void);
+void PORTD_INT_vect(void);
+
+// ========== time ==========
+
+volatile uint64_t HAL_now;
+static uint32_t HAL_ps;					// less than a nano second, in pico seconds
+static uint64_t HAL_limit;
+static jmp_buf HAL_exit;
+
+// inputs, the buttons are released, the drives are disabled and a card is inserted
+#define HAL_IN0 (PIN4_bm)
+#define HAL_IN1 (PIN2_bm)
+#define HAL_IN2 (PIN1_bm|PIN2_bm|PIN3_bm|PIN5_bm|PIN6_bm)
+static uint8_t HAL_pins[3] = {HAL_IN0, HAL_IN1, HAL_IN2};
+
+// interrupts
+static uint8_t HAL_inIsr;
+static uint8_t HAL_pendC4, HAL_pendC5, HAL_pendA, HAL_pendD;
+static uint64_t HAL_perC4, HAL_perC5, HAL_nextC4, HAL_nextC5;
+static uint32_t HAL_wrapD5;
+
+// the task beside the firmware
+static ucontext_t HAL_fwCtx, HAL_taskCtx;
+static uint8_t HAL_stack[1UL<<18];
+static void (*HAL_task)(void);
+static uint8_t HAL_taskOn;
+static uint64_t HAL_taskWake;
+
+// the period of a timer in nano seconds, 0 if stopped
+static uint64_t HAL_period(TC_t *tc)
+{
+	static const uint16_t div[8] = {0, 1, 2, 4, 8, 64, 256, 1024};
+	uint8_t cs = tc->CTRLA&7;
+
+	if (!cs) return 0;
+	return HAL_NS((uint64_t)(tc->PER+1)*div[cs]);
+}
+
+// overflow of a timer since the last call
+static uint8_t HAL_overflow(TC_t *tc, uint64_t *per, uint64_t *next)
+{
+	uint64_t p = HAL_period(tc);
+
+	if (p != *per) {
+		*per = p;
+		*next = HAL_now+p;
+	}
+	if (!p || (HAL_now < *next)) return 0;
+	*next += ((HAL_now-*next)/p+1)*p;
+	return 1;
+}
+
+static void HAL_timers(void)
+{
+	if (HAL_overflow(&TCC4, &HAL_perC4, &HAL_nextC4)) HAL_pendC4 = 1;
+	if (HAL_overflow(&TCC5, &HAL_perC5, &HAL_nextC5)) HAL_pendC5 = 1;
+	// TCD5 runs free at clk/256
+	if (TCD5.CTRLA&7) {
+		uint64_t t = HAL_now/HAL_NS(256);
+
+		TCD5.CNT = t&0xffff;
+		if ((uint32_t)(t>>16) != HAL_wrapD5) {
+			HAL_wrapD5 = t>>16;
+			TCD5.INTFLAGS |= TC5_OVFIF_bm;
+		}
+	}
+}
+
+static void HAL_dispatch(void)
+{
+	while (!HAL_inIsr && (SREG&CPU_I_bm) && (PMIC.CTRL&PMIC_LOLVLEN_bm)) {
+		void (*v)(void);
+
+		if (HAL_pendC4 && (TCC4.INTCTRLA&3)) { HAL_pendC4 = 0; v = TCC4_OVF_vect; }
+		else if (HAL_pendC5 && (TCC5.INTCTRLA&3)) { HAL_pendC5 = 0; v = TCC5_OVF_vect; }
+		else if (HAL_pendA && (PORTA.INTCTRL&3)) { HAL_pendA = 0; v = PORTA_INT_vect; }
+		else if (HAL_pendD && (PORTD.INTCTRL&3)) { HAL_pendD = 0; v = PORTD_INT_vect; }
+		else break;
+		HAL_inIsr = 1;
+		HAL_cycles(10);			// entry and the pushes
+		v();
+		HAL_cycles(8);			// the pops and reti
+		HAL_inIsr = 0;
+		HAL_timers();
+	}
+}
+
+static void HAL_poll(void)
+{
+	// flags cleared by writing 1 since the last call
+	if (PORTA.INTFLAGS) { HAL_pendA = 0; PORTA.INTFLAGS = 0; }
+	if (VPORT2_INTFLAGS&PIN2_bm) { HAL_pendD = 0; VPORT2_INTFLAGS = 0; }
+	if (HAL_now >= HAL_limit) longjmp(HAL_exit, 2);
+	while (HAL_taskOn && (HAL_taskWake <= HAL_now)) swapcontext(&HAL_fwCtx, &HAL_taskCtx);
+	if (!HAL_taskOn) longjmp(HAL_exit, 1);
+	HAL_timers();
+	HAL_dispatch();
+}
+
+// go on to the time, stopping at each event
+static void HAL_advance(uint64_t ns)
+{
+	uint64_t end = HAL_now+ns;
+
+	while (1) {
+		uint64_t t = end;
+
+		if (HAL_taskOn && (HAL_taskWake < t)) t = HAL_taskWake;
+		if (HAL_perC4 && (HAL_nextC4 < t)) t = HAL_nextC4;
+		if (HAL_perC5 && (HAL_nextC5 < t)) t = HAL_nextC5;
+		if (HAL_limit < t) t = HAL_limit;
+		if (t > HAL_now) HAL_now = t;
+		HAL_poll();
+		if (HAL_now >= end) break;
+	}
+}
+
+void HAL_cycles(uint32_t n)
+{
+	uint64_t ps = (uint64_t)n*(1000000000000ULL/HAL_F_CPU)+HAL_ps;
+
+	HAL_ps = ps%1000;
+	HAL_advance(ps/1000);
+}
+
+void HAL_wait(uint64_t ns)
+{
+	HAL_advance(ns);
+}
+
+// ========== pins ==========
+
+// the read and a branch on it
+uint8_t HAL_in(uint8_t port)
+{
+	HAL_cycles(3);
+	return HAL_pins[port];
+}
+
+uint8_t HAL_peekIn(uint8_t port)
+{
+	return HAL_pins[port];
+}
+
+void HAL_setIn(uint8_t port, uint8_t mask, uint8_t val)
+{
+	uint8_t old = HAL_pins[port];
+	uint8_t now = (old&~mask)|(val&mask);
+
+	HAL_pins[port] = now;
+	// phases on both edges, WREQ on the falling edge
+	if ((port == 0) && ((old^now)&PORTA.INTMASK)) HAL_pendA = 1;
+	if ((port == 2) && (old&~now&PIN2_bm&PORTD.INTMASK)) HAL_pendD = 1;
+	// the card is powered off when ejected
+	if ((port == 0) && (~old&now&PIN5_bm)) SDCARD_reset();
+}
+
+// the written mask is taken on the next call, the chip select is PORTC PIN4
+static volatile uint8_t HAL_csMask;
+static uint8_t HAL_csHigh = 1, HAL_csSet;
+
+static void HAL_csTake(void)
+{
+	if (HAL_csMask&PIN4_bm) {
+		HAL_csHigh = HAL_csSet;
+		SDCARD_cs(HAL_csHigh);
+	}
+	HAL_csMask = 0;
+}
+
+volatile uint8_t *HAL_cs(uint8_t high)
+{
+	HAL_csTake();
+	HAL_csSet = high;
+	HAL_cycles(1);
+	return &HAL_csMask;
+}
+
+// ========== SPI ==========
+
+static uint8_t HAL_spiRx, HAL_spiOn;
+static uint64_t HAL_spiEnd;
+
+void HAL_spiSend(uint8_t c)
+{
+	static const uint8_t div[4] = {4, 16, 64, 128};
+	uint32_t bit = div[SPIC_CTRL&3]>>((SPIC_CTRL&SPI_CLK2X_bm)?1:0);
+
+	HAL_csTake();
+	HAL_cycles(2);
+	HAL_spiRx = (HAL_csHigh || (HAL_pins[0]&PIN5_bm)) ? 0xff : SDCARD_xfer(c);
+	HAL_spiOn = 1;
+	HAL_spiEnd = HAL_now+HAL_NS(bit*8);
+}
+
+// the flag is set when the byte is shifted, a byte not sent never completes
+uint8_t HAL_spiDone(void)
+{
+	HAL_cycles(4);
+	return HAL_spiOn && (HAL_now >= HAL_spiEnd);
+}
+
+uint8_t HAL_spiRecv(void)
+{
+	HAL_cycles(2);
+	HAL_spiOn = 0;
+	return HAL_spiRx;
+}
+
+// ========== interrupts ==========
+
+void HAL_cli(void)
+{
+	SREG &= ~CPU_I_bm;
+}
+
+void HAL_sei(void)
+{
+	SREG |= CPU_I_bm;
+	HAL_cycles(1);
+}
+
+// ========== EEPROM ==========
+
+// a byte is erased and written in 8ms, the next access waits for it
+#define HAL_EEPROM_SIZE 1024
+#define HAL_EEPROM_WRITE 8000000ULL
+static uint8_t HAL_eeprom[HAL_EEPROM_SIZE];
+static uint8_t HAL_eepromOn;
+static uint64_t HAL_eepromBusy;
+
+static void HAL_eepromErased(void)
+{
+	if (!HAL_eepromOn) {
+		memset(HAL_eeprom, 0xff, sizeof(HAL_eeprom));
+		HAL_eepromOn = 1;
+	}
+}
+
+static void HAL_eepromWait(void)
+{
+	HAL_eepromErased();
+	if (HAL_eepromBusy > HAL_now) HAL_wait(HAL_eepromBusy-HAL_now);
+}
+
+uint8_t HAL_eepromRead(uint16_t adr)
+{
+	HAL_eepromWait();
+	HAL_cycles(4);
+	return HAL_eeprom[adr%HAL_EEPROM_SIZE];
+}
+
+void HAL_eepromWrite(uint16_t adr, uint8_t d)
+{
+	HAL_eepromWait();
+	HAL_eeprom[adr%HAL_EEPROM_SIZE] = d;
+	HAL_eepromBusy = HAL_now+HAL_EEPROM_WRITE;
+}
+
+void HAL_eepromUpdate(uint16_t adr, uint8_t d)
+{
+	if (HAL_eepromRead(adr) != d) HAL_eepromWrite(adr, d);
+}
+
+uint8_t HAL_eepromLoad(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	uint8_t ok;
+
+	HAL_eepromErased();
+	if (!f) return 0;
+	ok = (fread(HAL_eeprom, 1, sizeof(HAL_eeprom), f) == sizeof(HAL_eeprom));
+	fclose(f);
+	return ok;
+}
+
+uint8_t HAL_eepromSave(const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	uint8_t ok;
+
+	HAL_eepromErased();
+	if (!f) return 0;
+	ok = (fwrite(HAL_eeprom, 1, sizeof(HAL_eeprom), f) == sizeof(HAL_eeprom));
+	fclose(f);
+	return ok;
+}
+
+// ========== RDR ==========
+
+#define HAL_RDR_SIZE (1UL<<16)
+static uint8_t HAL_rdrPulse[HAL_RDR_SIZE];
+static uint64_t HAL_rdrTime[HAL_RDR_SIZE];
+static uint32_t HAL_rdrHead, HAL_rdrTail;
+static uint8_t HAL_rdrOn;
+
+void HAL_rdr(uint8_t pulse)
+{
+	if (!HAL_rdrOn) return;
+	HAL_rdrPulse[HAL_rdrHead%HAL_RDR_SIZE] = pulse;
+	HAL_rdrTime[HAL_rdrHead%HAL_RDR_SIZE] = HAL_now;
+	HAL_rdrHead++;
+	// the oldest bits are lost if not taken
+	if (HAL_rdrHead-HAL_rdrTail > HAL_RDR_SIZE) HAL_rdrTail = HAL_rdrHead-HAL_RDR_SIZE;
+}
+
+void HAL_rdrListen(uint8_t on)
+{
+	HAL_rdrOn = on;
+	HAL_rdrTail = HAL_rdrHead;
+}
+
+uint32_t HAL_rdrTake(uint8_t *pulses, uint64_t *times, uint32_t max)
+{
+	uint32_t n = 0;
+
+	while ((HAL_rdrTail != HAL_rdrHead) && (n < max)) {
+		pulses[n] = HAL_rdrPulse[HAL_rdrTail%HAL_RDR_SIZE];
+		if (times) times[n] = HAL_rdrTime[HAL_rdrTail%HAL_RDR_SIZE];
+		HAL_rdrTail++;
+		n++;
+	}
+	return n;
+}
+
+// ========== writing of the Apple II ==========
+
+#define HAL_WRITE_MAX 1024
+static uint8_t HAL_wNib[HAL_WRITE_MAX];
+static uint64_t HAL_wStart[HAL_WRITE_MAX], HAL_wEnd;
+static uint16_t HAL_wNum;
+
+// a bit cell is 4 usec
+void HAL_writeStart(const uint8_t *nib, const uint8_t *bits, uint16_t n)
+{
+	uint64_t t = HAL_now;
+	uint16_t i;
+
+	if (n > HAL_WRITE_MAX) n = HAL_WRITE_MAX;
+	for (i=0; i<n; i++) {
+		HAL_wNib[i] = nib[i];
+		HAL_wStart[i] = t;
+		t += (uint64_t)(bits ? bits[i] : 8)*4000;
+	}
+	HAL_wNum = n;
+	HAL_wEnd = t;
+}
+
+uint16_t HAL_writeNibbles(const uint8_t **nib, const uint64_t **start, uint64_t *end)
+{
+	*nib = HAL_wNib;
+	*start = HAL_wStart;
+	*end = HAL_wEnd;
+	return HAL_wNum;
+}
+
+// ========== packets of SmartPort ==========
+
+#define HAL_PACKET_MAX 1024
+static uint8_t HAL_hPacket[HAL_PACKET_MAX], HAL_dPacket[HAL_PACKET_MAX];
+static uint16_t HAL_hLen, HAL_dLen;
+static uint64_t HAL_hStart;
+
+void HAL_hostSend(const uint8_t *p, uint16_t len)
+{
+	if (len > HAL_PACKET_MAX) len = HAL_PACKET_MAX;
+	memcpy(HAL_hPacket, p, len);
+	HAL_hLen = len;
+	HAL_hStart = HAL_now;
+}
+
+uint16_t HAL_hostPacket(const uint8_t **p, uint64_t *start)
+{
+	uint16_t len = HAL_hLen;
+
+	*p = HAL_hPacket;
+	*start = HAL_hStart;
+	HAL_hLen = 0;
+	return len;
+}
+
+void HAL_devicePacket(const uint8_t *p, uint16_t len)
+{
+	if (len > HAL_PACKET_MAX) len = HAL_PACKET_MAX;
+	memcpy(HAL_dPacket, p, len);
+	HAL_dLen = len;
+}
+
+uint16_t HAL_hostTake(uint8_t *p, uint16_t max)
+{
+	uint16_t len = HAL_dLen;
+
+	if (len > max) len = max;
+	memcpy(p, HAL_dPacket, len);
+	HAL_dLen = 0;
+	return len;
+}
+
+// ========== the task and the firmware ==========
+
+void HAL_sleep(uint64_t ns)
+{
+	HAL_taskWake = HAL_now+(ns ? ns : 1);
+	swapcontext(&HAL_taskCtx, &HAL_fwCtx);
+}
+
+static void HAL_taskMain(void)
+{
+	HAL_task();
+	HAL_taskOn = 0;
+}
+
+// the clock is set up by SYSTEM.c on the chip
+void system_clocks_init(void)
+{
+}
+
+uint8_t HAL_run(void (*task)(void), uint64_t limit)
+{
+	int r;
+
+	HAL_task = task;
+	HAL_taskOn = 1;
+	HAL_taskWake = HAL_now;
+	HAL_limit = HAL_now+limit;
+	getcontext(&HAL_taskCtx);
+	HAL_taskCtx.uc_stack.ss_sp = HAL_stack;
+	HAL_taskCtx.uc_stack.ss_size = sizeof(HAL_stack);
+	HAL_taskCtx.uc_link = &HAL_fwCtx;
+	makecontext(&HAL_taskCtx, HAL_taskMain, 0);
+	r = setjmp(HAL_exit);
+	if (!r) {
+		UNISDISK_main();
+		r = 1;
+	}
+	HAL_inIsr = 0;
+	return (r == 2);
+}
@@ -0,0 +1,119 @@
+﻿/*
+ * HAL.h
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// hardware abstraction of the host build
+// the firmware runs on the host against models of the card and the Apple II in simulated time,
+// the registers with side effects are reached through the functions below (see avr/io.h and SD.h)
+// time is spent by the pins, the SPI, the delays and the interrupts, plain computing is free
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#include <stdint.h>
+
+#define HAL_F_CPU 32000000UL
+#define HAL_NS(cycles) ((uint64_t)(cycles)*1000000000ULL/HAL_F_CPU)
+
+// ========== for the firmware ==========
+
+// simulated time in nano seconds
+extern volatile uint64_t HAL_now;
+
+// spend CPU cycles
+void HAL_cycles(uint32_t n);
+
+// spend time, interrupts run meanwhile
+void HAL_wait(uint64_t ns);
+
+// sample a virtual port, 0 : PORTA, 1 : PORTC, 2 : PORTD
+uint8_t HAL_in(uint8_t port);
+
+// chip select of the card, the returned byte takes the written mask
+volatile uint8_t *HAL_cs(uint8_t high);
+
+// SPI data register and interrupt flag
+void HAL_spiSend(uint8_t c);
+uint8_t HAL_spiRecv(void);
+uint8_t HAL_spiDone(void);
+
+// global interrupt flag, SREG bit 7
+void HAL_cli(void);
+void HAL_sei(void);
+
+// EEPROM
+uint8_t HAL_eepromRead(uint16_t adr);
+void HAL_eepromWrite(uint16_t adr, uint8_t d);
+void HAL_eepromUpdate(uint16_t adr, uint8_t d);
+
+// output of the bit stream on RDR, by the model of DISK2ASM.S
+void HAL_rdr(uint8_t pulse);
+
+// the sector being written by the Apple II, for the model of DISK2ASM.S
+// nibbles, the time each one starts and the time the last one ends
+uint16_t HAL_writeNibbles(const uint8_t **nib, const uint64_t **start, uint64_t *end);
+
+// the packet being sent by the Apple II, for the model of SMARTASM.s
+// bytes as sent, the time the first one starts, 0 if none
+uint16_t HAL_hostPacket(const uint8_t **p, uint64_t *start);
+// the packet sent to the Apple II
+void HAL_devicePacket(const uint8_t *p, uint16_t len);
+
+// ========== for the models outside ==========
+
+// drive input pins
+void HAL_setIn(uint8_t port, uint8_t mask, uint8_t val);
+// pins as they are, without spending time
+uint8_t HAL_peekIn(uint8_t port);
+
+// a task beside the firmware : the Apple II or the user
+// it runs until it sleeps, the firmware runs meanwhile
+void HAL_sleep(uint64_t ns);
+
+// boot the firmware with the task beside it, once in a process since the firmware keeps its RAM
+// return 0 when the task returns, 1 on the time limit
+uint8_t HAL_run(void (*task)(void), uint64_t limit);
+
+// set the EEPROM from a file or save it, 0 if not
+uint8_t HAL_eepromLoad(const char *path);
+uint8_t HAL_eepromSave(const char *path);
+
+// bits on RDR since the last call, with the time of each
+// bit 0 of each byte of pulses is the pulse
+uint32_t HAL_rdrTake(uint8_t *pulses, uint64_t *times, uint32_t max);
+// start or stop keeping the bits
+void HAL_rdrListen(uint8_t on);
+
+// the Apple II writes nibbles from now
+void HAL_writeStart(const uint8_t *nib, const uint8_t *bits, uint16_t n);
+
+// the packet of the Apple II, from now
+void HAL_hostSend(const uint8_t *p, uint16_t len);
+// take the packet sent by the firmware, return the length or 0
+uint16_t HAL_hostTake(uint8_t *p, uint16_t max);
+
+// the display, 16 characters and a 0
+void HAL_lcd(char *s);
+
+// the firmware
+int UNISDISK_main(void);
+
+#endif /* HAL_H_ */
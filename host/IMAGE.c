@@ -0,0 +1,485 @@
+﻿/*
+ * IMAGE.c
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// card images for the host build
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+#include "IMAGE.h"
+
+static uint8_t *IMAGE_mem;
+static uint32_t IMAGE_sectors;
+static uint8_t IMAGE_fs;
+static uint32_t IMAGE_part;				// the sector of the boot sector
+static uint32_t IMAGE_spc;
+static uint32_t IMAGE_fatLba, IMAGE_fatSz, IMAGE_numFats;
+static uint32_t IMAGE_rootLba, IMAGE_rootSecs;	// FAT16 root directory
+static uint32_t IMAGE_dataLba, IMAGE_clusters;
+static uint32_t IMAGE_rootClst, IMAGE_bitmapClst;
+static uint32_t IMAGE_next;				// the next cluster to allocate
+
+static void IMAGE_w16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v>>8; }
+static void IMAGE_w32(uint8_t *p, uint32_t v) { IMAGE_w16(p, v); IMAGE_w16(p+2, v>>16); }
+static void IMAGE_w64(uint8_t *p, uint64_t v) { IMAGE_w32(p, v); IMAGE_w32(p+4, v>>32); }
+static uint16_t IMAGE_r16(const uint8_t *p) { return p[0]|(p[1]<<8); }
+static uint32_t IMAGE_r32(const uint8_t *p) { return IMAGE_r16(p)|((uint32_t)IMAGE_r16(p+2)<<16); }
+
+uint8_t *IMAGE_sector(uint32_t lba)
+{
+	return IMAGE_mem+(size_t)lba*512;
+}
+
+static uint8_t *IMAGE_clst(uint32_t c)
+{
+	return IMAGE_sector(IMAGE_dataLba+(c-2)*IMAGE_spc);
+}
+
+// ========== FAT ==========
+
+static void IMAGE_setFat(uint32_t c, uint32_t v)
+{
+	uint32_t i;
+
+	for (i=0; i<IMAGE_numFats; i++) {
+		uint8_t *fat = IMAGE_sector(IMAGE_fatLba+i*IMAGE_fatSz);
+
+		if (IMAGE_fs == IMAGE_FAT16) IMAGE_w16(fat+c*2, v);
+		else IMAGE_w32(fat+c*4, v);
+	}
+	if (IMAGE_fs == IMAGE_EXFAT) {
+		uint8_t *bm = IMAGE_clst(IMAGE_bitmapClst);
+
+		bm[(c-2)/8] |= 1<<((c-2)%8);
+	}
+}
+
+static uint32_t IMAGE_getFat(uint32_t c)
+{
+	uint8_t *fat = IMAGE_sector(IMAGE_fatLba);
+
+	if (IMAGE_fs == IMAGE_FAT16) {
+		uint32_t v = IMAGE_r16(fat+c*2);
+		return (v >= 0xfff8) ? 0x0fffffff : v;
+	}
+	return IMAGE_r32(fat+c*4)&0x0fffffff;
+}
+
+#define IMAGE_EOC 0x0fffffff
+
+// clusters in a chain, return the first one or 0
+static uint32_t IMAGE_alloc(uint32_t n, uint32_t frag)
+{
+	uint32_t first = 0, prev = 0, run = 0, i;
+
+	for (i=0; i<n; i++) {
+		uint32_t c;
+
+		if (frag && (run == frag)) {
+			IMAGE_next++;
+			run = 0;
+		}
+		c = IMAGE_next++;
+		if (c-2 >= IMAGE_clusters) return 0;
+		run++;
+		memset(IMAGE_clst(c), 0, IMAGE_spc*512);
+		IMAGE_setFat(c, (IMAGE_fs == IMAGE_FAT16) ? 0xffff : IMAGE_EOC);
+		if (prev) IMAGE_setFat(prev, c);
+		else first = c;
+		prev = c;
+	}
+	return first;
+}
+
+// ========== format ==========
+
+static void IMAGE_fat(void)
+{
+	uint8_t *b = IMAGE_sector(IMAGE_part);
+	uint32_t tot = IMAGE_sectors-IMAGE_part, rsvd = (IMAGE_fs == IMAGE_FAT16) ? 4 : 32;
+	uint32_t rootEnt = (IMAGE_fs == IMAGE_FAT16) ? 1024 : 0;
+
+	IMAGE_spc = (IMAGE_fs == IMAGE_FAT16) ? 4 : 1;
+	IMAGE_numFats = 2;
+	IMAGE_rootSecs = rootEnt*32/512;
+	// big enough for all the clusters
+	IMAGE_fatSz = ((tot/IMAGE_spc+2)*((IMAGE_fs == IMAGE_FAT16) ? 2 : 4)+511)/512;
+	IMAGE_fatLba = IMAGE_part+rsvd;
+	IMAGE_rootLba = IMAGE_fatLba+IMAGE_numFats*IMAGE_fatSz;
+	IMAGE_dataLba = IMAGE_rootLba+IMAGE_rootSecs;
+	IMAGE_clusters = (IMAGE_sectors-IMAGE_dataLba)/IMAGE_spc;
+
+	memcpy(b, "\xeb\x3c\x90MSWIN4.1", 11);
+	IMAGE_w16(b+11, 512);
+	b[13] = IMAGE_spc;
+	IMAGE_w16(b+14, rsvd);
+	b[16] = IMAGE_numFats;
+	IMAGE_w16(b+17, rootEnt);
+	if (tot < 0x10000) IMAGE_w16(b+19, tot);
+	b[21] = 0xf8;
+	IMAGE_w16(b+24, 63);
+	IMAGE_w16(b+26, 255);
+	IMAGE_w32(b+28, IMAGE_part);
+	if (tot >= 0x10000) IMAGE_w32(b+32, tot);
+	if (IMAGE_fs == IMAGE_FAT16) {
+		IMAGE_w16(b+22, IMAGE_fatSz);
+		b[36] = 0x80;
+		b[38] = 0x29;
+		memcpy(b+43, "UNISDISK   FAT16   ", 19);
+	} else {
+		IMAGE_w32(b+36, IMAGE_fatSz);
+		IMAGE_w32(b+44, 2);
+		IMAGE_w16(b+48, 1);
+		IMAGE_w16(b+50, 6);
+		b[64] = 0x80;
+		b[66] = 0x29;
+		memcpy(b+71, "UNISDISK   FAT32   ", 19);
+	}
+	b[510] = 0x55;
+	b[511] = 0xaa;
+	if (IMAGE_fs == IMAGE_FAT16) {
+		IMAGE_setFat(0, 0xfff8);
+		IMAGE_setFat(1, 0xffff);
+		IMAGE_next = 2;
+	} else {
+		IMAGE_setFat(0, 0x0ffffff8);
+		IMAGE_setFat(1, IMAGE_EOC);
+		IMAGE_next = 2;
+		IMAGE_rootClst = IMAGE_alloc(1, 0);
+	}
+}
+
+static void IMAGE_exfat(void)
+{
+	uint8_t *b = IMAGE_sector(IMAGE_part);
+	uint32_t tot = IMAGE_sectors-IMAGE_part, heap, bitmapLen, i;
+	uint8_t *root, upcase[256];
+	uint32_t sum = 0, upClst;
+
+	IMAGE_spc = 8;
+	IMAGE_numFats = 1;
+	IMAGE_fatLba = IMAGE_part+32;
+	IMAGE_fatSz = ((tot/IMAGE_spc+2)*4+511)/512;
+	heap = (32+IMAGE_fatSz+IMAGE_spc-1)/IMAGE_spc*IMAGE_spc;
+	IMAGE_dataLba = IMAGE_part+heap;
+	IMAGE_clusters = (tot-heap)/IMAGE_spc;
+
+	memcpy(b, "\xeb\x76\x90""EXFAT   ", 11);
+	IMAGE_w64(b+0x40, IMAGE_part);
+	IMAGE_w64(b+0x48, tot);
+	IMAGE_w32(b+0x50, 32);
+	IMAGE_w32(b+0x54, IMAGE_fatSz);
+	IMAGE_w32(b+0x58, heap);
+	IMAGE_w32(b+0x5c, IMAGE_clusters);
+	IMAGE_w32(b+0x64, 0x12345678);
+	IMAGE_w16(b+0x68, 0x0100);
+	b[0x6c] = 9;
+	b[0x6d] = 3;
+	b[0x6e] = 1;
+	b[0x6f] = 0x80;
+	b[510] = 0x55;
+	b[511] = 0xaa;
+
+	IMAGE_w32(IMAGE_sector(IMAGE_fatLba), 0xfffffff8);
+	IMAGE_w32(IMAGE_sector(IMAGE_fatLba)+4, 0xffffffff);
+	IMAGE_next = 2;
+	// the bitmap is cluster 2, it marks itself once it is there
+	bitmapLen = (IMAGE_clusters+7)/8;
+	IMAGE_bitmapClst = 2;
+	IMAGE_alloc((bitmapLen+IMAGE_spc*512-1)/(IMAGE_spc*512), 0);
+	// up-case table of ASCII
+	for (i=0; i<128; i++) IMAGE_w16(upcase+i*2, toupper(i));
+	for (i=0; i<256; i++) sum = ((sum&1)?0x80000000:0)+(sum>>1)+upcase[i];
+	upClst = IMAGE_alloc(1, 0);
+	memcpy(IMAGE_clst(upClst), upcase, 256);
+	IMAGE_rootClst = IMAGE_alloc(1, 0);
+	IMAGE_w32(b+0x60, IMAGE_rootClst);
+	root = IMAGE_clst(IMAGE_rootClst);
+	root[0] = 0x83;							// no label
+	root[32] = 0x81;
+	IMAGE_w32(root+32+20, IMAGE_bitmapClst);
+	IMAGE_w64(root+32+24, bitmapLen);
+	root[64] = 0x82;
+	IMAGE_w32(root+64+4, sum);
+	IMAGE_w32(root+64+20, upClst);
+	IMAGE_w64(root+64+24, 256);
+}
+
+void IMAGE_new(uint8_t fs, uint32_t mbytes, uint8_t mbr)
+{
+	free(IMAGE_mem);
+	IMAGE_sectors = mbytes*2048;
+	IMAGE_mem = calloc(IMAGE_sectors, 512);
+	IMAGE_fs = fs;
+	IMAGE_part = mbr ? 2048 : 0;
+	if (mbr) {
+		uint8_t *m = IMAGE_sector(0);
+
+		m[0x1c2] = (fs == IMAGE_FAT16) ? 0x06 : (fs == IMAGE_FAT32) ? 0x0c : 0x07;
+		IMAGE_w32(m+0x1c6, IMAGE_part);
+		IMAGE_w32(m+0x1ca, IMAGE_sectors-IMAGE_part);
+		m[510] = 0x55;
+		m[511] = 0xaa;
+	}
+	if (fs == IMAGE_EXFAT) IMAGE_exfat();
+	else IMAGE_fat();
+}
+
+// ========== directories ==========
+
+// the sectors of a directory one by one, 0 at the end
+// extended by a cluster if grow
+static uint32_t IMAGE_dirSector(uint32_t dir, uint32_t i, uint8_t grow)
+{
+	uint32_t c;
+
+	if (!dir) {
+		if (IMAGE_fs == IMAGE_FAT16) return (i < IMAGE_rootSecs) ? IMAGE_rootLba+i : 0;
+		dir = IMAGE_rootClst;
+	}
+	c = dir;
+	while (i >= IMAGE_spc) {
+		uint32_t n = IMAGE_getFat(c);
+
+		if (n >= 0x0ffffff7) {
+			if (!grow) return 0;
+			n = IMAGE_alloc(1, 0);
+			if (!n) return 0;
+			IMAGE_setFat(c, n);
+		}
+		c = n;
+		i -= IMAGE_spc;
+	}
+	return IMAGE_dataLba+(c-2)*IMAGE_spc+i;
+}
+
+// n free entries in a sector
+static uint8_t *IMAGE_dirFree(uint32_t dir, uint8_t n)
+{
+	uint32_t i, s;
+
+	for (i=0; (s = IMAGE_dirSector(dir, i, 1)); i++) {
+		uint8_t *p = IMAGE_sector(s);
+		uint8_t j, run = 0;
+
+		for (j=0; j<16; j++) {
+			uint8_t t = p[j*32];
+
+			if ((IMAGE_fs == IMAGE_EXFAT) ? (t&0x80) : (t && (t != 0xe5))) run = 0;
+			else if (++run == n) return p+(j+1-n)*32;
+		}
+	}
+	return 0;
+}
+
+// 8.3 form
+static void IMAGE_83(const char *name, char *e)
+{
+	const char *dot = strrchr(name, '.');
+	uint8_t i;
+
+	memset(e, ' ', 11);
+	for (i=0; (i<8) && name[i] && (name+i != dot); i++) e[i] = toupper((uint8_t)name[i]);
+	if (dot) for (i=0; (i<3) && dot[i+1]; i++) e[8+i] = toupper((uint8_t)dot[i+1]);
+}
+
+static uint16_t IMAGE_exSum16(uint16_t sum, uint8_t d)
+{
+	return ((sum&1)?0x8000:0)+(sum>>1)+d;
+}
+
+static void IMAGE_exEntrySum(uint8_t *set, uint8_t n)
+{
+	uint16_t sum = 0;
+	uint16_t i;
+
+	for (i=0; i<n*32; i++) if ((i != 2) && (i != 3)) sum = IMAGE_exSum16(sum, set[i]);
+	IMAGE_w16(set+2, sum);
+}
+
+// a directory entry, return 0 if no room
+static uint8_t IMAGE_entry(uint32_t dir, const char *name, uint8_t attr, uint32_t clst, uint32_t len, uint8_t noChain)
+{
+	if (IMAGE_fs != IMAGE_EXFAT) {
+		uint8_t *p = IMAGE_dirFree(dir, 1);
+
+		if (!p) return 0;
+		memset(p, 0, 32);
+		IMAGE_83(name, (char *)p);
+		p[11] = attr;
+		IMAGE_w16(p+20, clst>>16);
+		IMAGE_w16(p+26, clst);
+		IMAGE_w32(p+28, len);
+		IMAGE_w16(p+24, 0x0021);			// 1980/1/1
+	} else {
+		uint8_t nameLen = strlen(name), names = (nameLen+14)/15, i;
+		uint8_t *p = IMAGE_dirFree(dir, 2+names);
+		uint16_t hash = 0;
+
+		if (!p) return 0;
+		memset(p, 0, (2+names)*32);
+		p[0] = 0x85;
+		p[1] = 1+names;
+		IMAGE_w16(p+4, attr);
+		for (i=8; i<20; i+=4) IMAGE_w32(p+i, 0x00210000);
+		p[32] = 0xc0;
+		p[33] = 0x01|(noChain ? 0x02 : 0);
+		p[35] = nameLen;
+		IMAGE_w64(p+40, len);
+		IMAGE_w32(p+52, clst);
+		IMAGE_w64(p+56, len);
+		for (i=0; i<nameLen; i++) {
+			uint8_t *q = p+64+(i/15)*32;
+
+			q[0] = 0xc1;
+			IMAGE_w16(q+2+(i%15)*2, (uint8_t)name[i]);
+			hash = IMAGE_exSum16(hash, toupper((uint8_t)name[i]));
+			hash = IMAGE_exSum16(hash, 0);
+		}
+		IMAGE_w16(p+36, hash);
+		IMAGE_exEntrySum(p, 2+names);
+	}
+	return 1;
+}
+
+uint32_t IMAGE_mkdir(uint32_t dir, const char *name)
+{
+	uint32_t c = IMAGE_alloc(1, 0);
+
+	if (!c) return 0;
+	if (!IMAGE_entry(dir, name, 0x10, c, (IMAGE_fs == IMAGE_EXFAT) ? IMAGE_spc*512 : 0, 0)) return 0;
+	if (IMAGE_fs != IMAGE_EXFAT) {
+		uint8_t *p = IMAGE_clst(c);
+
+		memcpy(p, ".          ", 11);
+		p[11] = 0x10;
+		IMAGE_w16(p+20, c>>16);
+		IMAGE_w16(p+26, c);
+		memcpy(p+32, "..         ", 11);
+		p[32+11] = 0x10;
+		IMAGE_w16(p+32+20, dir>>16);
+		IMAGE_w16(p+32+26, dir);
+	}
+	return c;
+}
+
+uint32_t IMAGE_addFile(uint32_t dir, const char *name, const uint8_t *data, uint32_t len, uint32_t frag)
+{
+	uint32_t csize = IMAGE_spc*512, n = (len+csize-1)/csize, c, first, done = 0;
+
+	if (!n) n = 1;
+	first = IMAGE_alloc(n, frag);
+	if (!first) return 0;
+	for (c=first; done<len; c=IMAGE_getFat(c)) {
+		uint32_t k = (len-done < csize) ? len-done : csize;
+
+		memcpy(IMAGE_clst(c), data+done, k);
+		done += k;
+	}
+	// contiguous files of exFAT keep their FAT chain too
+	if (!IMAGE_entry(dir, name, 0x20, first, len, !frag)) return 0;
+	return first;
+}
+
+// find an entry, the first cluster and the length
+static uint8_t IMAGE_find(uint32_t dir, const char *name, uint32_t *clst, uint32_t *len, uint8_t *noChain)
+{
+	uint32_t i, s;
+	char e[11];
+
+	IMAGE_83(name, e);
+	for (i=0; (s = IMAGE_dirSector(dir, i, 0)); i++) {
+		uint8_t *p = IMAGE_sector(s);
+		uint8_t j;
+
+		for (j=0; j<16; j++) {
+			uint8_t *q = p+j*32;
+
+			if (!q[0]) return 0;
+			if (IMAGE_fs != IMAGE_EXFAT) {
+				if ((q[0] != 0xe5) && !(q[11]&0x08) && !memcmp(q, e, 11)) {
+					*clst = IMAGE_r16(q+26)|((uint32_t)IMAGE_r16(q+20)<<16);
+					*len = IMAGE_r32(q+28);
+					*noChain = 0;
+					return 1;
+				}
+			} else if ((q[0] == 0x85) && (j+2 < 16)) {
+				uint8_t *st = q+32, k, nameLen = st[3];
+				char buf[256];
+
+				for (k=0; k<nameLen; k++) buf[k] = q[64+(k/15)*32+2+(k%15)*2];
+				buf[k] = 0;
+				if (!strcasecmp(buf, name)) {
+					*clst = IMAGE_r32(st+20);
+					*len = IMAGE_r32(st+24);
+					*noChain = (st[1]>>1)&1;
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+int32_t IMAGE_readFile(uint32_t dir, const char *name, uint8_t *data, uint32_t max)
+{
+	uint32_t c, len, csize = IMAGE_spc*512, done = 0;
+	uint8_t noChain;
+
+	if (!IMAGE_find(dir, name, &c, &len, &noChain)) return -1;
+	if (len > max) len = max;
+	while (done < len) {
+		uint32_t k = (len-done < csize) ? len-done : csize;
+
+		memcpy(data+done, IMAGE_clst(c), k);
+		done += k;
+		c = noChain ? c+1 : IMAGE_getFat(c);
+	}
+	return len;
+}
+
+// ========== files ==========
+
+uint8_t IMAGE_save(const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	uint8_t ok;
+
+	if (!f) return 0;
+	ok = (fwrite(IMAGE_mem, 512, IMAGE_sectors, f) == IMAGE_sectors);
+	fclose(f);
+	return ok;
+}
+
+// only to read files back, the image has to be made by IMAGE_new in the process
+uint8_t IMAGE_load(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	uint8_t ok;
+
+	if (!f) return 0;
+	ok = (fread(IMAGE_mem, 512, IMAGE_sectors, f) == IMAGE_sectors);
+	fclose(f);
+	return ok;
+}
@@ -0,0 +1,54 @@
+﻿/*
+ * IMAGE.h
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// card images for the host build, formatted in memory
+// FAT16, FAT32 or exFAT, as a super floppy or in the first partition
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <stdint.h>
+
+enum {IMAGE_FAT16, IMAGE_FAT32, IMAGE_EXFAT};
+
+// a formatted image of mbytes, with a MBR if mbr
+void IMAGE_new(uint8_t fs, uint32_t mbytes, uint8_t mbr);
+
+// a directory, 0 is the root, return the first cluster or 0
+uint32_t IMAGE_mkdir(uint32_t dir, const char *name);
+
+// a file, names are 8.3 on FAT and as they are on exFAT
+// if frag, clusters are allocated frag at a time with a free one between
+// return the first cluster or 0
+uint32_t IMAGE_addFile(uint32_t dir, const char *name, const uint8_t *data, uint32_t len, uint32_t frag);
+
+// read a file back, return the length or -1
+int32_t IMAGE_readFile(uint32_t dir, const char *name, uint8_t *data, uint32_t max);
+
+// a sector of the image, the image is updated by writing it
+uint8_t *IMAGE_sector(uint32_t lba);
+
+// the image to or from a file, 0 if not
+uint8_t IMAGE_save(const char *path);
+uint8_t IMAGE_load(const char *path);
+
+#endif /* IMAGE_H_ */
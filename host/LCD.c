@@ -0,0 +1,122 @@
+﻿/*
+ * LCD.c
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// the display of the host build, 8 x 2 characters kept in memory
+
+#include <string.h>
+#include "avr/io.h"
+#include "HAL.h"
+#include "../LCD.h"
+
+#define LCD_COLS 8
+#define LCD_ROWS 2
+
+static char LCD_fb[LCD_COLS*LCD_ROWS];
+static uint8_t LCD_col, LCD_row;
+
+void HAL_lcd(char *s)
+{
+	memcpy(s, LCD_fb, LCD_COLS*LCD_ROWS);
+	s[LCD_COLS*LCD_ROWS] = 0;
+}
+
+void LCD_init(void)
+{
+	memset(LCD_fb, ' ', sizeof(LCD_fb));
+	LCD_col = LCD_row = 0;
+}
+
+void LCD_flush(void)
+{
+}
+
+void LCD_locate(uint8_t x, uint8_t y)
+{
+	LCD_col = x;
+	LCD_row = y;
+}
+
+void LCD_putchar(char c)
+{
+	if ((LCD_col < LCD_COLS) && (LCD_row < LCD_ROWS)) LCD_fb[LCD_row*LCD_COLS+LCD_col] = c;
+	LCD_col++;
+}
+
+void LCD_print(char str[], uint8_t len)
+{
+	uint8_t i;
+
+	for (i=0; i<len; i++) LCD_putchar(str[i]);
+}
+
+void LCD_printhex(uint32_t a, int8_t digits)
+{
+	uint8_t i;
+	char str[8];
+
+	for (i=0; i<digits; i++) {
+		uint8_t b = (a & 0xf);
+		str[i] = (b<10)?b+'0':b+'A'-10;
+		a>>=4;
+	}
+	for (i=0; i<digits; i++) LCD_putchar(str[digits-i-1]);
+}
+
+void LCD_printdec(uint32_t a, int8_t digits)
+{
+	uint8_t i;
+	char str[8];
+
+	for (i=0; i<digits; i++) {
+		str[i] = (a%10)+'0';
+		a/=10;
+	}
+	for (i=0; i<digits; i++) LCD_putchar(str[digits-i-1]);
+}
+
+void LCD_printAll(char *str)
+{
+	uint8_t len = strlen(str);
+	LCD_locate(0,0);
+	LCD_print(str, (len<8)?len:8);
+	if (len<8) LCD_print("       ",8-len);
+	LCD_locate(0,1);
+	if (len>8) LCD_print(str+8,len-8);
+	if (len<16) LCD_print("        ",16-len);
+}
+
+void LCD_cls()
+{
+	LCD_printAll("                ");
+}
+
+void LCD_marker(char *str)
+{
+	LCD_printAll(str);
+}
+
+// the chip stops here
+void LCD_markerL(char *str)
+{
+	LCD_printAll(str);
+	while (1) HAL_cycles(1000);
+}
@@ -0,0 +1,269 @@
+﻿/*
+ * REPLAY.c
+ *
+ * Created: 2026/10/19 07:39:51
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// the Apple II replaying a trace of disk accesses, in simulated time on each profile of the card
+// each trace and profile runs the firmware in a process of its own
+//
+// a trace is lines of
+//   disk2 | smartport		the mode, on the first line
+//   r track sector[-sector]	read DOS 3.3 sectors, in the order given
+//   w track sector[-sector]	write them
+//   rb block[-block]			read SmartPort blocks
+//   wb block[-block]			write them
+//   idle ms					the Apple II does something else
+// and comments from #
+// built with PROF, the write-backs of Disk II and the blocks read ahead of SmartPort are counted too
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "HAL.h"
+#include "SDCARD.h"
+#include "IMAGE.h"
+#include "RIG.h"
+#include "APPLE.h"
+#include "../SMART.h"
+
+#define REPLAY_OPS 4096
+#define REPLAY_DSK_BLOCKS 280
+#define REPLAY_PO_BLOCKS 1600
+// a revolution of 16 sectors of 412 bytes
+#define REPLAY_REV (16*412*8*4000ULL)
+
+enum {REPLAY_R, REPLAY_W, REPLAY_RB, REPLAY_WB, REPLAY_IDLE};
+struct REPLAY_op {
+	uint8_t type;
+	uint32_t a, b;
+};
+
+static struct REPLAY_op REPLAY_ops[REPLAY_OPS];
+static uint16_t REPLAY_opNum;
+static uint8_t REPLAY_smart;
+static const char *REPLAY_name;
+static uint8_t REPLAY_profile;
+
+static uint8_t *REPLAY_d;				// the image as it should be
+static uint64_t REPLAY_lat[REPLAY_OPS*16];
+static uint32_t REPLAY_n, REPLAY_errors;
+
+// read a trace, 0 if not
+static uint8_t REPLAY_load(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[128], cmd[16];
+	uint32_t a, b, c;
+
+	if (!f) return 0;
+	REPLAY_opNum = 0;
+	REPLAY_smart = 0;
+	while (fgets(line, sizeof(line), f)) {
+		struct REPLAY_op *op = &REPLAY_ops[REPLAY_opNum];
+		int n;
+		char *h = strchr(line, '#');
+
+		if (h) *h = 0;
+		n = sscanf(line, "%15s %u %u-%u", cmd, &a, &b, &c);
+		if (n < 1) continue;
+		if (!strcmp(cmd, "disk2")) { REPLAY_smart = 0; continue; }
+		if (!strcmp(cmd, "smartport")) { REPLAY_smart = 1; continue; }
+		if (REPLAY_opNum == REPLAY_OPS) break;
+		if (!strcmp(cmd, "r") || !strcmp(cmd, "w")) {
+			if (n < 3) continue;
+			op->type = (cmd[0] == 'r') ? REPLAY_R : REPLAY_W;
+			op->a = a*16+b;
+			op->b = a*16+((n == 4) ? c : b);
+		} else if (!strcmp(cmd, "rb") || !strcmp(cmd, "wb")) {
+			if (n < 2) continue;
+			n = sscanf(line, "%15s %u-%u", cmd, &a, &b);
+			op->type = (cmd[0] == 'r') ? REPLAY_RB : REPLAY_WB;
+			op->a = a;
+			op->b = (n == 3) ? b : a;
+		} else if (!strcmp(cmd, "idle")) {
+			if (n < 2) continue;
+			op->type = REPLAY_IDLE;
+			op->a = a;
+		} else continue;
+		REPLAY_opNum++;
+	}
+	fclose(f);
+	return 1;
+}
+
+// what is written, different at each write
+static void REPLAY_fill(uint8_t *p, uint16_t len, uint32_t seed)
+{
+	uint16_t i;
+
+	for (i=0; i<len; i++) p[i] = (seed*31+i*7)^(i>>3);
+}
+
+// a sector or a block, the time of it is kept
+static void REPLAY_one(uint8_t type, uint32_t n)
+{
+	static uint32_t written;
+	uint8_t data[512];
+	uint64_t t = HAL_now;
+	uint16_t r;
+
+	switch (type) {
+	case REPLAY_R:
+	case REPLAY_W:
+		APPLE_seek(n/16);
+		if (type == REPLAY_R) {
+			r = APPLE_readSector(n%16, data);
+			if (!r && memcmp(data, REPLAY_d+n*256, 256)) r = APPLE_BADDATA;
+		} else {
+			REPLAY_fill(REPLAY_d+n*256, 256, ++written);
+			r = APPLE_writeSector(n%16, REPLAY_d+n*256);
+		}
+		break;
+	default:
+		if (type == REPLAY_RB) {
+			r = APPLE_smartRead(1, n, 0, data);
+			if (!r && memcmp(data, REPLAY_d+n*512, 512)) r = APPLE_BADDATA;
+		} else {
+			REPLAY_fill(REPLAY_d+n*512, 512, ++written);
+			r = APPLE_smartWrite(1, n, 0, REPLAY_d+n*512);
+		}
+		break;
+	}
+	if (r) REPLAY_errors++;
+	if (REPLAY_n < sizeof(REPLAY_lat)/sizeof(REPLAY_lat[0])) REPLAY_lat[REPLAY_n++] = HAL_now-t;
+}
+
+static void REPLAY_task(void)
+{
+	uint16_t i;
+
+	if (REPLAY_smart) {
+		APPLE_smartReady();
+		if (!APPLE_smartInit()) RIG_FAIL("no unit");
+	} else {
+		APPLE_diskReady();
+		APPLE_diskOn(0);
+	}
+	for (i=0; i<REPLAY_opNum; i++) {
+		struct REPLAY_op *op = &REPLAY_ops[i];
+		uint32_t n = op->a;
+
+		if (op->type == REPLAY_IDLE) {
+			HAL_sleep(op->a*RIG_MS);
+			continue;
+		}
+		while (1) {
+			REPLAY_one(op->type, n);
+			if (n == op->b) break;
+			n = (n < op->b) ? n+1 : n-1;
+		}
+	}
+	if (!REPLAY_smart) APPLE_diskOff();
+}
+
+static int REPLAY_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void REPLAY_run(void)
+{
+	const char *paths[6] = {"TEST    DSK", 0, "TEST    PO "};
+	uint32_t blocks = REPLAY_smart ? REPLAY_PO_BLOCKS : REPLAY_DSK_BLOCKS;
+	uint64_t sum = 0;
+	uint32_t i;
+
+	REPLAY_d = RIG_blocks(blocks);
+	IMAGE_new(IMAGE_FAT32, 64, 1);
+	RIG_ini(0, paths);
+	IMAGE_addFile(0, REPLAY_smart ? "TEST.PO" : "TEST.DSK", REPLAY_d, blocks*512, 0);
+	RIG_insert(REPLAY_smart);
+	SDCARD_setProfile(REPLAY_profile, 1);
+	RIG_boot(REPLAY_task);
+	if (!REPLAY_n) RIG_FAIL("nothing replayed");
+	qsort(REPLAY_lat, REPLAY_n, sizeof(REPLAY_lat[0]), REPLAY_cmp);
+	for (i=0; i<REPLAY_n; i++) sum += REPLAY_lat[i];
+	// the time of the accesses, not of the idles
+	printf("%-8s %-12s %5u %-7s %7.2f s %7.1f /s  p50 %7.2f  p99 %7.2f  max %7.2f ms",
+		SDCARD_profiles[REPLAY_profile].name, REPLAY_name, REPLAY_n, REPLAY_smart ? "blocks" : "sectors",
+		sum/1e9, REPLAY_n/(sum/1e9),
+		REPLAY_lat[REPLAY_n/2]/1e6, REPLAY_lat[(REPLAY_n*99)/100]/1e6, REPLAY_lat[REPLAY_n-1]/1e6);
+	if (!REPLAY_smart) printf("  %4.2f rev", (double)sum/REPLAY_n/REPLAY_REV);
+#ifdef PROF
+	if (!REPLAY_smart) {
+		uint32_t wb = 0;
+
+		for (i=0; i<PROF_BUCKETS; i++) wb += PROF_hist[PROF_WRITEBACK][i];
+		printf("  %4u write-backs", wb);
+	} else printf("  %u of %u read ahead used, %u late up to %.2f ms", SMART_aheadHits, SMART_aheadReads,
+		SMART_aheadLate, SMART_aheadLateMax*0.008);
+#endif
+	printf("  %u errors\n", REPLAY_errors);
+	free(REPLAY_d);
+	if (REPLAY_errors) exit(1);
+}
+
+// replay [-p profile] trace ...
+int main(int argc, char *argv[])
+{
+	int failed = 0, a = 1;
+	const char *only = 0;
+
+	setvbuf(stdout, 0, _IONBF, 0);
+	if ((argc > 2) && !strcmp(argv[1], "-p")) {
+		only = argv[2];
+		a = 3;
+	}
+	for (; a<argc; a++) {
+		const char *base = strrchr(argv[a], '/');
+		char name[32];
+
+		if (!REPLAY_load(argv[a])) {
+			printf("%s: not read\n", argv[a]);
+			failed++;
+			continue;
+		}
+		snprintf(name, sizeof(name), "%s", base ? base+1 : argv[a]);
+		if (strchr(name, '.')) *strchr(name, '.') = 0;
+		REPLAY_name = name;
+		for (REPLAY_profile=0; REPLAY_profile<SDCARD_PROFILES; REPLAY_profile++) {
+			pid_t pid;
+			int st;
+
+			if (only && strcmp(only, SDCARD_profiles[REPLAY_profile].name)) continue;
+			pid = fork();
+			if (!pid) {
+				REPLAY_run();
+				exit(0);
+			}
+			waitpid(pid, &st, 0);
+			RIG_clean(pid);
+			if (!WIFEXITED(st) || WEXITSTATUS(st)) {
+				printf("%-8s %-12s failed\n", SDCARD_profiles[REPLAY_profile].name, name);
+				failed++;
+			}
+		}
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,108 @@
+﻿/*
+ * RIG.c
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// the firmware on a card image, for the tests and the benchmarks
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "HAL.h"
+#include "SDCARD.h"
+#include "IMAGE.h"
+#include "RIG.h"
+
+static char RIG_path[64];
+
+void RIG_fail(const char *file, int line, const char *what)
+{
+	printf("  %s:%d: %s\n", file, line, what);
+	exit(1);
+}
+
+// an image file of a unique name for the process
+const char *RIG_image(void)
+{
+	if (!RIG_path[0]) snprintf(RIG_path, sizeof(RIG_path), "/tmp/unisdisk-%d.img", (int)getpid());
+	return RIG_path;
+}
+
+// UNISDISK.INI with the path of each drive, 0 if none
+// drives 0 and 1 are of DISK II, 2 to 5 are of SmartPort
+void RIG_ini(uint32_t dir, const char *paths[6])
+{
+	uint8_t ini[512];
+	uint8_t i;
+
+	memset(ini, ' ', sizeof(ini));
+	for (i=0; i<6; i++) {
+		ini[i*64] = 0;
+		if (paths && paths[i]) {
+			strcpy((char *)ini+i*64, paths[i]);
+		}
+	}
+	IMAGE_addFile(dir, "UNISDISK.INI", ini, 512, 0);
+}
+
+// a disk image of the size, each block is filled with its number
+uint8_t *RIG_blocks(uint32_t blocks)
+{
+	uint8_t *d = malloc(blocks*512);
+	uint32_t b, i;
+
+	for (b=0; b<blocks; b++) for (i=0; i<512; i+=4) {
+		d[b*512+i] = b;
+		d[b*512+i+1] = b>>8;
+		d[b*512+i+2] = i>>2;
+		d[b*512+i+3] = 0xa5^(b>>16);
+	}
+	return d;
+}
+
+// the image saved and put in the card, the mode in the EEPROM
+void RIG_insert(uint8_t smart)
+{
+	if (!IMAGE_save(RIG_image())) RIG_FAIL("image not saved");
+	if (!SDCARD_open(RIG_image())) RIG_FAIL("image not opened");
+	HAL_eepromWrite(0x0001, smart ? SMARTMODE : DISK2MODE);
+}
+
+static void RIG_idle(void)
+{
+	HAL_sleep(RIG_IDLE);
+}
+
+// boot and run until the task returns
+void RIG_boot(void (*task)(void))
+{
+	if (HAL_run(task ? task : RIG_idle, RIG_LIMIT)) RIG_FAIL("time limit");
+	IMAGE_load(RIG_image());
+}
+
+// the image of a process that has ended
+void RIG_clean(int pid)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/tmp/unisdisk-%d.img", pid);
+	unlink(path);
+}
@@ -0,0 +1,72 @@
+﻿/*
+ * RIG.h
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// the firmware on a card image, for the tests and the benchmarks
+
+#ifndef RIG_H_
+#define RIG_H_
+
+#include <stdint.h>
+#include "avr/io.h"
+
+// the firmware is built with packed structures
+#pragma pack(push, 1)
+#include "../SD.h"
+#include "../BUFFER.h"
+#include "../COMMON.h"
+#pragma pack(pop)
+
+// a test or a benchmark, run in a process of its own
+struct RIG_case {
+	const char *name;
+	void (*f)(void);
+};
+
+// simulated time
+#define RIG_MS 1000000ULL
+#define RIG_IDLE (1000*RIG_MS)			// a boot without the Apple II
+#define RIG_LIMIT (600000*RIG_MS)		// the firmware is stuck
+
+void RIG_fail(const char *file, int line, const char *what);
+#define RIG_FAIL(what) RIG_fail(__FILE__, __LINE__, what)
+#define RIG_ASSERT(c) do { if (!(c)) RIG_FAIL(#c); } while (0)
+
+// an image file of a unique name for the process
+const char *RIG_image(void);
+// remove the image of an ended process
+void RIG_clean(int pid);
+
+// UNISDISK.INI with the path of each drive, 0 if none
+// drives 0 and 1 are of DISK II, 2 to 5 are of SmartPort
+void RIG_ini(uint32_t dir, const char *paths[6]);
+
+// a disk image of the size, each block is filled with its number
+uint8_t *RIG_blocks(uint32_t blocks);
+
+// the image saved and put in the card, the mode in the EEPROM
+void RIG_insert(uint8_t smart);
+
+// boot and run until the task returns, the image is read back then
+// the firmware idles a while without a task
+void RIG_boot(void (*task)(void));
+
+#endif /* RIG_H_ */
@@ -0,0 +1,346 @@
+﻿/*
+ * SDCARD.c
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// a SD card on the SPI for the host build
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "HAL.h"
+#include "SDCARD.h"
+
+struct SDCARD_stat SDCARD_stat;
+uint32_t SDCARD_watch = 0xffffffff;
+
+static int SDCARD_fd = -1;
+static uint32_t SDCARD_blocks;
+static struct SDCARD_timing SDCARD_t = {1000000, 100000, 20000, 300000};
+static uint8_t SDCARD_jitter;
+static uint16_t SDCARD_tailOf;
+static uint64_t SDCARD_tail;
+static uint32_t SDCARD_seed = 1;
+
+// times from the data sheets of typical cards, in nano seconds
+const struct SDCARD_profile SDCARD_profiles[SDCARD_PROFILES] = {
+	{"ideal",   {1000000,       0,      0,       0},  0,   0,         0},
+	{"a1",      {100000000,  250000,  30000,  400000}, 20, 200,  20000000},
+	{"class10", {200000000,  500000,  50000, 1000000}, 30, 100,  80000000},
+	{"slow",    {500000000, 1500000, 200000, 3000000}, 50,  50, 250000000},
+};
+
+// 0 : off, 1 : idle, 2 : ready
+static uint8_t SDCARD_power;
+static uint64_t SDCARD_readyAt;
+static uint8_t SDCARD_app;				// command 55 is just before
+
+// the command being received
+static uint8_t SDCARD_cmd[6], SDCARD_cmdLen;
+
+// the response, after some bytes of 0xff
+static uint8_t SDCARD_resp[8], SDCARD_respLen, SDCARD_respPos, SDCARD_respSkip;
+static uint64_t SDCARD_busyUntil;
+
+// the data transfer
+enum {SDCARD_NONE, SDCARD_READ, SDCARD_READMULTI, SDCARD_WRITE, SDCARD_WRITEMULTI};
+static uint8_t SDCARD_mode;
+static uint32_t SDCARD_blk;
+static uint8_t SDCARD_buf[512];
+static int16_t SDCARD_pos;				// -1 : before the token
+static uint64_t SDCARD_dataAt;			// the token is sent from
+static uint8_t SDCARD_inBlock;			// 1 : the token of the written block is received
+
+uint8_t SDCARD_open(const char *path)
+{
+	struct stat st;
+
+	SDCARD_close();
+	SDCARD_fd = open(path, O_RDWR);
+	if (SDCARD_fd < 0) return 0;
+	if (fstat(SDCARD_fd, &st)) { SDCARD_close(); return 0; }
+	SDCARD_blocks = st.st_size/512;
+	SDCARD_reset();
+	return 1;
+}
+
+void SDCARD_close(void)
+{
+	if (SDCARD_fd >= 0) close(SDCARD_fd);
+	SDCARD_fd = -1;
+	SDCARD_blocks = 0;
+}
+
+void SDCARD_setTiming(const struct SDCARD_timing *t)
+{
+	SDCARD_t = *t;
+	SDCARD_jitter = 0;
+	SDCARD_tailOf = 0;
+}
+
+void SDCARD_setProfile(uint8_t profile, uint32_t seed)
+{
+	const struct SDCARD_profile *p = &SDCARD_profiles[profile];
+
+	SDCARD_t = p->t;
+	SDCARD_jitter = p->jitter;
+	SDCARD_tailOf = p->tailOf;
+	SDCARD_tail = p->tail;
+	SDCARD_seed = seed ? seed : 1;
+}
+
+// xorshift, not the C library so that the times are the same anywhere
+static uint32_t SDCARD_random(void)
+{
+	SDCARD_seed ^= SDCARD_seed<<13;
+	SDCARD_seed ^= SDCARD_seed>>17;
+	SDCARD_seed ^= SDCARD_seed<<5;
+	return SDCARD_seed;
+}
+
+// a time varied by the jitter
+static uint64_t SDCARD_vary(uint64_t t)
+{
+	if (!SDCARD_jitter || !t) return t;
+	return t*(100-SDCARD_jitter+SDCARD_random()%(2*SDCARD_jitter+1))/100;
+}
+
+static uint64_t SDCARD_accessTime(void)
+{
+	uint64_t t = SDCARD_vary(SDCARD_t.access);
+
+	SDCARD_stat.access += t;
+	if (t > SDCARD_stat.maxAccess) SDCARD_stat.maxAccess = t;
+	if (SDCARD_blk == SDCARD_watch) SDCARD_stat.watchTime += t;
+	return t;
+}
+
+static uint64_t SDCARD_programTime(void)
+{
+	uint64_t t = SDCARD_vary(SDCARD_t.program);
+
+	if (SDCARD_tailOf && !(SDCARD_random()%SDCARD_tailOf)) t = SDCARD_tail;
+	SDCARD_stat.busy += t;
+	if (t > SDCARD_stat.maxBusy) SDCARD_stat.maxBusy = t;
+	if (SDCARD_blk == SDCARD_watch) SDCARD_stat.watchTime += t;
+	return t;
+}
+
+void SDCARD_reset(void)
+{
+	SDCARD_power = 0;
+	SDCARD_app = 0;
+	SDCARD_cmdLen = 0;
+	SDCARD_respLen = SDCARD_respPos = 0;
+	SDCARD_busyUntil = 0;
+	SDCARD_mode = SDCARD_NONE;
+	SDCARD_inBlock = 0;
+}
+
+void SDCARD_cs(uint8_t high)
+{
+	if (high) SDCARD_cmdLen = 0;
+}
+
+static void SDCARD_load(void)
+{
+	memset(SDCARD_buf, 0, 512);
+	if (pread(SDCARD_fd, SDCARD_buf, 512, (off_t)SDCARD_blk*512) < 0) memset(SDCARD_buf, 0, 512);
+	SDCARD_stat.readBlocks++;
+	if (SDCARD_blk == SDCARD_watch) SDCARD_stat.watchReads++;
+}
+
+static void SDCARD_store(void)
+{
+	if (pwrite(SDCARD_fd, SDCARD_buf, 512, (off_t)SDCARD_blk*512) != 512) return;
+	SDCARD_stat.writeBlocks++;
+	if (SDCARD_blk == SDCARD_watch) SDCARD_stat.watchWrites++;
+}
+
+// the response from the second byte after the command
+static void SDCARD_respond(const uint8_t *r, uint8_t len)
+{
+	memcpy(SDCARD_resp, r, len);
+	SDCARD_respLen = len;
+	SDCARD_respPos = 0;
+	SDCARD_respSkip = 1;
+}
+
+static uint8_t SDCARD_r1(void)
+{
+	return (SDCARD_power == 1) ? 0x01 : 0x00;
+}
+
+static void SDCARD_exec(void)
+{
+	uint8_t idx = SDCARD_cmd[0]&0x3f;
+	uint32_t arg = ((uint32_t)SDCARD_cmd[1]<<24)|((uint32_t)SDCARD_cmd[2]<<16)|(SDCARD_cmd[3]<<8)|SDCARD_cmd[4];
+	uint8_t app = SDCARD_app;
+	uint8_t r[5];
+
+	SDCARD_app = 0;
+	SDCARD_stat.cmds[idx]++;
+	SDCARD_respLen = SDCARD_respPos = 0;
+	if (!SDCARD_power && idx) return;
+	r[0] = SDCARD_r1();
+	switch (idx) {
+	case 0:
+		SDCARD_power = 1;
+		SDCARD_readyAt = HAL_now+SDCARD_t.init;
+		SDCARD_mode = SDCARD_NONE;
+		r[0] = 0x01;
+		SDCARD_respond(r, 1);
+		break;
+	case 8:
+		r[1] = 0; r[2] = 0; r[3] = (arg>>8)&0x0f; r[4] = arg&0xff;
+		SDCARD_respond(r, 5);
+		break;
+	case 55:
+		SDCARD_app = 1;
+		SDCARD_respond(r, 1);
+		break;
+	case 41:
+		if (!app) { r[0] |= 0x04; SDCARD_respond(r, 1); break; }
+		if ((SDCARD_power == 1) && (HAL_now >= SDCARD_readyAt)) SDCARD_power = 2;
+		r[0] = SDCARD_r1();
+		SDCARD_respond(r, 1);
+		break;
+	case 58:
+		r[1] = 0xc0; r[2] = 0xff; r[3] = 0x80; r[4] = 0x00;	// powered up, block address
+		SDCARD_respond(r, 5);
+		break;
+	case 12:
+		SDCARD_mode = SDCARD_NONE;
+		SDCARD_respond(r, 1);
+		SDCARD_busyUntil = HAL_now+SDCARD_t.gap;
+		break;
+	case 17:
+	case 18:
+		if ((SDCARD_power != 2) || (arg >= SDCARD_blocks)) { r[0] |= 0x40; SDCARD_respond(r, 1); break; }
+		SDCARD_respond(r, 1);
+		SDCARD_mode = (idx == 17) ? SDCARD_READ : SDCARD_READMULTI;
+		SDCARD_blk = arg;
+		SDCARD_load();
+		SDCARD_pos = -1;
+		SDCARD_dataAt = HAL_now+SDCARD_accessTime();
+		break;
+	case 24:
+	case 25:
+		if ((SDCARD_power != 2) || (arg >= SDCARD_blocks)) { r[0] |= 0x40; SDCARD_respond(r, 1); break; }
+		SDCARD_respond(r, 1);
+		SDCARD_mode = (idx == 24) ? SDCARD_WRITE : SDCARD_WRITEMULTI;
+		SDCARD_blk = arg;
+		SDCARD_inBlock = 0;
+		break;
+	case 13:
+		r[1] = 0;
+		SDCARD_respond(r, 2);
+		break;
+	case 16:
+		SDCARD_respond(r, 1);
+		break;
+	default:
+		r[0] |= 0x04;						// illegal command
+		SDCARD_respond(r, 1);
+		break;
+	}
+}
+
+// the byte the card drives
+static uint8_t SDCARD_out(void)
+{
+	if (SDCARD_respPos < SDCARD_respLen) {
+		if (SDCARD_respSkip) { SDCARD_respSkip--; return 0xff; }
+		return SDCARD_resp[SDCARD_respPos++];
+	}
+	if (HAL_now < SDCARD_busyUntil) return 0x00;
+	if ((SDCARD_mode == SDCARD_READ) || (SDCARD_mode == SDCARD_READMULTI)) {
+		if (SDCARD_pos < 0) {
+			if (HAL_now < SDCARD_dataAt) return 0xff;
+			SDCARD_pos = 0;
+			return 0xfe;
+		}
+		if (SDCARD_pos < 512) return SDCARD_buf[SDCARD_pos++];
+		if (SDCARD_pos++ == 512) return 0x00;		// CRC
+		if (SDCARD_mode == SDCARD_READ) SDCARD_mode = SDCARD_NONE;
+		else {
+			SDCARD_blk++;
+			SDCARD_load();
+			SDCARD_pos = -1;
+			SDCARD_dataAt = HAL_now+SDCARD_vary(SDCARD_t.gap);
+		}
+		return 0x00;
+	}
+	return 0xff;
+}
+
+// the byte the card receives
+static void SDCARD_in(uint8_t mosi)
+{
+	if ((SDCARD_mode == SDCARD_WRITE) || (SDCARD_mode == SDCARD_WRITEMULTI)) {
+		if (SDCARD_inBlock) {
+			if (SDCARD_pos < 512) SDCARD_buf[SDCARD_pos] = mosi;
+			if (++SDCARD_pos < 514) return;
+			// data accepted
+			SDCARD_store();
+			SDCARD_resp[0] = 0x05;
+			SDCARD_respLen = 1;
+			SDCARD_respPos = SDCARD_respSkip = 0;
+			SDCARD_busyUntil = HAL_now+SDCARD_programTime();
+			SDCARD_inBlock = 0;
+			if (SDCARD_mode == SDCARD_WRITE) SDCARD_mode = SDCARD_NONE;
+			else SDCARD_blk++;
+			return;
+		}
+		if ((SDCARD_respPos < SDCARD_respLen) || (HAL_now < SDCARD_busyUntil)) return;
+		if (mosi == ((SDCARD_mode == SDCARD_WRITE) ? 0xfe : 0xfc)) {
+			SDCARD_inBlock = 1;
+			SDCARD_pos = 0;
+		} else if ((SDCARD_mode == SDCARD_WRITEMULTI) && (mosi == 0xfd)) {
+			SDCARD_mode = SDCARD_NONE;
+			SDCARD_resp[0] = 0xff;				// a byte before the busy
+			SDCARD_respLen = 1;
+			SDCARD_respPos = SDCARD_respSkip = 0;
+			SDCARD_busyUntil = HAL_now+SDCARD_t.gap;
+		}
+		return;
+	}
+	if (SDCARD_cmdLen) {
+		SDCARD_cmd[SDCARD_cmdLen++] = mosi;
+		if (SDCARD_cmdLen == 6) {
+			SDCARD_cmdLen = 0;
+			SDCARD_exec();
+		}
+	} else if ((mosi&0xc0) == 0x40) {
+		SDCARD_cmd[0] = mosi;
+		SDCARD_cmdLen = 1;
+	}
+}
+
+uint8_t SDCARD_xfer(uint8_t mosi)
+{
+	uint8_t miso;
+
+	if (SDCARD_fd < 0) return 0xff;
+	miso = SDCARD_out();
+	SDCARD_in(mosi);
+	return miso;
+}
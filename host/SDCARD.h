@@ -0,0 +1,79 @@
+﻿/*
+ * SDCARD.h
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// a SD card on the SPI for the host build
+// SDHC in SPI mode, the blocks are kept in an image file
+
+#ifndef SDCARD_H_
+#define SDCARD_H_
+
+#include <stdint.h>
+
+// times of the card in nano seconds
+struct SDCARD_timing {
+	uint64_t init;				// command 0 until command 41 reports ready
+	uint64_t access;			// a read command until the data token
+	uint64_t gap;				// between blocks of command 18
+	uint64_t program;			// busy after a written block
+};
+
+// a kind of card, the times vary around its timing
+// one in tailOf of the written blocks is busy for tail, as a card does while it erases
+struct SDCARD_profile {
+	const char *name;
+	struct SDCARD_timing t;
+	uint8_t jitter;				// the times vary by this percent up and down
+	uint16_t tailOf;			// 0 : no long busy
+	uint64_t tail;
+};
+enum {SDCARD_IDEAL, SDCARD_A1, SDCARD_CLASS10, SDCARD_SLOW, SDCARD_PROFILES};
+extern const struct SDCARD_profile SDCARD_profiles[SDCARD_PROFILES];
+
+// what the card has done
+struct SDCARD_stat {
+	uint32_t cmds[64];			// commands by index
+	uint32_t readBlocks, writeBlocks;
+	uint64_t busy;				// time busy after writes
+	uint64_t access;			// time until the data tokens
+	uint64_t maxAccess, maxBusy;
+	uint32_t watchReads, watchWrites;	// of the block SDCARD_watch
+	uint64_t watchTime;			// access and busy of that block
+};
+extern struct SDCARD_stat SDCARD_stat;
+// a block counted apart, such as the sector of UNISDISK.INI, 0xffffffff : none
+extern uint32_t SDCARD_watch;
+
+// use the image file, 0 if not
+uint8_t SDCARD_open(const char *path);
+void SDCARD_close(void);
+// the times from now, a fast card by default
+void SDCARD_setTiming(const struct SDCARD_timing *t);
+// a profile from now, the same seed gives the same times
+void SDCARD_setProfile(uint8_t profile, uint32_t seed);
+// power off, command 0 is needed again
+void SDCARD_reset(void);
+
+// from the SPI of HAL.c
+void SDCARD_cs(uint8_t high);
+uint8_t SDCARD_xfer(uint8_t mosi);
+
+#endif /* SDCARD_H_ */
@@ -0,0 +1,67 @@
+﻿/*
+ * SMARTASM.c
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// the model of SMARTASM.s for the host build
+// the packets are passed as bytes at 32 usec each
+
+#include "avr/io.h"
+#include "HAL.h"
+
+#define SMARTASM_BYTE 32000ULL
+
+// receive a packet, 1 if none in about 10ms
+// the first byte is not stored and a 0 marks the end
+uint8_t SMART_ReceivePacket(uint8_t *buf)
+{
+	const uint8_t *p;
+	uint64_t start, end;
+	uint16_t len, i;
+	uint32_t n = 0;
+
+	while (!(len = HAL_hostPacket(&p, &start))) {
+		if (++n == 65536) return 1;
+		HAL_cycles(5);
+	}
+	for (i=1; i<len; i++) *buf++ = p[i];
+	*buf = 0;
+	end = start+len*SMARTASM_BYTE;
+	if (HAL_now < end) HAL_wait(end-HAL_now);
+	HAL_cycles(100*5);				// no more bits
+	VPORT2_OUT &= ~PIN7_bm;			// ACK low
+	while (VPORT0_IN&PIN0_bm) ;		// wait for REQ low
+	return 0;
+}
+
+// send a packet ended by 0
+uint8_t SMART_SendPacket(uint8_t *buf)
+{
+	uint16_t len = 0;
+
+	VPORT2_OUT |= PIN7_bm;			// ACK high
+	while (!(VPORT0_IN&PIN0_bm)) ;	// wait for REQ high
+	while (buf[len]) len++;
+	HAL_devicePacket(buf, len);
+	HAL_wait(len*SMARTASM_BYTE);
+	VPORT2_OUT &= ~PIN7_bm;			// ACK low
+	while (VPORT0_IN&PIN0_bm) ;		// wait for REQ low
+	return 0;
+}
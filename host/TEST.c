@@ -0,0 +1,665 @@
+﻿/*
+ * TEST.c
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// tests of the host build
+// each test runs the firmware in a process of its own, as the firmware keeps its RAM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "HAL.h"
+#include "SDCARD.h"
+#include "IMAGE.h"
+#include "RIG.h"
+#include "APPLE.h"
+
+// ========== mount ==========
+
+static void TEST_mount(uint8_t fs, uint8_t mbr)
+{
+	uint8_t *d = RIG_blocks(280);
+	const char *paths[6] = {0, 0, "TEST    PO "};
+	uint32_t dir;
+
+	IMAGE_new(fs, 64, mbr);
+	RIG_ini(0, paths);
+	dir = IMAGE_mkdir(0, "GAMES");
+	IMAGE_addFile(dir, "OTHER.PO", d, 280*512, 0);
+	IMAGE_addFile(0, "TEST.PO", d, 280*512, 0);
+	RIG_insert(1);
+	RIG_boot(0);
+	RIG_ASSERT(SD_p.inited);
+	RIG_ASSERT(SD_p.exfat == (fs == IMAGE_EXFAT));
+	RIG_ASSERT(buffer2.smart.img[0].valid);
+	RIG_ASSERT(!memcmp(buffer2.smart.img[0].name, "TEST    PO ", 11));
+	RIG_ASSERT(buffer2.smart.img[0].length == 280*512);
+	RIG_ASSERT(!buffer2.smart.img[1].valid);
+	free(d);
+}
+
+static void TEST_mountFat16(void) { TEST_mount(IMAGE_FAT16, 0); }
+static void TEST_mountFat32(void) { TEST_mount(IMAGE_FAT32, 1); }
+static void TEST_mountExfat(void) { TEST_mount(IMAGE_EXFAT, 1); }
+
+// long exFAT names of the same start are told apart by the NameHash in the 8.3 form
+static void TEST_exfatNames(void)
+{
+	static const char *names[2] = {"Long Disk One.po", "Long Disk Two.po"};
+	uint8_t *d = RIG_blocks(1600);
+	char form[2][12];
+	const char *paths[6] = {0, 0, form[0], form[1]};
+	uint8_t i, j;
+
+	for (i=0; i<2; i++) {
+		uint16_t hash = 0;
+
+		for (j=0; names[i][j]; j++) {
+			hash = ((hash&1)?0x8000:0)+(hash>>1)+toupper((uint8_t)names[i][j]);
+			hash = ((hash&1)?0x8000:0)+(hash>>1);
+		}
+		sprintf(form[i], "LO%04X~1PO ", hash);
+	}
+	IMAGE_new(IMAGE_EXFAT, 64, 1);
+	RIG_ini(0, paths);
+	IMAGE_addFile(0, names[0], d, 280*512, 0);
+	IMAGE_addFile(0, names[1], d, 1600*512, 0);
+	RIG_insert(1);
+	RIG_boot(0);
+	RIG_ASSERT(buffer2.smart.img[0].valid && buffer2.smart.img[1].valid);
+	RIG_ASSERT(!memcmp(buffer2.smart.img[0].name, form[0], 11));
+	RIG_ASSERT(buffer2.smart.img[0].length == 280*512);
+	RIG_ASSERT(buffer2.smart.img[1].length == 1600*512);
+	free(d);
+}
+
+// UNISDISK.INI is made if the card has none
+static void TEST_iniCreated(void)
+{
+	uint8_t ini[512];
+	uint8_t i;
+
+	IMAGE_new(IMAGE_FAT32, 64, 1);
+	RIG_insert(1);
+	RIG_boot(0);
+	RIG_ASSERT(IMAGE_readFile(0, "UNISDISK.INI", ini, 512) == 512);
+	for (i=0; i<6; i++) RIG_ASSERT(ini[i*64] == 0);
+	RIG_ASSERT(SDCARD_stat.cmds[24] > 0);
+}
+
+// a DSK is converted to NIC for DISK II
+static void TEST_nicCreated(void)
+{
+	uint8_t *d = RIG_blocks(280), *nic = malloc(286720);
+	const char *paths[6] = {"TEST    DSK"};
+	uint16_t i, s;
+
+	IMAGE_new(IMAGE_FAT16, 64, 0);
+	RIG_ini(0, paths);
+	IMAGE_addFile(0, "TEST.DSK", d, 280*512, 0);
+	RIG_insert(0);
+	RIG_boot(0);
+	RIG_ASSERT(buffer2.disk2.img[0].valid);
+	RIG_ASSERT(IMAGE_readFile(0, "TEST.NIC", nic, 286720) == 286720);
+	// the address field of the first and the last sector
+	for (s=0; s<560; s+=559) {
+		uint8_t *p = nic+s*512;
+
+		for (i=0; i<512-3; i++) if ((p[i] == 0xd5) && (p[i+1] == 0xaa) && (p[i+2] == 0x96)) break;
+		RIG_ASSERT(i < 512-3);
+	}
+	free(d);
+	free(nic);
+}
+
+// no card, the firmware waits for it
+static void TEST_noCard(void)
+{
+	HAL_setIn(0, PIN5_bm, PIN5_bm);
+	HAL_eepromWrite(0x0001, SMARTMODE);
+	RIG_boot(0);
+	RIG_ASSERT(!SD_p.inited);
+}
+
+// ========== file lists ==========
+
+#define TEST_IDX_FILES 200
+static uint8_t TEST_idxOn;
+
+// push a button of the UI and release it, PSW4 is PIN1 of PORTD
+static void TEST_push(uint8_t port, uint8_t mask)
+{
+	HAL_setIn(port, mask, 0);
+	HAL_sleep(100*RIG_MS);
+	HAL_setIn(port, mask, mask);
+	HAL_sleep(3000*RIG_MS);
+}
+
+// the list is made at the first visit and used at the next one without scanning the directory
+static void TEST_idxTask(void)
+{
+	uint32_t reads;
+
+	HAL_sleep(RIG_IDLE);
+	TEST_push(2, PIN1_bm);
+	TEST_push(2, PIN1_bm);
+	reads = SDCARD_stat.readBlocks;
+	TEST_push(2, PIN1_bm);
+	TEST_push(2, PIN1_bm);
+	if (TEST_idxOn) RIG_ASSERT(SDCARD_stat.readBlocks-reads < 8);
+}
+
+// files in the reverse order, UNISDISK.IDX is used only with "IDX=1" in UNISDISK.INI
+static void TEST_idx(uint8_t on)
+{
+	uint8_t ini[512], d[512] = {0}, *idx = malloc(256*512), *p;
+	char name[16];
+	uint16_t i;
+
+	TEST_idxOn = on;
+	IMAGE_new(IMAGE_FAT32, 64, 1);
+	memset(ini, ' ', sizeof(ini));
+	for (i=0; i<6; i++) ini[i*64] = 0;
+	if (on) memcpy(ini+6*64, "IDX=1", 5);
+	IMAGE_addFile(0, "UNISDISK.INI", ini, 512, 0);
+	for (i=TEST_IDX_FILES; i; i--) {
+		snprintf(name, sizeof(name), "F%03u.PO", i-1);
+		IMAGE_addFile(0, name, d, 512, 0);
+	}
+	RIG_insert(1);
+	RIG_boot(TEST_idxTask);
+	if (!on) {
+		RIG_ASSERT(IMAGE_readFile(0, "UNISDISK.IDX", idx, 256*512) < 0);
+	} else {
+		RIG_ASSERT(IMAGE_readFile(0, "UNISDISK.IDX", idx, 256*512) == 256*512);
+		RIG_ASSERT(!memcmp(idx, "UNISDID2", 8));
+		p = idx+32;
+		RIG_ASSERT(p[10]+p[11]*256 == TEST_IDX_FILES);
+		RIG_ASSERT(!strcmp((char *)p+12, "PO 2MG"));
+		p = idx+(p[8]+p[9]*256)*512;
+		for (i=0; i<TEST_IDX_FILES; i++) {
+			snprintf(name, sizeof(name), "F%03u    PO ", i);
+			RIG_ASSERT(!memcmp(p+i*16, name, 11));
+		}
+	}
+	free(idx);
+}
+static void TEST_idxList(void) { TEST_idx(1); }
+static void TEST_idxOff(void) { TEST_idx(0); }
+
+// the directories one after another, PSW1 : next, PSW3 : select
+// back to the root by "..", where the cursor is on the directory left
+static void TEST_idxCompactTask(void)
+{
+	uint8_t i;
+
+	HAL_sleep(RIG_IDLE);
+	TEST_push(2, PIN1_bm);
+	for (i=0; i<4; i++) {
+		TEST_push(0, PIN4_bm);
+		TEST_push(2, PIN3_bm);
+		TEST_push(0, PIN4_bm);
+		TEST_push(2, PIN3_bm);
+	}
+	TEST_push(2, PIN1_bm);
+}
+
+// the fourth list of 32 sectors has no room until the others are moved down over their sort sectors
+static void TEST_idxCompact(void)
+{
+	uint8_t ini[512], d[512] = {0}, *idx = malloc(256*512), *p;
+	uint32_t dir[4];
+	char name[16];
+	uint16_t i, j, k, n;
+
+	IMAGE_new(IMAGE_FAT32, 64, 1);
+	memset(ini, ' ', sizeof(ini));
+	for (i=0; i<6; i++) ini[i*64] = 0;
+	memcpy(ini+6*64, "IDX=1", 5);
+	IMAGE_addFile(0, "UNISDISK.INI", ini, 512, 0);
+	for (k=0; k<4; k++) {
+		snprintf(name, sizeof(name), "D%u", k);
+		dir[k] = IMAGE_mkdir(0, name);
+		for (i=1000; i; i--) {
+			snprintf(name, sizeof(name), "F%u%03u.PO", k, i-1);
+			IMAGE_addFile(dir[k], name, d, 512, 0);
+		}
+	}
+	RIG_insert(1);
+	RIG_boot(TEST_idxCompactTask);
+	RIG_ASSERT(IMAGE_readFile(0, "UNISDISK.IDX", idx, 256*512) == 256*512);
+	RIG_ASSERT(idx[8]+idx[9]*256 == 1+1+3*32+2*32);
+	for (k=0; k<4; k++) {
+		for (j=0; j<15; j++) {
+			p = idx+32+j*32;
+			if ((p[8]|p[9]) && (p[0]+(p[1]<<8)+(p[2]<<16)+((uint32_t)p[3]<<24) == dir[k])) break;
+		}
+		RIG_ASSERT(j < 15);
+		n = p[10]+p[11]*256;
+		RIG_ASSERT(n == 1001);
+		p = idx+(p[8]+p[9]*256)*512;
+		RIG_ASSERT(!memcmp(p, "..         ", 11));
+		for (i=0; i<1000; i++) {
+			snprintf(name, sizeof(name), "F%u%03u   PO ", k, i);
+			RIG_ASSERT(!memcmp(p+(i+1)*16, name, 11));
+		}
+	}
+	free(idx);
+}
+
+// A, B, back to A : PSW1 : next, PSW2 : previous, PSW3 : select
+static void TEST_idxDropTask(void)
+{
+	HAL_sleep(RIG_IDLE);
+	TEST_push(2, PIN1_bm);
+	TEST_push(0, PIN4_bm);
+	TEST_push(2, PIN3_bm);
+	TEST_push(0, PIN4_bm);
+	TEST_push(2, PIN3_bm);
+	TEST_push(0, PIN4_bm);
+	TEST_push(2, PIN3_bm);
+	TEST_push(0, PIN4_bm);
+	TEST_push(2, PIN3_bm);
+	TEST_push(1, PIN2_bm);
+	TEST_push(2, PIN3_bm);
+	TEST_push(2, PIN1_bm);
+}
+
+// the list of B of 126 sectors has room only when the list of A, the only one left, is dropped
+// A visited again is scanned and not served from the sectors of B
+static void TEST_idxDrop(void)
+{
+	uint8_t ini[512], d[512] = {0}, *idx = malloc(256*512), *p;
+	uint32_t a, b;
+	char name[16];
+	uint16_t i, j;
+
+	IMAGE_new(IMAGE_FAT32, 64, 1);
+	memset(ini, ' ', sizeof(ini));
+	for (i=0; i<6; i++) ini[i*64] = 0;
+	memcpy(ini+6*64, "IDX=1", 5);
+	IMAGE_addFile(0, "UNISDISK.INI", ini, 512, 0);
+	a = IMAGE_mkdir(0, "A");
+	for (i=100; i; i--) {
+		snprintf(name, sizeof(name), "F%03u.PO", i-1);
+		IMAGE_addFile(a, name, d, 512, 0);
+	}
+	b = IMAGE_mkdir(0, "B");
+	for (i=126*32-1; i; i--) {
+		snprintf(name, sizeof(name), "G%04u.PO", i-1);
+		IMAGE_addFile(b, name, d, 512, 0);
+	}
+	RIG_insert(1);
+	RIG_boot(TEST_idxDropTask);
+	RIG_ASSERT(IMAGE_readFile(0, "UNISDISK.IDX", idx, 256*512) == 256*512);
+	for (j=0; j<15; j++) {
+		p = idx+32+j*32;
+		if ((p[8]|p[9]) && (p[0]+(p[1]<<8)+(p[2]<<16)+((uint32_t)p[3]<<24) == a)) break;
+	}
+	RIG_ASSERT(j < 15);
+	RIG_ASSERT(p[10]+p[11]*256 == 101);
+	p = idx+(p[8]+p[9]*256)*512;
+	RIG_ASSERT(!memcmp(p, "..         ", 11));
+	for (i=0; i<100; i++) {
+		snprintf(name, sizeof(name), "F%03u    PO ", i);
+		RIG_ASSERT(!memcmp(p+(i+1)*16, name, 11));
+	}
+	free(idx);
+}
+
+// ========== SmartPort ==========
+
+static uint8_t *TEST_d;
+
+// a SmartPort image of the blocks and the firmware with the task
+static void TEST_smart(uint32_t blocks, void (*task)(void))
+{
+	const char *paths[6] = {0, 0, "TEST    PO "};
+
+	TEST_d = RIG_blocks(blocks);
+	IMAGE_new(IMAGE_FAT32, 64, 1);
+	RIG_ini(0, paths);
+	IMAGE_addFile(0, "TEST.PO", TEST_d, blocks*512, 0);
+	RIG_insert(1);
+	RIG_boot(task);
+}
+
+// blocks read are as in the image, all 512 bytes of them
+static void TEST_smartReadTask(void)
+{
+	static const uint32_t blocks[] = {0, 1, 2, 5, 6, 7, 300, 301, 1599};
+	uint8_t data[512];
+	uint8_t i;
+
+	APPLE_smartReady();
+	RIG_ASSERT(APPLE_smartInit() >= 1);
+	for (i=0; i<sizeof(blocks)/sizeof(blocks[0]); i++) {
+		memset(data, 0, 512);
+		RIG_ASSERT(APPLE_smartRead(1, blocks[i], 0, data) == APPLE_OK);
+		RIG_ASSERT(!memcmp(data, TEST_d+blocks[i]*512, 512));
+	}
+}
+static void TEST_smartRead(void) { TEST_smart(1600, TEST_smartReadTask); free(TEST_d); }
+
+// a block the card can not read is an I/O error, not a data packet
+static void TEST_smartReadErrorTask(void)
+{
+	uint8_t data[512];
+
+	APPLE_smartReady();
+	RIG_ASSERT(APPLE_smartInit() >= 1);
+	RIG_ASSERT(APPLE_smartRead(1, 5, 0, data) == APPLE_OK);
+	HAL_setIn(0, PIN5_bm, PIN5_bm);		// ejected
+	RIG_ASSERT(APPLE_smartRead(1, 9, 0, data) == APPLE_IOERR);
+}
+static void TEST_smartReadError(void) { TEST_smart(1600, TEST_smartReadErrorTask); free(TEST_d); }
+
+// extended commands, with block numbers over 16 bits
+#define TEST_EXT_BLOCKS 70000
+static void TEST_smartExtendedTask(void)
+{
+	uint8_t data[512], w[512];
+	uint16_t i;
+
+	APPLE_smartReady();
+	RIG_ASSERT(APPLE_smartInit() >= 1);
+	RIG_ASSERT(APPLE_smartBlocks(1, 1) == TEST_EXT_BLOCKS);
+	RIG_ASSERT(APPLE_resp[10] == 0xc0);
+	RIG_ASSERT(APPLE_smartBlocks(1, 0) == TEST_EXT_BLOCKS);
+	RIG_ASSERT(APPLE_resp[10] == 0x80);
+	// encoded while received from the card
+	RIG_ASSERT(APPLE_smartRead(1, 0x10203, 1, data) == APPLE_OK);
+	RIG_ASSERT(APPLE_resp[10] == 0xc0);
+	RIG_ASSERT(!memcmp(data, TEST_d+0x10203*512, 512));
+	RIG_ASSERT(APPLE_smartRead(1, 0x203, 1, data) == APPLE_OK);
+	RIG_ASSERT(!memcmp(data, TEST_d+0x203*512, 512));
+	// written, then read back either way
+	for (i=0; i<512; i++) w[i] = i*7+3;
+	RIG_ASSERT(APPLE_smartWrite(1, 0x10204, 1, w) == APPLE_OK);
+	RIG_ASSERT(APPLE_resp[10] == 0xc0);
+	RIG_ASSERT(APPLE_smartRead(1, 0x10204, 1, data) == APPLE_OK);
+	RIG_ASSERT(!memcmp(data, w, 512));
+	RIG_ASSERT(APPLE_smartRead(1, 0x10204, 0, data) == APPLE_OK);
+	RIG_ASSERT(!memcmp(data, w, 512));
+	memcpy(TEST_d+0x10204*512, w, 512);
+}
+
+static void TEST_smartExtended(void)
+{
+	uint8_t *d = malloc(TEST_EXT_BLOCKS*512);
+
+	TEST_smart(TEST_EXT_BLOCKS, TEST_smartExtendedTask);
+	RIG_ASSERT(IMAGE_readFile(0, "TEST.PO", d, TEST_EXT_BLOCKS*512) == TEST_EXT_BLOCKS*512);
+	RIG_ASSERT(!memcmp(d, TEST_d, TEST_EXT_BLOCKS*512));
+	free(d);
+	free(TEST_d);
+}
+
+// the bitmap of a ProDOS volume is kept while it is not written
+static void TEST_smartVolumeTask(void)
+{
+	uint8_t data[512], w[512];
+	uint32_t reads;
+	uint16_t i;
+
+	APPLE_smartReady();
+	RIG_ASSERT(APPLE_smartInit() >= 1);
+	RIG_ASSERT(APPLE_smartRead(1, 2, 0, data) == APPLE_OK);
+	RIG_ASSERT(APPLE_smartRead(1, 6, 0, data) == APPLE_OK);
+	reads = SDCARD_stat.readBlocks;
+	RIG_ASSERT(APPLE_smartRead(1, 6, 0, data) == APPLE_OK);
+	RIG_ASSERT(SDCARD_stat.readBlocks == reads);
+	RIG_ASSERT(!memcmp(data, TEST_d+6*512, 512));
+	// written, then read from the card again, or from the block kept after it is written behind
+	for (i=0; i<512; i++) w[i] = i*5+1;
+	RIG_ASSERT(APPLE_smartWrite(1, 6, 0, w) == APPLE_OK);
+	RIG_ASSERT(APPLE_smartRead(1, 6, 0, data) == APPLE_OK);
+#ifndef SMART_WRITE_BEHIND
+	RIG_ASSERT(SDCARD_stat.readBlocks > reads);
+#endif
+	RIG_ASSERT(!memcmp(data, w, 512));
+}
+static void TEST_smartVolume(void)
+{
+	const char *paths[6] = {0, 0, "TEST    PO "};
+	uint8_t *p;
+
+	TEST_d = RIG_blocks(1600);
+	p = TEST_d+2*512;
+	memset(p, 0, 0x2b);
+	p[4] = 0xf4;						// the volume directory header
+	p[0x23] = 0x27;
+	p[0x24] = 0x0d;
+	p[0x27] = 6;						// the bitmap
+	p[0x29] = 1600&0xff;
+	p[0x2a] = 1600>>8;
+	IMAGE_new(IMAGE_FAT32, 64, 1);
+	RIG_ini(0, paths);
+	IMAGE_addFile(0, "TEST.PO", TEST_d, 1600*512, 0);
+	RIG_insert(1);
+	RIG_boot(TEST_smartVolumeTask);
+	free(TEST_d);
+}
+
+// an image with a volume at every 32MB is carved into units, after a unit for each image
+// a drive without an image has none in the desktop mode
+static void TEST_smartUnitsTask(void)
+{
+	APPLE_smartReady();
+	RIG_ASSERT(APPLE_smartInit() == 3);
+	RIG_ASSERT(APPLE_smartBlocks(1, 0) == 65535);
+	RIG_ASSERT(APPLE_smartBlocks(2, 0) == 280);
+	RIG_ASSERT(APPLE_smartBlocks(3, 0) == TEST_EXT_BLOCKS-65536);
+}
+static void TEST_smartUnits(void)
+{
+	const char *paths[6] = {0, 0, "BIG     PO ", 0, "TEST    PO "};
+	uint8_t *p;
+
+	TEST_d = RIG_blocks(TEST_EXT_BLOCKS);
+	p = TEST_d+(65536+2)*512;
+	memset(p, 0, 0x2b);
+	p[4] = 0xf4;						// the volume directory header
+	p[0x23] = 0x27;
+	p[0x24] = 0x0d;
+	IMAGE_new(IMAGE_FAT32, 64, 1);
+	RIG_ini(0, paths);
+	IMAGE_addFile(0, "BIG.PO", TEST_d, TEST_EXT_BLOCKS*512, 0);
+	IMAGE_addFile(0, "TEST.PO", TEST_d, 280*512, 0);
+	RIG_insert(1);
+	HAL_setIn(1, PIN2_bm, 0);			// the desktop mode
+	HAL_setIn(2, PIN3_bm, 0);
+	RIG_boot(TEST_smartUnitsTask);
+	free(TEST_d);
+}
+
+// ========== Disk II ==========
+
+// a DSK converted to NIC and the firmware with the task
+static void TEST_disk2(void (*task)(void))
+{
+	const char *paths[6] = {"TEST    DSK"};
+
+	TEST_d = RIG_blocks(280);
+	IMAGE_new(IMAGE_FAT16, 64, 0);
+	RIG_ini(0, paths);
+	IMAGE_addFile(0, "TEST.DSK", TEST_d, 280*512, 0);
+	RIG_insert(0);
+	RIG_boot(task);
+}
+
+// sectors read on RDR are as in the DSK
+static void TEST_disk2ReadTask(void)
+{
+	static const uint8_t tracks[] = {0, 17, 34};
+	uint8_t data[256];
+	uint8_t t, s;
+
+	APPLE_diskReady();
+	APPLE_diskOn(0);
+	for (t=0; t<sizeof(tracks); t++) {
+		APPLE_seek(tracks[t]);
+		for (s=0; s<16; s++) {
+			memset(data, 0, 256);
+			RIG_ASSERT(APPLE_readSector(s, data) == APPLE_OK);
+			RIG_ASSERT(!memcmp(data, TEST_d+(tracks[t]*16+s)*256, 256));
+		}
+	}
+	APPLE_diskOff();
+}
+static void TEST_disk2Read(void) { TEST_disk2(TEST_disk2ReadTask); free(TEST_d); }
+
+// sectors written on WREQ are read back, the others are kept
+static void TEST_disk2WriteTask(void)
+{
+	uint8_t data[256], w[256];
+	uint16_t i;
+
+	APPLE_diskReady();
+	APPLE_diskOn(0);
+	APPLE_seek(5);
+	for (i=0; i<256; i++) w[i] = i*13+1;
+	RIG_ASSERT(APPLE_writeSector(3, w) == APPLE_OK);
+	w[0] ^= 0xff;
+	RIG_ASSERT(APPLE_writeSector(4, w) == APPLE_OK);
+	RIG_ASSERT(APPLE_readSector(4, data) == APPLE_OK);
+	RIG_ASSERT(!memcmp(data, w, 256));
+	w[0] ^= 0xff;
+	RIG_ASSERT(APPLE_readSector(3, data) == APPLE_OK);
+	RIG_ASSERT(!memcmp(data, w, 256));
+	RIG_ASSERT(APPLE_readSector(5, data) == APPLE_OK);
+	RIG_ASSERT(!memcmp(data, TEST_d+(5*16+5)*256, 256));
+	APPLE_diskOff();
+}
+static void TEST_disk2Write(void) { TEST_disk2(TEST_disk2WriteTask); free(TEST_d); }
+
+// a data field with nibbles that are not 6-and-2 is written back as it is
+static void TEST_disk2WriteRawTask(void)
+{
+	uint8_t nib[343], data[343], w[256];
+	uint16_t i;
+
+	APPLE_diskReady();
+	APPLE_diskOn(0);
+	APPLE_seek(9);
+	for (i=0; i<256; i++) w[i] = i*7+3;
+	RIG_ASSERT(APPLE_writeSector(1, w) == APPLE_OK);
+	for (i=0; i<343; i++) nib[i] = 0x96+(i%0x69);
+	nib[0] = 0xaa;
+	nib[200] = 0xd5;
+	RIG_ASSERT(APPLE_writeNibbles(2, nib) == APPLE_OK);
+	RIG_ASSERT(APPLE_readNibbles(2, data) == APPLE_OK);
+	RIG_ASSERT(!memcmp(data, nib, 343));
+	// the packed one before it is kept
+	RIG_ASSERT(APPLE_readSector(1, data) == APPLE_OK);
+	RIG_ASSERT(!memcmp(data, w, 256));
+	APPLE_diskOff();
+}
+static void TEST_disk2WriteRaw(void) { TEST_disk2(TEST_disk2WriteRawTask); free(TEST_d); }
+
+// sectors written are read back from their slots as the disk turns, and written back when the drive stops
+static void TEST_disk2SlotTask(void)
+{
+	uint8_t data[256], w[256];
+	uint32_t writes;
+	uint16_t i;
+
+	APPLE_diskReady();
+	APPLE_diskOn(0);
+	APPLE_seek(7);
+	writes = SDCARD_stat.writeBlocks;
+	for (i=0; i<256; i++) w[i] = i*11+5;
+	RIG_ASSERT(APPLE_writeSector(6, w) == APPLE_OK);
+	w[0] ^= 0xff;
+	RIG_ASSERT(APPLE_writeSector(8, w) == APPLE_OK);
+	RIG_ASSERT(APPLE_readSector(8, data) == APPLE_OK);
+	RIG_ASSERT(!memcmp(data, w, 256));
+	w[0] ^= 0xff;
+	RIG_ASSERT(APPLE_readSector(6, data) == APPLE_OK);
+	RIG_ASSERT(!memcmp(data, w, 256));
+	RIG_ASSERT(SDCARD_stat.writeBlocks == writes);
+	APPLE_diskOff();
+	HAL_sleep(100*RIG_MS);
+	RIG_ASSERT(SDCARD_stat.writeBlocks >= writes+2);
+	APPLE_diskOn(0);
+	RIG_ASSERT(APPLE_readSector(6, data) == APPLE_OK);
+	RIG_ASSERT(!memcmp(data, w, 256));
+	APPLE_diskOff();
+}
+static void TEST_disk2Slot(void) { TEST_disk2(TEST_disk2SlotTask); free(TEST_d); }
+
+// ========== all ==========
+
+static const struct RIG_case TEST_cases[] = {
+	{"mountFat16", TEST_mountFat16},
+	{"mountFat32", TEST_mountFat32},
+	{"mountExfat", TEST_mountExfat},
+	{"exfatNames", TEST_exfatNames},
+	{"iniCreated", TEST_iniCreated},
+	{"nicCreated", TEST_nicCreated},
+	{"noCard", TEST_noCard},
+	{"idxList", TEST_idxList},
+	{"idxOff", TEST_idxOff},
+	{"idxCompact", TEST_idxCompact},
+	{"idxDrop", TEST_idxDrop},
+	{"smartRead", TEST_smartRead},
+	{"smartReadError", TEST_smartReadError},
+	{"smartExtended", TEST_smartExtended},
+	{"smartVolume", TEST_smartVolume},
+	{"smartUnits", TEST_smartUnits},
+	{"disk2Read", TEST_disk2Read},
+	{"disk2Write", TEST_disk2Write},
+	{"disk2WriteRaw", TEST_disk2WriteRaw},
+	{"disk2Slot", TEST_disk2Slot},
+	{0, 0}
+};
+
+int main(int argc, char *argv[])
+{
+	const struct RIG_case *t;
+	int failed = 0, n = 0;
+
+	setvbuf(stdout, 0, _IONBF, 0);
+	for (t=TEST_cases; t->name; t++) {
+		pid_t pid;
+		int st;
+
+		if ((argc > 1) && strcmp(argv[1], t->name)) continue;
+		n++;
+		pid = fork();
+		if (!pid) {
+			t->f();
+			exit(0);
+		}
+		waitpid(pid, &st, 0);
+		RIG_clean(pid);
+		if (WIFEXITED(st) && !WEXITSTATUS(st)) printf("ok   %s\n", t->name);
+		else {
+			printf("FAIL %s\n", t->name);
+			failed++;
+		}
+	}
+	printf("%d of %d passed\n", n-failed, n);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,37 @@
+﻿/*
+ * eeprom.h
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// the EEPROM of the host build, kept by HAL.c
+
+#ifndef HOST_EEPROM_H_
+#define HOST_EEPROM_H_
+
+#include <stdint.h>
+#include "HAL.h"
+
+#define EEMEM
+#define eeprom_busy_wait()
+#define eeprom_read_byte(a) HAL_eepromRead((uint16_t)(uintptr_t)(a))
+#define eeprom_write_byte(a, d) HAL_eepromWrite((uint16_t)(uintptr_t)(a), (d))
+#define eeprom_update_byte(a, d) HAL_eepromUpdate((uint16_t)(uintptr_t)(a), (d))
+
+#endif /* HOST_EEPROM_H_ */
@@ -0,0 +1,35 @@
+﻿/*
+ * interrupt.h
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// interrupts of the host build
+// an ISR is a plain function called by HAL.c when its flag is set and interrupts are enabled
+
+#ifndef HOST_INTERRUPT_H_
+#define HOST_INTERRUPT_H_
+
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void)
+#define cli() HAL_cli()
+#define sei() HAL_sei()
+
+#endif /* HOST_INTERRUPT_H_ */
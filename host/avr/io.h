@@ -0,0 +1,139 @@
+﻿/*
+ * io.h
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// the registers of the ATxmega32E5 used by UNISDISK, for the host build
+// plain registers are variables, the ones with side effects go through HAL.c
+
+#ifndef HOST_IO_H_
+#define HOST_IO_H_
+
+#include <stdint.h>
+#include "HAL.h"
+
+#define _BV(b) (1<<(b))
+#define bit_is_set(r,b) ((r)&_BV(b))
+#define _SFR_IO_ADDR(x) x
+
+typedef struct {
+	volatile uint8_t DIR, DIRSET, DIRCLR, OUT, OUTSET, OUTCLR, IN, INTCTRL, INTMASK, INTFLAGS;
+	volatile uint8_t PIN0CTRL, PIN1CTRL, PIN2CTRL, PIN3CTRL, PIN4CTRL, PIN5CTRL, PIN6CTRL, PIN7CTRL;
+} __attribute__((packed)) PORT_t;
+typedef struct {volatile uint8_t CTRL, INTCTRL, STATUS, DATA;} __attribute__((packed)) SPI_t;
+typedef struct {volatile uint8_t CTRLA, CTRLB, CTRLC, STATUS, BAUD, ADDR, DATA;} __attribute__((packed)) TWI_MASTER_t;
+typedef struct {TWI_MASTER_t MASTER;} __attribute__((packed)) TWI_t;
+typedef struct {
+	volatile uint8_t CTRLA, CTRLB, CTRLC, CTRLD, CTRLE, INTCTRLA, INTCTRLB, INTFLAGS;
+	volatile uint16_t PER, CNT, CCA;
+} __attribute__((packed)) TC_t;
+typedef struct {volatile uint8_t CTRL, STATUS;} __attribute__((packed)) PMIC_t;
+typedef struct {volatile uint8_t MPCMASK;} __attribute__((packed)) PORTCFG_t;
+typedef struct {volatile uint8_t CTRL, STATUS, DFLLCTRL;} __attribute__((packed)) OSC_t;
+typedef struct {volatile uint8_t CTRL, PSCTRL;} __attribute__((packed)) CLK_t;
+typedef struct {volatile uint8_t CTRL;} __attribute__((packed)) DFLL_t;
+
+extern PORT_t PORTA, PORTC, PORTD, PORTR;
+extern SPI_t SPIC;
+extern TWI_t TWIC;
+extern TC_t TCC4, TCC5, TCD5;
+extern PMIC_t PMIC;
+extern PORTCFG_t PORTCFG;
+extern OSC_t OSC;
+extern CLK_t CLK;
+extern DFLL_t DFLLRC32M;
+
+// SREG bit 7 is the global interrupt flag, see cli() and sei()
+extern volatile uint8_t SREG;
+extern volatile uint8_t CCP, NVM_LOCKBITS, GPIO0;
+extern volatile uint8_t SPIC_CTRL, SPIC_STATUS, PORTC_DIRSET, PORTC_PIN6CTRL, TCC5_INTFLAGS;
+extern volatile uint8_t VPORT2_OUT, VPORT2_INTFLAGS;
+
+// inputs are sampled from the model of the Apple II and the buttons
+#define VPORT0_IN HAL_in(0)
+#define VPORT1_IN HAL_in(1)
+#define VPORT2_IN HAL_in(2)
+// the chip select of the card is followed at once
+#define PORTC_OUTSET (*HAL_cs(1))
+#define PORTC_OUTCLR (*HAL_cs(0))
+
+enum {
+	PIN0_bm = 0x01, PIN1_bm = 0x02, PIN2_bm = 0x04, PIN3_bm = 0x08,
+	PIN4_bm = 0x10, PIN5_bm = 0x20, PIN6_bm = 0x40, PIN7_bm = 0x80,
+	PIN0_bp = 0, PIN2_bp = 2
+};
+
+#define SPI_IF_bm 0x80
+#define SPI_CLK2X_bm 0x80
+#define SPI_ENABLE_bm 0x40
+#define SPI_MASTER_bm 0x10
+#define SPI_MODE_0_gc 0x00
+#define SPI_PRESCALER_DIV4_gc 0x00
+#define SPI_PRESCALER_DIV16_gc 0x01
+#define SPI_PRESCALER_DIV64_gc 0x02
+#define SPI_PRESCALER_DIV128_gc 0x03
+
+#define PORT_OPC_PULLUP_gc 0x18
+#define PORT_INTLVL_LO_gc 0x01
+#define PORT_INTLVL_MED_gc 0x02
+#define PORT_ISC_BOTHEDGES_gc 0x00
+#define PORT_ISC_FALLING_gc 0x02
+
+#define TWI_MASTER_BUSSTATE_UNKNOWN_gc 0x00
+#define TWI_MASTER_BUSSTATE_IDLE_gc 0x01
+#define TWI_MASTER_ENABLE_bm 0x08
+#define TWI_MASTER_WIEN_bm 0x10
+#define TWI_MASTER_INTLVL_LO_gc 0x40
+#define TWI_MASTER_CMD_STOP_gc 0x03
+#define TWI_MASTER_RIF_bm 0x80
+#define TWI_MASTER_WIF_bm 0x40
+#define TWI_MASTER_RXACK_bm 0x10
+#define TWI_MASTER_ARBLOST_bm 0x08
+#define TWI_MASTER_BUSERR_bm 0x04
+#define CPU_I_bm 0x80
+
+#define TC4_OVFINTLVL0_bm 0x01
+#define TC5_OVFINTLVL0_bm 0x01
+#define TC4_CLKSEL0_bm 0x01
+#define TC5_CLKSEL0_bm 0x01
+#define TC5_CLKSEL1_bm 0x02
+#define TC5_CLKSEL2_bm 0x04
+#define TC5_OVFIF_bm 0x01
+
+#define PMIC_LOLVLEN_bm 0x01
+#define PMIC_MEDLVLEN_bm 0x02
+#define OSC_RC2MEN_bm 0x01
+#define OSC_RC32MEN_bm 0x02
+#define OSC_RC32KEN_bm 0x04
+#define OSC_XOSCEN_bm 0x08
+#define OSC_PLLEN_bm 0x10
+#define OSC_RC32MRDY_bm 0x02
+#define OSC_RC32KRDY_bm 0x04
+#define CLK_SCLKSEL_gm 0x07
+#define CLK_SCLKSEL_RC32M_gc 0x01
+#define CLK_PSADIV_gm 0x7c
+#define CLK_PSADIV_1_gc 0x00
+#define CLK_PSBCDIV_1_1_gc 0x00
+#define CLK_PSBCDIV0_bm 0x01
+#define CLK_PSBCDIV1_bm 0x02
+#define CCP_IOREG_gc 0xd8
+#define DFLL_ENABLE_bm 0x01
+
+#endif /* HOST_IO_H_ */
@@ -0,0 +1,33 @@
+﻿/*
+ * delay.h
+ *
+ * Created: 2026/10/19 07:30:57
+ */ 
+/*
+Copyright (C) 2013 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// busy waits spend simulated time
+
+#ifndef HOST_DELAY_H_
+#define HOST_DELAY_H_
+
+#include "HAL.h"
+
+#define _delay_ms(ms) HAL_wait((uint64_t)((ms)*1000000.0))
+#define _delay_us(us) HAL_wait((uint64_t)((us)*1000.0))
+
+#endif /* HOST_DELAY_H_ */